@@ -7,6 +7,7 @@ echo "Backup Selected:shell:nandroid-backup_openrecovery.sh" >> "$MENU_FILE"
 echo "Options:break:*" >> "$MENU_FILE"
 echo "Reboot when finished:tag:nand_bkp_autoreboot" >> "$MENU_FILE"
 echo "Compress backup:tag:nand_bkp_compress" >> "$MENU_FILE"
+echo "Incremental backup:tag:nand_bkp_incremental" >> "$MENU_FILE"
 echo "Partitions:break:*" >> "$MENU_FILE"
 echo "System:tag:nand_bkp_system" >> "$MENU_FILE"
 echo "Data:tag:nand_bkp_data" >> "$MENU_FILE"
@@ -4,6 +4,7 @@ NOTHING=1
 
 REBOOT=0
 COMPRESS=0
+INCREMENTAL=0
 
 BKP_BOOT=0
 BKP_BPSW=0
@@ -25,8 +26,8 @@ TAGPREFIX="/tags/."
 BACKUPPATH="/sdcard/nandroid/openrecovery"
 BACKUPPREFIX="OR-"
 
-#amount of space remaining
-FREEBLOCKS="`df -k /sdcard| grep sdcard | awk '{ print $4 }'`"
+#incremental backups keep their data in a store shared by all backups
+STOREPATH="/sdcard/nandroid/store"
 
 echo "+----------------------------------------------+"
 echo "+                                              +"
@@ -47,6 +48,10 @@ if [ -f "$TAGPREFIX"nand_bkp_compress ]; then
 	COMPRESS=1
 fi
 
+if [ -f "$TAGPREFIX"nand_bkp_incremental ]; then
+	INCREMENTAL=1
+fi
+
 if [ "$1" == "--all" ]; then
 	BKP_BOOT=1
 	BKP_BPSW=1
@@ -128,6 +133,13 @@ fi
 #===============================================================================
 
 #check availbility of the utilities
+nandroid=`which nandroid-or`
+if [ "$nandroid" == "" ]; then
+	echo "E:nandroid-or not found in path."
+	exit 1
+fi
+
+#nandroid-or runs it for the yaffs2 partitions
 mkyaffs2image=`which mkyaffs2image`
 if [ "$mkyaffs2image" == "" ]; then
 	mkyaffs2image=`which mkyaffs2image-or`
@@ -137,16 +149,13 @@ if [ "$mkyaffs2image" == "" ]; then
 	fi
 fi
 
-dump_image=`which dump_image`
-if [ "$dump_image" == "" ]; then
-	dump_image=`which dump_image-or`
-	if [ "$dump_image" == "" ]; then
-		echo "E:dump_image or dump_image-or not found in path."
-		exit 1
+if [ $INCREMENTAL -eq 1 ]; then
+	if [ $COMPRESS -eq 1 ]; then
+		echo "Incremental backup, compression will not be used."
+		COMPRESS=0
 	fi
 fi
 
-
 #check battery
 if [ "$COMPRESS" == 1 ]; then
 	ENERGY=`cat /sys/class/power_supply/battery/capacity`
@@ -163,15 +172,6 @@ fi
 # Check partitions and free space
 #===============================================================================
 
-#require at least 400 MiB to proceed
-if [ $FREEBLOCKS -le 409600 ]; then
-	echo "E:Not enough free space available on sdcard for backing up."
-	echo "Requires 400 MiB to proceed."
-	exit 1
-else
-	echo "There is at least 400 MiB on the sdcard."
-fi
-
 #build the prefix and check if the filesystem partitions are properly mounteable
 BACKUPLEGEND=""
 
@@ -261,6 +261,44 @@ if [ $BKP_EXT2 -eq 1 ]; then
 	fi
 fi
 
+PARTITIONS=""
+
+for image in boot bpsw lbl logo devtree system data cache cust cdrom ext2; do
+	case $image in
+		boot)    SELECTED=$BKP_BOOT ;;
+		bpsw)    SELECTED=$BKP_BPSW ;;
+		lbl)     SELECTED=$BKP_LBL ;;
+		logo)    SELECTED=$BKP_LOGO ;;
+		devtree) SELECTED=$BKP_DEVTREE ;;
+		system)  SELECTED=$BKP_SYSTEM ;;
+		data)    SELECTED=$BKP_DATA ;;
+		cache)   SELECTED=$BKP_CACHE ;;
+		cust)    SELECTED=$BKP_CUST ;;
+		cdrom)   SELECTED=$BKP_CDROM ;;
+		ext2)    SELECTED=$BKP_EXT2 ;;
+	esac
+	
+	if [ $SELECTED -eq 1 ]; then
+		PARTITIONS="$PARTITIONS $image"
+	else
+		echo "${image}: Skipping."
+	fi
+done
+
+NANDROIDFLAGS=""
+
+if [ $COMPRESS -eq 1 ]; then
+	NANDROIDFLAGS="-c"
+fi
+
+if [ $INCREMENTAL -eq 1 ]; then
+	NANDROIDFLAGS="-i $STOREPATH"
+fi
+
+#the space the selected partitions need, from their sizes and from what the
+#earlier backups measured
+$nandroid plan $NANDROIDFLAGS $BACKUPPATH $PARTITIONS || exit 1
+
 BACKUPLEGEND=$BACKUPLEGEND"-"
 TIMESTAMP="`date +%Y%m%d-%H%M`"
 DESTDIR="$BACKUPPATH/$BACKUPPREFIX$BACKUPLEGEND$TIMESTAMP"
@@ -276,141 +314,8 @@ fi
 echo "Backup directory:"
 echo "$DESTDIR"
 
-CWD=$PWD
-cd $DESTDIR
-
-#===============================================================================
-# Backup the non-filesystem partitions
-#===============================================================================
-
-for image in boot bpsw lbl logo devtree; do
-	case $image in
-		boot)
-			if [ $BKP_BOOT -eq 0 ]; then
-				echo "boot: Skipping."
-				continue
-			fi
-			;;
-			
-		bpsw)
-			if [ $BKP_BPSW -eq 0 ]; then
-				echo "bpsw: Skipping."
-				continue
-			fi
-			;;
-			
-		lbl)
-			if [ $BKP_LBL -eq 0 ]; then
-				echo "lbl: Skipping."
-				continue
-			fi
-			;;
-			
-		logo)
-			if [ $BKP_LOGO -eq 0 ]; then
-				echo "logo: Skipping."
-				continue
-			fi
-			;;
-			
-		devtree)
-			if [ $BKP_DEVTREE -eq 0 ]; then
-				echo "devtree: Skipping."
-				continue
-			fi
-			;;
-			
-	esac
-	
-	DEVICEMD5=`$dump_image $image - | md5sum | awk '{ print $1 }'`
-	sleep 1s
-	MD5RESULT=1
-	echo -n "${image}: Dumping..."
-	ATTEMPT=0
-	
-	while [ $MD5RESULT -eq 1 ]; do
-		let ATTEMPT=$ATTEMPT+1
-		$dump_image $image $DESTDIR/$image.img > /dev/null 2> /dev/null
-		sync
-		echo "${DEVICEMD5}  $DESTDIR/$image.img" | md5sum -c -s -
-		if [ $? -eq 1 ]; then
-			true
-		else
-			MD5RESULT=0
-		fi
-		
-		if [ "$ATTEMPT" == "5" ]; then
-			echo "failed"
-			echo "E:Fatal error while trying to dump $image, aborting."
-			exit 1
-		fi
-	done
-	
-	echo "done"
-	
-	#generate the md5 sum
-	echo -n "${image}: Generating MD5..."
-	md5sum $image.img > $image.md5
-	echo "done"
-	
-done
-
 #===============================================================================
-# Backup the yaffs2 filesystem partitions
-#===============================================================================
-
-for image in system data cache cust cdrom; do
-	case $image in
-		system)
-			if [ $BKP_SYSTEM -eq 0 ]; then
-				echo "system: Skipping."
-				continue
-			fi
-			;;
-		  
-		data)
-			if [ $BKP_DATA -eq 0 ]; then
-				echo "data: Skipping."
-				continue
-			fi
-			;;
-		  
-		cache)
-			if [ $BKP_CACHE -eq 0 ]; then
-				echo "cache: Skipping."
-				continue
-			fi
-			;;
-		
-		cust)
-			if [ $BKP_CUST -eq 0 ]; then
-				echo "cust: Skipping."
-				continue
-			fi
-			;;
-		
-		cdrom)
-			if [ $BKP_CDROM -eq 0 ]; then
-				echo "cdrom: Skipping."
-				continue
-			fi
-			;;    
-	esac
-	
-	echo -n "${image}: Dumping..."
-	$mkyaffs2image /$image $DESTDIR/$image.img > /dev/null 2> /dev/null
-	sync
-	echo "done"
-	
-	#generate the md5 sum
-	echo -n "${image}: Generating MD5..."
-	md5sum $image.img > $image.md5
-	echo "done"
-	
-done
-
-#===============================================================================
-# EXT2
+# Back up the partitions
 #===============================================================================
 
 if [ $BKP_EXT2 -eq 1 ]; then
@@ -419,48 +324,16 @@ if [ $BKP_EXT2 -eq 1 ]; then
 	e2fsck -fp /dev/block/mmcblk0p2 > /dev/null
 	echo "done"
 	mount /sddata
-	echo -n "ext2: Dumping..."
-	CW2=$PWD
-	cd /sddata
-	tar -cvf $DESTDIR/ext2.tar ./ > /dev/null
-	cd $CW2
-	echo "done"
-	
-	#generate the md5 sum
-	echo -n "ext2: Generating MD5..."
-	md5sum ext2.tar > ext2.md5
-	echo "done"
-else
-	echo "ext2: Skipping."
 fi
 
-
-#===============================================================================
-# Compression
-#===============================================================================
-
-if [ $COMPRESS -eq 1 ]; then
-	# we need about 70MiB for the intermediate storage needs
-	if [ $FREEBLOCKS -le 71680 ]; then
-		echo "E:Not enough free space available on sdcard for compression operation (need 70 MiB)."
-		echo "Leaving this backup uncompressed."
-		exit 1
-	else
-		echo -n "Compressing the backup, may take a bit of time, please wait..."
-		# we are already in $DESTDIR, start compression from the smallest files
-		# to maximize space for the largest's compression, less likely to fail.
-		# To decompress reverse the order.
-		bzip2 -6 `ls -S -r *.img` > /dev/null
-		bzip2 -6 `ls -S -r *.tar` > /dev/null
-		echo "done"
-	fi
-fi
+#each partition is read once and hashed, compressed or stored, and written
+#on the way; a few of them at a time
+$nandroid backup $NANDROIDFLAGS $DESTDIR $PARTITIONS || exit 1
 
 #===============================================================================
 # Exit
 #===============================================================================
 
-cd $CWD
 echo "Backing up finished."
 
 if [ $REBOOT -eq 1 ]; then
@@ -10,6 +10,15 @@ USER_ACTION=`imenu "Really delete ${BACKUP_NAME}?" No Yes`
 if [ $USER_ACTION -eq 2 ]; then
 	echo "Deleting ${BACKUP_NAME}..."
 	rm -fr "$1"
+	
+	#drop the data of incremental backups no other backup uses
+	STOREPATH="/sdcard/nandroid/store"
+	nandroid=`which nandroid-or`
+	if [ -d "$STOREPATH" ] && [ "$nandroid" != "" ]; then
+		echo "Cleaning up the backup store..."
+		shopt -s nullglob
+		$nandroid gc "$STOREPATH" /sdcard/nandroid/openrecovery/*/*.manifest
+	fi
 else
 	echo "Doing nothing."
 fi
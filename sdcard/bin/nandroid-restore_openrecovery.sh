@@ -125,24 +125,13 @@ fi
 #===============================================================================
 
 #check availbility of the utilities
-erase_image=`which erase_image`
-if [ "$erase_image" == "" ]; then
-	erase_image=`which erase_image-or`
-	if [ "$erase_image" == "" ]; then
-		echo "E:erase_image or erase_image-or not found in path."
-		exit 1
-	fi
-fi
-
-flash_image=`which flash_image`
-if [ "$flash_image" == "" ]; then
-	flash_image=`which flash_image-or`
-	if [ "$flash_image" == "" ]; then
-		echo "E:flash_image or flash_image-or not found in path."
-		exit 1
-	fi
+nandroid=`which nandroid-or`
+if [ "$nandroid" == "" ]; then
+	echo "E:nandroid-or not found in path."
+	exit 1
 fi
 
+#nandroid-or runs it for the yaffs2 partitions
 unyaffs=`which unyaffs`
 if [ "$unyaffs" == "" ]; then
 	unyaffs=`which unyaffs-or`
@@ -152,6 +141,9 @@ if [ "$unyaffs" == "" ]; then
 	fi
 fi
 
+#incremental backups keep their data in a store shared by all backups
+STOREPATH="/sdcard/nandroid/store"
+
 
 #check battery
 if [ "$COMPRESS" == 1 ]; then
@@ -166,366 +158,141 @@ if [ "$COMPRESS" == 1 ]; then
 fi
 
 #===============================================================================
-# Check compression
+# Check the format
+#
+# The images are decompressed or reassembled from the store on the fly and
+# checked against their MD5 (or the old format's nandroid.md5), so no extra
+# space is needed.  nandroid-or checks an image before it erases the partition,
+# so a bad backup leaves the partition as it was.
 #===============================================================================
 
-COMPRESSED=0
-
 CWD=$PWD
 cd "$RESTOREPATH"
 
 if [ `ls *.bz2 2>/dev/null|wc -l` -ge 1 ]; then
 	echo "This backup is compressed."
-	COMPRESSED=1
-	
-	if [ $FREEBLOCKS -le 262144 ]; then
-		echo "E:Not enough free space available on sdcard for decompression operation (need 256 MiB)."
-		cd $CWD
-		exit 1
-	else
-		echo "There is at least 256 MiB on the sdcard."
-	fi
 fi
 
-#===============================================================================
-# Check the format (either nandroid.md5 exists or not)
-# If it doesn't exist, think of it to be the Open Recovery Backup type
-# and fail later when attempting to restore the partition.
-#
-# If old format, verify checksums now
-# If mixed format, give priority to the old format
-#===============================================================================
+if [ `ls *.manifest 2>/dev/null|wc -l` -ge 1 ]; then
+	echo "This backup is incremental."
+fi
 
-if [ ! -f nandroid.md5 ]; then
-	OPEN_RCVR_BKP=1
-else
-	OPEN_RCVR_BKP=0	
+if [ -f nandroid.md5 ]; then
 	echo "NOTE: This backup is in old format."
-	echo "Verifying MD5..."
-	
-	md5sum -c nandroid.md5
-	if [ $? -eq 1 ]; then
-		echo "E:Failed verifying checksums."
-		exit 1
-	fi	
 fi
 
+#true if the backup has an image of the partition in any of its formats
+backed_up()
+{
+	[ -f $1.img ] || [ -f $1.img.bz2 ] || [ -f $1.tar ] || [ -f $1.tar.bz2 ] || [ -f $1.manifest ]
+}
+
 #===============================================================================
-# Restore the non-filesystem partitions
+# Choose and prepare the partitions
 #===============================================================================
 
-for image in boot bpsw lbl logo devtree; do
-	if [ ! -f $image.img* ]; then
+PARTITIONS=""
+
+for image in boot bpsw lbl logo devtree system data cache cust cdrom ext2; do
+	case $image in
+		boot)    SELECTED=$REST_BOOT ;;
+		bpsw)    SELECTED=$REST_BPSW ;;
+		lbl)     SELECTED=$REST_LBL ;;
+		logo)    SELECTED=$REST_LOGO ;;
+		devtree) SELECTED=$REST_DEVTREE ;;
+		system)  SELECTED=$REST_SYSTEM ;;
+		data)    SELECTED=$REST_DATA ;;
+		cache)   SELECTED=$REST_CACHE ;;
+		cust)    SELECTED=$REST_CUST ;;
+		cdrom)   SELECTED=$REST_CDROM ;;
+		ext2)    SELECTED=$REST_EXT2 ;;
+	esac
+	
+	if ! backed_up $image; then
 		echo "${image}: Not backed up."
 		continue
 	fi
 	
+	if [ $SELECTED -eq 0 ]; then
+		echo "${image}: Skipping."
+		continue
+	fi
+	
 	case $image in
-		boot)
-			if [ $REST_BOOT -eq 0 ]; then
-				echo "boot: Skipping."
-				continue
-			fi
-			;;
-			
-		bpsw)
-			if [ $REST_BPSW -eq 0 ]; then
-				echo "bpsw: Skipping."
-				continue
-			fi
-			;;
+		system|data|cache|cust|cdrom)
+			umount /$image 2> /dev/null
+			mount /$image 2> /dev/null
 			
-		lbl)
-			if [ $REST_LBL -eq 0 ]; then
-				echo "lbl: Skipping."
+			if [ $? -ne 0 ]; then
+				echo "E:Cannot mount properly /$image."
+				echo "${image}: Cannot restore."
+				ERROR="${ERROR}${image}: Failed to mount.\n"
 				continue
 			fi
 			;;
 			
-		logo)
-			if [ $REST_LOGO -eq 0 ]; then
-				echo "logo: Skipping."
-				continue
-			fi
-			;;
-			
-		devtree)
-			if [ $REST_DEVTREE -eq 0 ]; then
-				echo "devtree: Skipping."
+		ext2)
+			if [ ! -d /sddata ]; then
+				echo "E: ext2 partition does not exist"
+				echo "ext2: Cannot restore."
+				ERROR="${ERROR}ext2: Attempted to restore non-existing partition.\n"
 				continue
 			fi
 			;;
 	esac
 	
-	if [ $OPEN_RCVR_BKP -eq 1 ]; then  
-	
-		if [ $COMPRESSED -eq 1 ]; then
-			echo -n "${image}: Decompressing..."
-			bunzip2 -c $image.img.bz2 > $image.img
-			echo "done"
-		fi
-		
-		if [ ! -f $image.md5 ]; then
-			echo "${image}: MD5 checksum file missing, skipping."
-			
-			if [ $COMPRESSED -eq 1 ]; then
-				#delete the uncompressed part
-				rm $image.img
-			fi
-			
-			ERROR="${ERROR}${image}: MD5 checksum file missing.\n"		
-			continue
-		fi
-		
-		echo -n "${image}: Verifying MD5..."  	
-		md5sum -c $image.md5 > /dev/null
-		
-		if [ $? -eq 1 ]; then
-			echo "failed"
-			echo "${image}: MD5 checksum mismatch, skipping."
-			
-			if [ $COMPRESSED -eq 1 ]; then
-				#delete the uncompressed part
-				rm $image.img
-			fi
-			
-			ERROR="${ERROR}${image}: MD5 checksum mismatch.\n"
-			continue
-		fi
-		
-		echo "done"
-	fi
+	PARTITIONS="$PARTITIONS $image"
+done
+
+#keep the persistent data of the current system across the restore
+if [ -d /system/persistent ] && echo "$PARTITIONS" | grep -q system; then
+	echo -n "system: Backing up persistent data..."
 	
-	echo -n "${image}: Restoring..."
-	$flash_image $image $image.img > /dev/null 2> /dev/null
-	echo "done"
+	mkdir /system_persistent > /dev/null
+	cp -a /system/persistent /system_persistent > /dev/null
 	
-	if [ $COMPRESSED -eq 1 ]; then
-		#delete the uncompressed part
-		rm $image.img
+	#check .sh tag
+	if [ -f /system/persistent/.persistent_sh ]; then
+		cp -a /system/bin/sh /system_persistent/sh > /dev/null
 	fi
 	
-done
+	echo "done"
+fi
 
 #===============================================================================
-# Restore the yaffs2 filesystem partitions
+# Restore
 #===============================================================================
 
-for image in system data cache cust cdrom; do
-	if [ ! -f $image.img* ]; then
-		echo "${image}: Not backed up."
-		continue
-	fi
-	
-	case $image in
-		system)
-			if [ $REST_SYSTEM -eq 0 ]; then
-				echo "system: Skipping."
-				continue
-			fi
-		  ;;
-	    
-		data)
-			if [ $REST_DATA -eq 0 ]; then
-				echo "data: Skipping."
-				continue
-			fi
-			;;
-	    
-		cache)
-			if [ $REST_CACHE -eq 0 ]; then
-				echo "cache: Skipping."
-				continue
-			fi
-			;;
-	
-		cust)
-			if [ $REST_CUST -eq 0 ]; then
-				echo "cust: Skipping ."
-				continue
-			fi
-			;;
-	
-		cdrom)
-			if [ $REST_CDROM -eq 0 ]; then
-				echo "cdrom: Skipping."
-				continue
-			fi
-			;;
-	esac
-	
-	umount /$image 2> /dev/null
-	mount /$image 2> /dev/null
+#the raw and the yaffs2 partitions are restored side by side, each image is
+#read once and checked while it is written; the yaffs2 partitions and ext2 are
+#erased (ext2 with mkfs.ext2 -c) only once their image has been found
+if [ "$PARTITIONS" != "" ]; then
+	$nandroid restore -s $STOREPATH "$RESTOREPATH" $PARTITIONS
 	
 	if [ $? -ne 0 ]; then
-		echo "E:Cannot mount properly /$image."
-		echo "${image}: Cannot restore."
-		ERROR="${ERROR}${image}: Failed to mount.\n"
-		continue
-	fi
-	
-	if [ $OPEN_RCVR_BKP -eq 1 ]; then  
-	
-		if [ $COMPRESSED -eq 1 ]; then
-			echo -n "${image}: Decompressing..."
-			bunzip2 -c $image.img.bz2 > $image.img
-			echo "done"
-		fi
-		
-		if [ ! -f $image.md5 ]; then
-			echo "${image}: MD5 checksum file missing, skipping."
-			
-			if [ $COMPRESSED -eq 1 ]; then
-				#delete the uncompressed part
-				rm $image.img
-			fi
-			
-			ERROR="${ERROR}${image}: MD5 checksum file missing.\n"		
-			continue
-		fi
-		
-		echo -n "${image}: Verifying MD5..."  	
-		md5sum -c $image.md5 > /dev/null
-		
-		if [ $? -eq 1 ]; then
-			echo "failed"
-			echo "${image}: MD5 checksum mismatch, skipping."
-			
-			if [ $COMPRESSED -eq 1 ]; then
-				#delete the uncompressed part
-				rm $image.img
-			fi
-			
-			ERROR="${ERROR}${image}: MD5 checksum mismatch.\n"
-			continue
-		fi
-		
-		echo "done"
+		ERROR="${ERROR}Some partitions were not restored, see above.\n"
 	fi
+fi
+
+if [ -d /system_persistent ]; then
+	echo -n "system: Restoring persistent data..."
+	mount /system 2> /dev/null
 	
-	if [ "$image" == "system" ]; then
-		if [ -d /system/persistent ]; then
-			echo -n "${image}: Backing up persistent data..."
-			
-			mkdir /system_persistent > /dev/null
-			cp -a /system/persistent /system_persistent > /dev/null
-			
-			#check .sh tag
-			if [ -f /system/persistent/.persistent_sh ]; then
-				cp -a /system/bin/sh /system_persistent/sh > /dev/null
-			fi
-			
-			echo "done"
-		fi
+	if [ -d /system/persistent ]; then
+		rm -r /system/persistent > /dev/null
 	fi
 	
-	umount /$image 2> /dev/null
-	echo -n "${image}: Erasing..."
+	cp -a /system_persistent/persistent /system > /dev/null
 	
-	if [ "$image" == "data" ]; then
-		my_image="userdata"
-	else
-		my_image=$image	
+	#check .sh tag (can be checked in the copied one)
+	if [ -f /system_persistent/persistent/.persistent_sh ]; then
+		rm /system/bin/sh > /dev/null
+		cp -a /system_persistent/sh /system/bin/sh  > /dev/null
 	fi
-		
-	$erase_image $my_image > /dev/null 2> /dev/null
-	echo "done"
-	mount /$image
-	echo -n "${image}: Restoring..."
-	$unyaffs $image.img /$image	> /dev/null 2> /dev/null
-	echo "done"
 	
-	if [ "$image" == "system" ]; then
-		if [ -d /system_persistent ]; then
-			echo -n "${image}: Restoring persistent data..."
-			
-			if [ -d /system/persistent ]; then
-				rm -r /system/persistent > /dev/null
-			fi
-			
-			cp -a /system_persistent/persistent /system > /dev/null
-			
-			#check .sh tag (can be checked in the copied one)
-			if [ -f /system_persistent/persistent/.persistent_sh ]; then
-				rm /system/bin/sh > /dev/null
-				cp -a /system_persistent/sh /system/bin/sh  > /dev/null
-			fi
-			
-			rm -r /system_persistent > /dev/null
-			
-			echo "done"
-		fi
-	fi
+	rm -r /system_persistent > /dev/null
 	
-	if [ $COMPRESSED -eq 1 ]; then
-		#delete the uncompressed part
-		rm $image.img
-	fi
-	
-done
-
-#===============================================================================
-# EXT2
-#===============================================================================
-
-if [ ! -f ext2.tar ]; then
-	echo "ext2: Not backed up."
-else 
-	if [ $REST_EXT2 -eq 0 ]; then
-		echo "ext2: Skipping."
-	elif [ ! -d /sddata ]; then
-		echo "E: ext2 partition does not exist"
-		echo "ext2: Cannot restore."
-		ERROR="${ERROR}ext2: Attempted to restore non-existing partition.\n"
-	else	
-		if [ ! -f ext2.md5 ]; then
-			echo "Partition ext2 checksum file missing, skipping."		
-			
-			if [ $COMPRESSED -eq 1 ]; then
-				#delete the uncompressed part
-				rm ext2.tar
-			fi
-			
-			ERROR="${ERROR}ext2: MD5 checksum file missing.\n"
-			
-		else
-					
-			echo -n "ext2: Verifying MD5..."
-			md5sum -c ext2.md5 > /dev/null
-			
-			if [ $? -eq 1 ]; then
-				echo "failed"
-				echo "Partition ext2 checksum mismatch, skipping."
-				
-				if [ $COMPRESSED -eq 1 ]; then
-					#delete the uncompressed part
-					rm ext2.tar
-				fi
-				
-				ERROR="${ERROR}ext2: MD5 checksum mismatch.\n"
-				
-			else
-				echo "done"
-				echo -n "ext2: Erasing..."
-				umount /sddata 2> /dev/null
-				mkfs.ext2 -c /dev/block/mmcblk0p2 > /dev/null
-				echo "done"
-				
-				echo -n "ext2: Restoring..."
-				mount /sddata
-				CW2=$PWD
-				cd /sddata
-				tar -xvf $RESTOREPATH/ext2.tar ./ > /dev/null
-				cd "$CW2"
-				echo "done"
-				
-				if [ $COMPRESSED -eq 1 ]; then
-					#delete the uncompressed part
-					rm ext2.tar
-				fi
-			fi
-		fi
-	fi
+	echo "done"
 fi
 
 #===============================================================================
@@ -1,5 +1,15 @@
 #!/sbin/bash
 
+#keep the images the recovery has converted for the current theme,
+#so that it doesn't have to decode them again next time
+if [ -f /etc/theme ]; then
+	OLD_THEME=`awk 'NR==1' /etc/theme`
+	
+	if [ -d /sdcard/OpenRecovery/$OLD_THEME/images ]; then
+		cp -f /res/images/*.sfc /sdcard/OpenRecovery/$OLD_THEME/images/ 2>/dev/null
+	fi
+fi
+
 echo "$1" > /etc/theme
 echo "$1" > /sdcard/OpenRecovery/etc/theme
 
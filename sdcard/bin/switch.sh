@@ -158,6 +158,10 @@ chmod 0755 /sbin/unyaffs-or
 ln -s /sbin/unyaffs-or /sbin/unyaffs
 chmod 0755 unyaffs
 
+#nandroid backup engine
+cp -f /sdcard/OpenRecovery/sbin/nandroid-or /sbin/nandroid-or
+chmod 0755 /sbin/nandroid-or
+
 #Updater
 cp -f /sdcard/OpenRecovery/sbin/updater-or /sbin/updater-or
 chmod 0755 /sbin/updater-or
@@ -286,6 +286,7 @@ include $(commands_recovery_local_path)/btsh/Android.mk
 include $(commands_recovery_local_path)/minui/Android.mk
 include $(commands_recovery_local_path)/minzip/Android.mk
 include $(commands_recovery_local_path)/mtdutils/Android.mk
+include $(commands_recovery_local_path)/nandroid/Android.mk
 include $(commands_recovery_local_path)/yaffs2-utils/Android.mk
 include $(commands_recovery_local_path)/tools/Android.mk
 include $(commands_recovery_local_path)/edify/Android.mk
@@ -298,3 +299,34 @@ commands_recovery_local_path :=
 endif   # TARGET_ARCH == arm
 endif	# !TARGET_SIMULATOR
 
+
+#OPEN RECOVERY UI ON THE HOST (headless minui, see uibench.c)
+#=========================================================================================================================
+ifeq ($(HOST_OS),linux)
+
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	uibench.c \
+	ui.c \
+	minui/graphics.c \
+	minui/events.c \
+	minui/resources.c
+
+LOCAL_C_INCLUDES +=\
+	external/libpng\
+	external/zlib
+
+RECOVERY_API_VERSION := 2
+LOCAL_CFLAGS := -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION) -DOPEN_RCVR_SHOLS
+
+LOCAL_MODULE := uibench_orcvr
+LOCAL_MODULE_TAGS := eng
+
+LOCAL_STATIC_LIBRARIES := libpixelflinger_static libpng libz
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+endif	# HOST_OS == linux
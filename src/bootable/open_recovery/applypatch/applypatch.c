@@ -27,6 +27,7 @@
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "imgdiff.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
@@ -292,20 +293,23 @@ int SaveFileContents(const char* filename, FileContents file) {
     return 0;
 }
 
-// Write a memory buffer to target_mtd partition, a string of the form
-// "MTD:<partition>[:...]".  Return 0 on success.
-int WriteToMTDPartition(unsigned char* data, size_t len,
-                        const char* target_mtd) {
-    char* partition = strchr(target_mtd, ':');
-    if (partition == NULL) {
+// Open the partition named by target_mtd, a string of the form
+// "MTD:<partition>[:...]", for writing.  On success the bare partition
+// name is returned (newly allocated) in *partition.  Return NULL on
+// failure.
+static MtdWriteContext* OpenMTDTarget(const char* target_mtd,
+                                      char** partition) {
+    *partition = NULL;
+    char* name = strchr(target_mtd, ':');
+    if (name == NULL) {
         printf("bad MTD target name \"%s\"\n", target_mtd);
-        return -1;
+        return NULL;
     }
-    ++partition;
+    ++name;
     // Trim off anything after a colon, eg "MTD:boot:blah:blah:blah...".
     // We want just the partition name "boot".
-    partition = strdup(partition);
-    char* end = strchr(partition, ':');
+    name = strdup(name);
+    char* end = strchr(name, ':');
     if (end != NULL)
         *end = '\0';
 
@@ -314,40 +318,60 @@ int WriteToMTDPartition(unsigned char* data, size_t len,
         mtd_partitions_scanned = 1;
     }
 
-    const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+    const MtdPartition* mtd = mtd_find_partition_by_name(name);
     if (mtd == NULL) {
-        printf("mtd partition \"%s\" not found for writing\n", partition);
-        return -1;
+        printf("mtd partition \"%s\" not found for writing\n", name);
+        free(name);
+        return NULL;
     }
 
     MtdWriteContext* ctx = mtd_write_partition(mtd);
     if (ctx == NULL) {
-        printf("failed to init mtd partition \"%s\" for writing\n",
-               partition);
-        return -1;
+        printf("failed to init mtd partition \"%s\" for writing\n", name);
+        free(name);
+        return NULL;
     }
 
-    size_t written = mtd_write_data(ctx, (char*)data, len);
-    if (written != len) {
-        printf("only wrote %d of %d bytes to MTD %s\n",
-               written, len, partition);
-        mtd_write_close(ctx);
-        return -1;
-    }
+    *partition = name;
+    return ctx;
+}
 
+// Flush and close a write started by OpenMTDTarget(), erasing the rest
+// of the partition.  Always frees partition.  Return 0 on success.
+static int FinishMTDWrite(MtdWriteContext* ctx, char* partition) {
+    int result = 0;
     if (mtd_erase_blocks(ctx, -1) < 0) {
         printf("error finishing mtd write of %s\n", partition);
-        mtd_write_close(ctx);
-        return -1;
+        result = -1;
     }
-
     if (mtd_write_close(ctx)) {
         printf("error closing mtd write of %s\n", partition);
+        result = -1;
+    }
+    free(partition);
+    return result;
+}
+
+// Write a memory buffer to target_mtd partition, a string of the form
+// "MTD:<partition>[:...]".  Return 0 on success.
+int WriteToMTDPartition(unsigned char* data, size_t len,
+                        const char* target_mtd) {
+    char* partition;
+    MtdWriteContext* ctx = OpenMTDTarget(target_mtd, &partition);
+    if (ctx == NULL) {
         return -1;
     }
 
-    free(partition);
-    return 0;
+    size_t written = mtd_write_data(ctx, (char*)data, len);
+    if (written != len) {
+        printf("only wrote %d of %d bytes to MTD %s\n",
+               written, len, partition);
+        mtd_write_close(ctx);
+        free(partition);
+        return -1;
+    }
+
+    return FinishMTDWrite(ctx, partition);
 }
 
 
@@ -475,6 +499,28 @@ ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
     return len;
 }
 
+// Sink that writes patched output straight to an MTD partition.
+// mtd_write_data() gathers the output into erase-block sized pieces,
+// so only one block (rather than the whole image) is held in memory.
+typedef struct {
+    MtdWriteContext* ctx;
+    ssize_t size;                 // expected size of the output
+    ssize_t pos;
+} MtdSinkInfo;
+
+ssize_t MtdSink(unsigned char* data, ssize_t len, void* token) {
+    MtdSinkInfo* msi = (MtdSinkInfo*)token;
+    if (msi->size - msi->pos < len) {
+        return -1;
+    }
+    ssize_t wrote = mtd_write_data(msi->ctx, (char*)data, len);
+    if (wrote != len) {
+        return -1;
+    }
+    msi->pos += len;
+    return len;
+}
+
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -602,7 +648,8 @@ int applypatch(const char* source_filename,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
+    MtdSinkInfo msi;
+    char* mtd_partition = NULL;
     FileContents* source_to_use;
     char* outname;
 
@@ -624,22 +671,24 @@ int applypatch(const char* source_filename,
         // file?
 
         if (strncmp(target_filename, "MTD:", 4) == 0) {
-            // If the target is an MTD partition, we're actually going to
-            // write the output to /tmp and then copy it to the partition.
-            // statfs() always returns 0 blocks free for /tmp, so instead
-            // we'll just assume that /tmp has enough space to hold the file.
-
-            // We still write the original source to cache, in case the MTD
-            // write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file.size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // If the target is an MTD partition, we write the output
+            // directly to the partition as it is produced, so there's no
+            // filesystem space to check.
+
+            // We write the original source to cache first, in case the MTD
+            // write is interrupted.  If we're already working from that
+            // copy, it's the only good source left; don't touch it.
+            if (source_patch_value != NULL) {
+                if (MakeFreeSpaceOnCache(source_file.size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    return 1;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
+                made_copy = 1;
             }
-            made_copy = 1;
             retry = 0;
         } else {
             int enough_space = 0;
@@ -704,16 +753,17 @@ int applypatch(const char* source_filename,
         output = -1;
         outname = NULL;
         if (strncmp(target_filename, "MTD:", 4) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
+            // We stream the decoded output directly to the partition.
+            // The source has already been saved to CACHE_TEMP_SOURCE,
+            // so if we're interrupted (or the output turns out to be
+            // wrong) the patch can be redone from that copy.
+            msi.ctx = OpenMTDTarget(target_filename, &mtd_partition);
+            if (msi.ctx == NULL) {
                 return 1;
             }
             msi.pos = 0;
             msi.size = target_size;
-            sink = MemorySink;
+            sink = MtdSink;
             token = &msi;
         } else {
             // We write the decoded output to "<tgt-file>.patch".
@@ -739,11 +789,14 @@ int applypatch(const char* source_filename,
         int result;
 
         if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
-            result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
+            (memcmp(header, "BSDIFF40", 8) == 0 ||
+             memcmp(header, BSDIFFZ1_MAGIC, 8) == 0)) {
+            result = ApplyBSDiffPatch(NULL,
+                                      source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
-                   memcmp(header, "IMGDIFF2", 8) == 0) {
+                   (memcmp(header, IMGDIFF2_MAGIC, 8) == 0 ||
+                    memcmp(header, IMGDIFF3_MAGIC, 8) == 0)) {
             result = ApplyImagePatch(source_to_use->data, source_to_use->size,
                                      patch, sink, token, &ctx);
         } else {
@@ -754,6 +807,14 @@ int applypatch(const char* source_filename,
         if (output >= 0) {
             fsync(output);
             close(output);
+        } else if (result != 0) {
+            // Don't erase the rest of a partition we failed to patch;
+            // just let go of it so the patch can be redone.
+            mtd_write_close(msi.ctx);
+            free(mtd_partition);
+        } else if (FinishMTDWrite(msi.ctx, mtd_partition) != 0) {
+            printf("write of patched data to %s failed\n", target_filename);
+            return 1;
         }
 
         if (result != 0) {
@@ -779,12 +840,8 @@ int applypatch(const char* source_filename,
     }
 
     if (output < 0) {
-        // Copy the temp file to the MTD partition.
-        if (WriteToMTDPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
+        // The patched data is already on the MTD partition.
+        printf("wrote %ld bytes to %s\n", (long)msi.pos, target_filename);
     } else {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
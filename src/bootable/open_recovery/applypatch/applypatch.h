@@ -58,26 +58,59 @@ int applypatch(const char* source_filename,
 int applypatch_check(const char* filename,
                      int num_patches,
                      char** const patch_sha1_str);
+int FindMatchingPatch(uint8_t* sha1, char** const patch_sha1_str,
+                      int num_patches);
 
 // Read a file into memory; store it and its associated metadata in
 // *file.  Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file);
 void FreeFileContents(FileContents* file);
 
-// bsdiff.c
+// bspatch.c
+
+// Decompressor memory and output buffers that can be reused across
+// many bsdiff patches (eg, the chunks of one IMGDIFF patch).
+typedef struct _PatchDecoder PatchDecoder;
+
+PatchDecoder* NewPatchDecoder();
+void FreePatchDecoder(PatchDecoder* pd);
+
 void ShowBSDiffLicense();
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+// pd may be NULL, in which case a temporary decoder is used.
+int ApplyBSDiffPatch(PatchDecoder* pd,
+                     const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx);
+// The caller owns (and must free) *new_data.
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
+// *new_data points into pd's output buffer, and is only valid until
+// the next call using pd.
+int DecodeBSDiffPatch(PatchDecoder* pd,
+                      const unsigned char* old_data, ssize_t old_size,
+                      const Value* patch, ssize_t patch_offset,
+                      const unsigned char** new_data, ssize_t* new_size);
 
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
                     SinkFn sink, void* token, SHA_CTX* ctx);
 
+// batchcheck.c
+
+// One file to verify in a batch: like the arguments of
+// applypatch_check().  'result' is filled in by the check (0 if the
+// file, or the cached copy of it, matches one of the sha1s).
+typedef struct {
+    const char* filename;
+    int num_sha1s;
+    char** sha1s;
+    int result;
+} CheckEntry;
+
+int applypatch_check_batch(CheckEntry* entries, int count, int threads);
+
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
 
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Batch Patch Check
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Batch version of applypatch_check(), for the pre-flight phase of an
+// incremental OTA.  Rather than loading each file into memory in turn,
+// a few worker threads stream the files through SHA-1 with a fixed-size
+// buffer each, so memory use is bounded no matter how large the files
+// are.  The CACHE_TEMP_SOURCE fallback is hashed at most once per batch
+// instead of once per mismatching file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mincrypt/sha.h"
+#include "applypatch.h"
+
+#define CHECK_BUFFER_SIZE  (64*1024)
+
+typedef struct {
+    CheckEntry* entries;
+    int count;
+
+    pthread_mutex_t lock;
+    int next;                    // next entry to hand out
+
+    // Separate from lock, so that hashing the cache file only holds up
+    // the workers that need it and not the handing out of entries.
+    pthread_mutex_t cache_lock;
+    int cache_state;             // 0: not hashed yet, 1: hashed, -1: missing
+    uint8_t cache_sha1[SHA_DIGEST_SIZE];
+} BatchState;
+
+// Compute the sha1 of a regular file without holding it in memory.
+// Return 0 on success.
+static int StreamSha1(const char* filename, unsigned char* buffer,
+                      uint8_t* digest) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buffer, CHECK_BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("failed to read \"%s\": %s\n", filename, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        SHA_update(&ctx, buffer, n);
+    }
+    close(fd);
+
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return 0;
+}
+
+static int MatchesAny(const uint8_t* digest, CheckEntry* e) {
+    return FindMatchingPatch((uint8_t*)digest, e->sha1s, e->num_sha1s) >= 0;
+}
+
+// Hash CACHE_TEMP_SOURCE the first time any file needs it.
+static int CacheMatches(BatchState* bs, CheckEntry* e, unsigned char* buffer) {
+    pthread_mutex_lock(&bs->cache_lock);
+    if (bs->cache_state == 0) {
+        bs->cache_state =
+            StreamSha1(CACHE_TEMP_SOURCE, buffer, bs->cache_sha1) == 0 ? 1 : -1;
+    }
+    int ok = bs->cache_state > 0 && MatchesAny(bs->cache_sha1, e);
+    pthread_mutex_unlock(&bs->cache_lock);
+    return ok;
+}
+
+static void CheckOne(BatchState* bs, CheckEntry* e, unsigned char* buffer) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+
+    // It's okay to specify no sha1s; the check passes if the file can
+    // be read at all.
+    if (StreamSha1(e->filename, buffer, digest) == 0 &&
+        (e->num_sha1s == 0 || MatchesAny(digest, e))) {
+        e->result = 0;
+        return;
+    }
+
+    // The file may be missing or corrupt because we were killed while
+    // patching it; in that case its source should be in the cache.
+    if (e->num_sha1s > 0 && CacheMatches(bs, e, buffer)) {
+        printf("\"%s\" doesn't match; using cached copy\n", e->filename);
+        e->result = 0;
+        return;
+    }
+
+    printf("file \"%s\" doesn't have any of expected sha1 sums\n",
+           e->filename);
+    e->result = 1;
+}
+
+static void* CheckThread(void* cookie) {
+    BatchState* bs = (BatchState*)cookie;
+    unsigned char* buffer = malloc(CHECK_BUFFER_SIZE);
+    if (buffer == NULL) return NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&bs->lock);
+        int i = bs->next;
+        // MTD partitions are left for applypatch_check() on the main
+        // thread: it scans the partition table into globals the first
+        // time it's needed, which mustn't happen on two threads at once.
+        // (Reading partitions in parallel once it's scanned is fine.)
+        while (i < bs->count &&
+               strncmp(bs->entries[i].filename, "MTD:", 4) == 0) {
+            ++i;
+        }
+        bs->next = i + 1;
+        pthread_mutex_unlock(&bs->lock);
+
+        if (i >= bs->count) break;
+        CheckOne(bs, bs->entries + i, buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Check every entry as applypatch_check() would, using up to
+// 'threads' worker threads, and store each outcome in entries[i].result
+// (0 for a match).  Return the number of entries that failed.
+int applypatch_check_batch(CheckEntry* entries, int count, int threads) {
+    BatchState bs;
+    memset(&bs, 0, sizeof(bs));
+    bs.entries = entries;
+    bs.count = count;
+    pthread_mutex_init(&bs.lock, NULL);
+    pthread_mutex_init(&bs.cache_lock, NULL);
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        entries[i].result = 1;
+    }
+
+    if (threads < 1) threads = 1;
+    if (threads > count) threads = count;
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(tids + started, NULL, CheckThread, &bs) == 0) {
+            ++started;
+        }
+    }
+    if (started == 0) {
+        // Couldn't start any threads; do the work ourselves.
+        CheckThread(&bs);
+    }
+
+    // The MTD partitions, while the workers do the files.
+    for (i = 0; i < count; ++i) {
+        if (strncmp(entries[i].filename, "MTD:", 4) == 0) {
+            entries[i].result = applypatch_check(entries[i].filename,
+                                                 entries[i].num_sha1s,
+                                                 entries[i].sha1s);
+        }
+    }
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    pthread_mutex_destroy(&bs.lock);
+    pthread_mutex_destroy(&bs.cache_lock);
+
+    int failed = 0;
+    for (i = 0; i < count; ++i) {
+        if (entries[i].result != 0) ++failed;
+    }
+
+    printf("checked %d files; %d failed\n", count, failed);
+    return failed;
+}
@@ -55,6 +55,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "zlib.h"
+#include "imgdiff.h"
+
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
 static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
@@ -210,6 +213,46 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+/* Compress len bytes of data onto pf with the given codec. */
+static void writeblock(FILE* pf, int codec, u_char* data, off_t len,
+		const char* patch_filename)
+{
+	BZFILE * pfbz2;
+	int bz2err;
+	z_stream strm;
+	u_char out[32768];
+	int ret;
+
+	if (codec == BSDIFF_CODEC_BZIP2) {
+		if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
+			errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+		BZ2_bzWrite(&bz2err, pfbz2, data, len);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+		BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+		return;
+	}
+
+	memset(&strm, 0, sizeof(strm));
+	if ((ret = deflateInit(&strm, 9)) != Z_OK)
+		errx(1, "deflateInit, ret = %d", ret);
+	strm.next_in = data;
+	strm.avail_in = len;
+	do {
+		strm.next_out = out;
+		strm.avail_out = sizeof(out);
+		ret = deflate(&strm, Z_FINISH);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			errx(1, "deflate, ret = %d", ret);
+		if (fwrite(out, 1, sizeof(out) - strm.avail_out, pf) !=
+		    sizeof(out) - strm.avail_out)
+			err(1, "fwrite(%s)", patch_filename);
+	} while (ret != Z_STREAM_END);
+	deflateEnd(&strm);
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
@@ -221,8 +264,12 @@ static void offtout(off_t x,u_char *buf)
 //      bsdiff() multiple times with the same 'old' data, we only do
 //      the qsufsort() step the first time.
 //
+//    - the control block is collected in memory, and all three blocks
+//      are compressed with 'codec': BSDIFF_CODEC_BZIP2 produces a
+//      standard BSDIFF40 patch, BSDIFF_CODEC_ZLIB a BSDIFFZ1 patch.
+//
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+           const char* patch_filename, int codec)
 {
 	int fd;
 	off_t *I;
@@ -232,13 +279,10 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	off_t s,Sf,lenf,Sb,lenb;
 	off_t overlap,Ss,lens;
 	off_t i;
-	off_t dblen,eblen;
-	u_char *db,*eb;
-	u_char buf[8];
+	off_t dblen,eblen,cblen,cbsize;
+	u_char *db,*eb,*cb;
 	u_char header[32];
 	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
 
         if (*IP == NULL) {
             off_t* V;
@@ -250,34 +294,34 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
         I = *IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
-		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
+		((eb=malloc(newsize+1))==NULL) ||
+		((cb=malloc(cbsize=4096))==NULL)) err(1,NULL);
 	dblen=0;
 	eblen=0;
+	cblen=0;
 
 	/* Create the patch file */
 	if ((pf = fopen(patch_filename, "w")) == NULL)
               err(1, "%s", patch_filename);
 
 	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
+		0	8	 "BSDIFF40" (or "BSDIFFZ1")
+		8	8	length of compressed ctrl block
+		16	8	length of compressed diff block
 		24	8	length of new file */
 	/* File is
 		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
+		32	??	Bzip2ed (or deflated) ctrl block
+		??	??	Bzip2ed (or deflated) diff block
+		??	??	Bzip2ed (or deflated) extra block */
+	memcpy(header, codec == BSDIFF_CODEC_ZLIB ? BSDIFFZ1_MAGIC : "BSDIFF40", 8);
 	offtout(0, header + 8);
 	offtout(0, header + 16);
 	offtout(newsize, header + 24);
 	if (fwrite(header, 32, 1, pf) != 1)
 		err(1, "fwrite(%s)", patch_filename);
 
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	/* Compute the differences, collecting ctrl as we go */
 	scan=0;len=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
@@ -340,29 +384,20 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			dblen+=lenf;
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			if(cblen+24>cbsize) {
+				if((cb=realloc(cb,cbsize*=2))==NULL) err(1,NULL);
+			};
+			offtout(lenf,cb+cblen);
+			offtout((scan-lenb)-(lastscan+lenf),cb+cblen+8);
+			offtout((pos-lenb)-(lastpos+lenf),cb+cblen+16);
+			cblen+=24;
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	writeblock(pf, codec, cb, cblen, patch_filename);
 
 	/* Compute size of compressed ctrl data */
 	if ((len = ftello(pf)) == -1)
@@ -370,14 +405,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(len-32, header + 8);
 
 	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	writeblock(pf, codec, db, dblen, patch_filename);
 
 	/* Compute size of compressed diff data */
 	if ((newsize = ftello(pf)) == -1)
@@ -385,14 +413,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(newsize - len, header + 16);
 
 	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	writeblock(pf, codec, eb, eblen, patch_filename);
 
 	/* Seek to the beginning, write the header, and close the file */
 	if (fseeko(pf, 0, SEEK_SET))
@@ -405,6 +426,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	/* Free the memory we used */
 	free(db);
 	free(eb);
+	free(cb);
 
 	return 0;
 }
@@ -24,12 +24,15 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <bzlib.h>
 
+#include "zlib.h"
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "imgdiff.h"
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -81,50 +84,323 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
-int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
-    stream->next_out = (char*)buffer;
-    stream->avail_out = size;
-    while (stream->avail_out > 0) {
-        int bzerr = BZ2_bzDecompress(stream);
-        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-            printf("bz error %d decompressing\n", bzerr);
-            return -1;
+// A PatchDecoder carries state across many calls to the bsdiff
+// decoder -- in practice, across the chunks of a single IMGDIFF patch,
+// which may contain hundreds of small bsdiff patches.
+//
+// bzip2 has no way to reset a decompressor, so each stream still has
+// to be torn down and set up again.  What we can recycle is the memory
+// behind it: BZ2_bzDecompressInit() and the first BZ2_bzDecompress()
+// call allocate the decoder state and the (multi-megabyte) block
+// tables, and the sizes of those allocations depend only on the block
+// size the stream was compressed with.  We hand bzip2 an allocator that
+// keeps freed blocks on a short free list, so after the first chunk
+// stream setup costs no malloc()s at all.
+//
+// zlib streams (used by BSDIFFZ1 patches) can be reset, so the decoder
+// simply keeps one inflater per block and calls inflateReset().
+//
+// The decoder also owns the output and control buffers, which are grown
+// as needed and kept for the next chunk.  When the output goes to a
+// sink, the output buffer only holds one window of it at a time.
+
+#define BZ_POOL_SLOTS 8
+
+// Bytes of new file decoded at a time when writing to a sink.
+#define OUTPUT_WINDOW (64*1024)
+
+typedef struct {
+    size_t size;
+    // keep the caller's memory aligned for anything bzip2 stores
+    long long align;
+} PoolHeader;
+
+struct _PatchDecoder {
+    void* pool[BZ_POOL_SLOTS];    // free blocks (each preceded by a PoolHeader)
+    int pool_count;
+
+    unsigned char* output;
+    ssize_t output_size;
+
+    unsigned char* ctrl;          // decompressed control block
+    ssize_t ctrl_size;
+
+    z_stream zstream[3];          // control, diff, extra
+    int zstream_ready[3];
+};
+
+// One of the three compressed blocks of the patch being decoded.
+typedef struct {
+    int codec;                    // BSDIFF_CODEC_BZIP2 or BSDIFF_CODEC_ZLIB
+    bz_stream bz;
+    z_stream* z;
+} BlockStream;
+
+static void* PoolAlloc(void* opaque, int items, int size) {
+    PatchDecoder* pd = (PatchDecoder*)opaque;
+    size_t want = (size_t)items * size;
+    int i;
+    for (i = 0; i < pd->pool_count; ++i) {
+        PoolHeader* h = (PoolHeader*)pd->pool[i];
+        if (h->size == want) {
+            pd->pool[i] = pd->pool[--pd->pool_count];
+            return h + 1;
         }
-        if (stream->avail_out > 0) {
-            printf("need %d more bytes\n", stream->avail_out);
+    }
+    PoolHeader* h = malloc(sizeof(PoolHeader) + want);
+    if (h == NULL) return NULL;
+    h->size = want;
+    return h + 1;
+}
+
+static void PoolFree(void* opaque, void* ptr) {
+    PatchDecoder* pd = (PatchDecoder*)opaque;
+    if (ptr == NULL) return;
+    PoolHeader* h = ((PoolHeader*)ptr) - 1;
+    if (pd->pool_count < BZ_POOL_SLOTS) {
+        pd->pool[pd->pool_count++] = h;
+    } else {
+        free(h);
+    }
+}
+
+PatchDecoder* NewPatchDecoder() {
+    PatchDecoder* pd = malloc(sizeof(PatchDecoder));
+    if (pd == NULL) return NULL;
+    memset(pd, 0, sizeof(PatchDecoder));
+    return pd;
+}
+
+void FreePatchDecoder(PatchDecoder* pd) {
+    if (pd == NULL) return;
+    int i;
+    for (i = 0; i < pd->pool_count; ++i) {
+        free(pd->pool[i]);
+    }
+    for (i = 0; i < 3; ++i) {
+        if (pd->zstream_ready[i]) inflateEnd(pd->zstream + i);
+    }
+    free(pd->output);
+    free(pd->ctrl);
+    free(pd);
+}
+
+// Make sure *buffer (currently *size bytes) can hold at least 'needed'
+// bytes.  Existing contents are not preserved.  Return 0 on success.
+static int GrowBuffer(unsigned char** buffer, ssize_t* size, ssize_t needed) {
+    if (*size >= needed && *buffer != NULL) return 0;
+    free(*buffer);
+    *buffer = malloc(needed > 0 ? needed : 1);
+    if (*buffer == NULL) {
+        *size = 0;
+        printf("failed to allocate %ld bytes of memory\n", (long)needed);
+        return -1;
+    }
+    *size = needed;
+    return 0;
+}
+
+static int InitStream(PatchDecoder* pd, BlockStream* stream, int codec,
+                      int which, char* data, ssize_t len, const char* name) {
+    stream->codec = codec;
+    if (codec == BSDIFF_CODEC_ZLIB) {
+        z_stream* z = pd->zstream + which;
+        int ret;
+        if (pd->zstream_ready[which]) {
+            ret = inflateReset(z);
+        } else {
+            memset(z, 0, sizeof(*z));
+            ret = inflateInit(z);
+            pd->zstream_ready[which] = (ret == Z_OK);
+        }
+        if (ret != Z_OK) {
+            printf("failed to init %s stream (%d)\n", name, ret);
+            return -1;
         }
+        z->next_in = (unsigned char*)data;
+        z->avail_in = len;
+        stream->z = z;
+        return 0;
+    }
+
+    bz_stream* bz = &stream->bz;
+    memset(bz, 0, sizeof(*bz));
+    bz->next_in = data;
+    bz->avail_in = len;
+    bz->bzalloc = PoolAlloc;
+    bz->bzfree = PoolFree;
+    bz->opaque = pd;
+    int bzerr = BZ2_bzDecompressInit(bz, 0, 0);
+    if (bzerr != BZ_OK) {
+        printf("failed to bzinit %s stream (%d)\n", name, bzerr);
+        return -1;
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+static void EndStream(BlockStream* stream) {
+    // zlib streams belong to the PatchDecoder, which resets them for
+    // the next patch.
+    if (stream->codec == BSDIFF_CODEC_BZIP2) {
+        BZ2_bzDecompressEnd(&stream->bz);
+    }
+}
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
+// Decompress into buffer until it is full or the stream ends; store
+// the number of bytes produced in *produced.  Return 1 if the end of
+// the stream was reached, 0 if the buffer was filled first, or -1 on
+// error.
+static int Decompress(BlockStream* stream, unsigned char* buffer,
+                      size_t size, size_t* produced) {
+    *produced = 0;
+    if (stream->codec == BSDIFF_CODEC_ZLIB) {
+        z_stream* z = stream->z;
+        z->next_out = buffer;
+        z->avail_out = size;
+        for (;;) {
+            int ret = inflate(z, Z_NO_FLUSH);
+            *produced = size - z->avail_out;
+            if (ret == Z_STREAM_END) return 1;
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                printf("zlib error %d decompressing\n", ret);
+                return -1;
+            }
+            if (z->avail_out == 0) return 0;
+            if (z->avail_in == 0) {
+                printf("compressed block truncated\n");
+                return -1;
+            }
+        }
+    }
+
+    bz_stream* bz = &stream->bz;
+    bz->next_out = (char*)buffer;
+    bz->avail_out = size;
+    for (;;) {
+        int bzerr = BZ2_bzDecompress(bz);
+        *produced = size - bz->avail_out;
+        if (bzerr == BZ_STREAM_END) return 1;
+        if (bzerr != BZ_OK) {
+            printf("bz error %d decompressing\n", bzerr);
+            return -1;
+        }
+        if (bz->avail_out == 0) return 0;
+        if (bz->avail_in == 0) {
+            printf("compressed block truncated\n");
+            return -1;
+        }
+    }
+}
+
+static int FillBuffer(unsigned char* buffer, int size, BlockStream* stream) {
+    size_t produced;
+    if (size == 0) return 0;
+    if (Decompress(stream, buffer, size, &produced) < 0) return -1;
+    if (produced < (size_t)size) {
+        printf("stream ended %ld bytes short\n", (long)(size - produced));
         return -1;
     }
+    return 0;
+}
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+// Decompress the entire control block into pd->ctrl in one go, rather
+// than pulling 24-byte records through the decompressor one at a time.
+// Returns the number of bytes decoded, or -1 on error.
+static ssize_t DecodeControlBlock(PatchDecoder* pd, BlockStream* stream) {
+    ssize_t have = 0;
+    if (pd->ctrl_size < 4096 &&
+        GrowBuffer(&pd->ctrl, &pd->ctrl_size, 4096) != 0) {
+        return -1;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+    for (;;) {
+        size_t produced;
+        int ret = Decompress(stream, pd->ctrl + have,
+                             pd->ctrl_size - have, &produced);
+        have += produced;
+        if (ret < 0) return -1;
+        if (ret > 0) break;
+
+        unsigned char* bigger = realloc(pd->ctrl, pd->ctrl_size * 2);
+        if (bigger == NULL) {
+            printf("failed to grow control buffer\n");
+            return -1;
+        }
+        pd->ctrl = bigger;
+        pd->ctrl_size *= 2;
     }
-    free(new_data);
+    return have;
+}
+
+// Where RunBSDiffPatch() puts the new file.
+typedef struct {
+    SinkFn sink;                  // NULL to keep all of it in pd->output
+    void* token;
+    SHA_CTX* ctx;
+    off_t newpos;
+} PatchOutput;
+
+// Decode the next len bytes of the new file from stream.  If add_old
+// is set, old_data from oldpos on is added to them (a diff string);
+// otherwise they are taken as they are (an extra string).  Return 0 on
+// success, -1 if the stream is bad, or 1 if the sink fails.
+static int DecodeSegment(PatchDecoder* pd, PatchOutput* o,
+                         BlockStream* stream, off_t len, int add_old,
+                         const unsigned char* old_data, ssize_t old_size,
+                         off_t oldpos) {
+    while (len > 0) {
+        unsigned char* out;
+        off_t n;
+        if (o->sink == NULL) {
+            out = pd->output + o->newpos;
+            n = len;
+        } else {
+            out = pd->output;
+            n = len < pd->output_size ? len : pd->output_size;
+        }
+
+        if (FillBuffer(out, n, stream) != 0) {
+            return -1;
+        }
+
+        if (add_old) {
+            // Add old data over the part of [oldpos, oldpos+n) that
+            // actually lies within the old file.
+            off_t i;
+            off_t lo = oldpos < 0 ? -oldpos : 0;
+            off_t hi = old_size - oldpos < n ? old_size - oldpos : n;
+            for (i = lo; i < hi; ++i) {
+                out[i] += old_data[oldpos+i];
+            }
+            oldpos += n;
+        }
+
+        if (o->sink != NULL) {
+            if (o->sink(out, n, o->token) < n) {
+                printf("short write of output: %d (%s)\n",
+                       errno, strerror(errno));
+                return 1;
+            }
+            if (o->ctx) {
+                SHA_update(o->ctx, out, n);
+            }
+        }
 
+        o->newpos += n;
+        len -= n;
+    }
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+// Apply a bsdiff patch.  If sink is NULL the whole new file is left in
+// pd->output; otherwise it is passed to sink (and hashed into ctx, if
+// given) a window at a time as it is decoded.  Return 0 on success.
+static int RunBSDiffPatch(PatchDecoder* pd,
+                          const unsigned char* old_data, ssize_t old_size,
+                          const Value* patch, ssize_t patch_offset,
+                          ssize_t* new_size,
+                          SinkFn sink, void* token, SHA_CTX* ctx) {
     // Patch data format:
-    //   0       8       "BSDIFF40"
+    //   0       8       "BSDIFF40" or "BSDIFFZ1"
     //   8       8       X
     //   16      8       Y
     //   24      8       sizeof(newfile)
@@ -134,9 +410,22 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // with control block a set of triples (x,y,z) meaning "add x bytes
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
+    //
+    // BSDIFFZ1 patches are identical except that the three blocks are
+    // zlib streams instead of bzip2 streams.
+
+    if (patch_offset + 32 > patch->size) {
+        printf("patch too short to contain bsdiff header\n");
+        return 1;
+    }
 
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+    int codec;
+    if (memcmp(header, "BSDIFF40", 8) == 0) {
+        codec = BSDIFF_CODEC_BZIP2;
+    } else if (memcmp(header, BSDIFFZ1_MAGIC, 8) == 0) {
+        codec = BSDIFF_CODEC_ZLIB;
+    } else {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
@@ -146,107 +435,152 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     data_len = offtin(header+16);
     *new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (ctrl_len < 0 || data_len < 0 || *new_size < 0 ||
+        patch_offset + 32 + ctrl_len + data_len > patch->size) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
 
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+    ssize_t want = *new_size;
+    if (sink != NULL && want > OUTPUT_WINDOW) {
+        want = OUTPUT_WINDOW;
     }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+    if (GrowBuffer(&pd->output, &pd->output_size, want) != 0) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)want);
+        return 1;
     }
+    PatchOutput output = { sink, token, ctx, 0 };
+
+    int result = 1;
+    int streams = 0;
+    BlockStream cstream, dstream, estream;
+    char* base = patch->data + patch_offset + 32;
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    if (InitStream(pd, &cstream, codec, 0, base, ctrl_len, "control") != 0) {
+        goto done;
     }
+    ++streams;
+    if (InitStream(pd, &dstream, codec, 1, base + ctrl_len, data_len,
+                   "diff") != 0) {
+        goto done;
+    }
+    ++streams;
+    if (InitStream(pd, &estream, codec, 2, base + ctrl_len + data_len,
+                   patch->size - (patch_offset + 32 + ctrl_len + data_len),
+                   "extra") != 0) {
+        goto done;
+    }
+    ++streams;
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
+    ssize_t ctrl_avail = DecodeControlBlock(pd, &cstream);
+    if (ctrl_avail < 0) {
+        printf("error while reading control stream\n");
+        goto done;
     }
+    const unsigned char* cp = pd->ctrl;
 
-    off_t oldpos = 0, newpos = 0;
+    off_t oldpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
-    unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (output.newpos < *new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ctrl_avail < 24) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
-        ctrl[0] = offtin(buf);
-        ctrl[1] = offtin(buf+8);
-        ctrl[2] = offtin(buf+16);
+        ctrl[0] = offtin((u_char*)cp);
+        ctrl[1] = offtin((u_char*)cp+8);
+        ctrl[2] = offtin((u_char*)cp+16);
+        cp += 24;
+        ctrl_avail -= 24;
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            output.newpos + ctrl[0] > *new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
-
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
-            }
+        // Read diff string and add old data to it
+        int ret = DecodeSegment(pd, &output, &dstream, ctrl[0], 1,
+                                old_data, old_size, oldpos);
+        if (ret != 0) {
+            if (ret < 0) printf("error while reading diff stream\n");
+            goto done;
         }
 
         // Adjust pointers
-        newpos += ctrl[0];
         oldpos += ctrl[0];
 
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (output.newpos + ctrl[1] > *new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        ret = DecodeSegment(pd, &output, &estream, ctrl[1], 0,
+                            NULL, 0, 0);
+        if (ret != 0) {
+            if (ret < 0) printf("error while reading extra stream\n");
+            goto done;
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
+    result = 0;
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
-    return 0;
+  done:
+    if (streams > 2) EndStream(&estream);
+    if (streams > 1) EndStream(&dstream);
+    if (streams > 0) EndStream(&cstream);
+    return result;
+}
+
+int ApplyBSDiffPatch(PatchDecoder* pd,
+                     const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    PatchDecoder* temp = NULL;
+    if (pd == NULL) {
+        pd = temp = NewPatchDecoder();
+        if (pd == NULL) return -1;
+    }
+
+    ssize_t new_size;
+    int result = RunBSDiffPatch(pd, old_data, old_size, patch, patch_offset,
+                                &new_size, sink, token, ctx);
+
+    FreePatchDecoder(temp);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    PatchDecoder* pd = NewPatchDecoder();
+    if (pd == NULL) return 1;
+
+    const unsigned char* out;
+    int result = DecodeBSDiffPatch(pd, old_data, old_size, patch,
+                                   patch_offset, &out, new_size);
+    if (result == 0) {
+        // Hand the output buffer over to the caller.
+        *new_data = pd->output;
+        pd->output = NULL;
+        pd->output_size = 0;
+    }
+    FreePatchDecoder(pd);
+    return result;
+}
+
+int DecodeBSDiffPatch(PatchDecoder* pd,
+                      const unsigned char* old_data, ssize_t old_size,
+                      const Value* patch, ssize_t patch_offset,
+                      const unsigned char** new_data, ssize_t* new_size) {
+    int result = RunBSDiffPatch(pd, old_data, old_size, patch, patch_offset,
+                                new_size, NULL, NULL, NULL);
+    *new_data = pd->output;
+    return result;
 }
@@ -11,7 +11,34 @@
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+// The scan of /cache and /proc is done once per process (one recovery
+// session, or one run of the updater), and its result kept in a list
+// of expendable files ordered largest first.  Later calls to
+// MakeFreeSpaceOnCache() just pick up where the previous one left off.
+// Files opened after the snapshot was taken are not noticed, but
+// nothing in recovery opens files directly in /cache while
+// applypatch is running.
+
+typedef struct {
+  char* name;
+  size_t size;
+} ExpendableFile;
+
+static ExpendableFile* expendable = NULL;
+static int expendable_count = 0;
+static int expendable_next = 0;   // first file not yet deleted
+static int cache_scanned = 0;
+
+static int compare_expendable(const void* a, const void* b) {
+  size_t sa = ((const ExpendableFile*)a)->size;
+  size_t sb = ((const ExpendableFile*)b)->size;
+  if (sa > sb) return -1;
+  if (sa < sb) return 1;
+  return 0;
+}
+
+// Walk /proc once and drop any candidate that some process has open.
+static int EliminateOpenFiles(ExpendableFile* files, int file_count) {
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -49,16 +76,13 @@ static int EliminateOpenFiles(char** files, int file_count) {
       if (count >= 0) {
         link[count] = '\0';
 
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
         if (strncmp(link, "/cache/", 7) == 0) {
           int j;
           for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
+            if (files[j].name && strcmp(files[j].name, link) == 0) {
               printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
+              free(files[j].name);
+              files[j].name = NULL;
             }
           }
         }
@@ -71,12 +95,12 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+static int FindExpendableFiles(ExpendableFile** files, int* entries) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  *files = malloc(size * sizeof(ExpendableFile));
 
   char path[FILENAME_MAX];
 
@@ -104,12 +128,14 @@ int FindExpendableFiles(char*** names, int* entries) {
       if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
 
       struct stat st;
-      if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      if (lstat(path, &st) == 0 && S_ISREG(st.st_mode)) {
         if (*entries >= size) {
           size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
+          *files = realloc(*files, size * sizeof(ExpendableFile));
         }
-        (*names)[(*entries)++] = strdup(path);
+        (*files)[*entries].name = strdup(path);
+        (*files)[*entries].size = st.st_blocks * 512;
+        ++*entries;
       }
     }
 
@@ -118,10 +144,21 @@ int FindExpendableFiles(char*** names, int* entries) {
 
   printf("%d regular files in deletable directories\n", *entries);
 
-  if (EliminateOpenFiles(*names, *entries) < 0) {
+  if (EliminateOpenFiles(*files, *entries) < 0) {
     return -1;
   }
 
+  // Squeeze out the files that are open, and put the biggest first so
+  // we delete as few files as possible.
+  int j = 0;
+  for (i = 0; i < (unsigned int)*entries; ++i) {
+    if ((*files)[i].name != NULL) {
+      (*files)[j++] = (*files)[i];
+    }
+  }
+  *entries = j;
+  qsort(*files, *entries, sizeof(ExpendableFile), compare_expendable);
+
   return 0;
 }
 
@@ -134,39 +171,40 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
-  int entries;
-
-  if (FindExpendableFiles(&names, &entries) < 0) {
-    return -1;
+  if (!cache_scanned) {
+    if (FindExpendableFiles(&expendable, &expendable_count) < 0) {
+      return -1;
+    }
+    cache_scanned = 1;
   }
 
-  if (entries == 0) {
+  if (expendable_next >= expendable_count) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
+  // Delete files (largest first) until, by their recorded sizes, we
+  // expect to have enough room; only then ask the filesystem, since a
+  // statfs() after every unlink() is wasted work.
+  size_t expected = free_now;
+  while (expendable_next < expendable_count && free_now < bytes_needed) {
+    ExpendableFile* f = expendable + expendable_next++;
+    if (unlink(f->name) == 0) {
+      expected += f->size;
+      printf("deleted %s (%ld bytes)\n", f->name, (long)f->size);
+    } else if (errno != ENOENT) {
+      printf("failed to delete %s: %s\n", f->name, strerror(errno));
+    }
+    free(f->name);
+    f->name = NULL;
 
-  int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
+    if (expected >= bytes_needed || expendable_next == expendable_count) {
       free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+      expected = free_now;
+      printf("now %ld bytes free\n", (long)free_now);
     }
   }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
-  }
-  free(names);
-
   return (free_now >= bytes_needed) ? 0 : -1;
 }
@@ -111,6 +111,11 @@
  *
  * After the header there are 'chunk count' bsdiff patches; the offset
  * of each from the beginning of the file is specified in the header.
+ *
+ * "IMGDIFF3" (written when imgdiff is run with "-c zlib") has exactly
+ * the same header as IMGDIFF2, but the bsdiff patches are in BSDIFFZ1
+ * format:  a BSDIFF40 patch whose three blocks are compressed with
+ * zlib instead of bzip2, which is much quicker to apply on the device.
  */
 
 #include <errno.h>
@@ -172,7 +177,11 @@ static int fileentry_compare(const void* a, const void* b) {
 
 // from bsdiff.c
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
+           const char* patch_filename, int codec);
+
+// Compression used for the control, diff, and extra blocks of every
+// bsdiff patch we generate (BSDIFF_CODEC_BZIP2 or BSDIFF_CODEC_ZLIB).
+static int patch_codec = BSDIFF_CODEC_BZIP2;
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -608,7 +617,8 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
   mkstemp(ptemp);
 
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp,
+                 patch_codec);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
@@ -772,20 +782,36 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
 }
 
 int main(int argc, char** argv) {
-  if (argc != 4 && argc != 5) {
+  if (argc < 4) {
     usage:
-    printf("usage: %s [-z] <src-img> <tgt-img> <patch-file>\n",
+    printf("usage: %s [-z] [-c bzip2|zlib] <src-img> <tgt-img> <patch-file>\n",
             argv[0]);
     return 2;
   }
 
   int zip_mode = 0;
 
-  if (strcmp(argv[1], "-z") == 0) {
-    zip_mode = 1;
-    --argc;
-    ++argv;
+  while (argc > 4 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-z") == 0) {
+      zip_mode = 1;
+      --argc;
+      ++argv;
+    } else if (strcmp(argv[1], "-c") == 0) {
+      if (strcmp(argv[2], "bzip2") == 0) {
+        patch_codec = BSDIFF_CODEC_BZIP2;
+      } else if (strcmp(argv[2], "zlib") == 0) {
+        patch_codec = BSDIFF_CODEC_ZLIB;
+      } else {
+        printf("unknown patch codec \"%s\"\n", argv[2]);
+        goto usage;
+      }
+      argc -= 2;
+      argv += 2;
+    } else {
+      goto usage;
+    }
   }
+  if (argc != 4) goto usage;
 
 
   int num_src_chunks;
@@ -955,7 +981,8 @@ int main(int argc, char** argv) {
 
   // Write out the headers.
 
-  fwrite("IMGDIFF2", 1, 8, f);
+  fwrite(patch_codec == BSDIFF_CODEC_ZLIB ? IMGDIFF3_MAGIC : IMGDIFF2_MAGIC,
+         1, 8, f);
   Write4(num_tgt_chunks, f);
   for (i = 0; i < num_tgt_chunks; ++i) {
     Write4(tgt_chunks[i].type, f);
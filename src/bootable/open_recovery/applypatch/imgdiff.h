@@ -28,3 +28,18 @@
 
 // The gzip footer size really is fixed.
 #define GZIP_FOOTER_LEN   8
+
+// bsdiff patch flavors.  "BSDIFF40" is the stock bsdiff format, with
+// bzip2-compressed control, diff, and extra blocks.  "BSDIFFZ1" has
+// exactly the same layout but compresses the blocks with zlib, which
+// decodes several times faster than bzip2 on the device.
+#define BSDIFF_CODEC_BZIP2   0
+#define BSDIFF_CODEC_ZLIB    1
+
+#define BSDIFFZ1_MAGIC    "BSDIFFZ1"
+
+// Image patch versions.  An IMGDIFF3 patch has the same chunk
+// structure as IMGDIFF2, but its embedded patches are BSDIFFZ1 rather
+// than BSDIFF40.
+#define IMGDIFF2_MAGIC    "IMGDIFF2"
+#define IMGDIFF3_MAGIC    "IMGDIFF3"
@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "zlib.h"
@@ -29,6 +30,166 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// Scratch state shared by all the chunks of one image patch, so that
+// patches with many small chunks don't pay for decoder setup and
+// buffer allocation over and over.
+typedef struct {
+    PatchDecoder* pd;
+
+    unsigned char* expanded;      // inflated source data
+    size_t expanded_size;
+    unsigned char* temp;          // output of deflate
+    size_t temp_size;
+
+    int inflate_ready;
+    z_stream istrm;
+
+    // The deflate stream is reused when consecutive chunks ask for the
+    // same encoder parameters (the common case: every entry of an apk).
+    int deflate_ready;
+    int level, method, windowBits, memLevel, strategy;
+    z_stream dstrm;
+} ImagePatchState;
+
+// Make *buffer at least 'needed' bytes; the contents are not preserved.
+static int ReserveBuffer(unsigned char** buffer, size_t* size, size_t needed) {
+    if (*size >= needed && *buffer != NULL) return 0;
+    free(*buffer);
+    *buffer = malloc(needed);
+    *size = (*buffer == NULL) ? 0 : needed;
+    return (*buffer == NULL) ? -1 : 0;
+}
+
+static void FreeImagePatchState(ImagePatchState* st) {
+    if (st->inflate_ready) inflateEnd(&st->istrm);
+    if (st->deflate_ready) deflateEnd(&st->dstrm);
+    FreePatchDecoder(st->pd);
+    free(st->expanded);
+    free(st->temp);
+}
+
+static int ApplyDeflateChunk(ImagePatchState* st, int i,
+                             const unsigned char* old_data,
+                             const Value* patch, char* deflate_header,
+                             SinkFn sink, void* token, SHA_CTX* ctx) {
+    size_t src_start = Read8(deflate_header);
+    size_t src_len = Read8(deflate_header+8);
+    size_t patch_offset = Read8(deflate_header+16);
+    size_t expanded_len = Read8(deflate_header+24);
+    size_t target_len = Read8(deflate_header+32);
+    int level = Read4(deflate_header+40);
+    int method = Read4(deflate_header+44);
+    int windowBits = Read4(deflate_header+48);
+    int memLevel = Read4(deflate_header+52);
+    int strategy = Read4(deflate_header+56);
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    if (ReserveBuffer(&st->expanded, &st->expanded_size, expanded_len) != 0) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               expanded_len);
+        return -1;
+    }
+
+    int ret;
+    if (!st->inflate_ready) {
+        st->istrm.zalloc = Z_NULL;
+        st->istrm.zfree = Z_NULL;
+        st->istrm.opaque = Z_NULL;
+        st->istrm.avail_in = 0;
+        st->istrm.next_in = Z_NULL;
+        ret = inflateInit2(&st->istrm, -15);
+        if (ret != Z_OK) {
+            printf("failed to init source inflation: %d\n", ret);
+            return -1;
+        }
+        st->inflate_ready = 1;
+    } else {
+        inflateReset(&st->istrm);
+    }
+    st->istrm.avail_in = src_len;
+    st->istrm.next_in = (unsigned char*)(old_data + src_start);
+    st->istrm.avail_out = expanded_len;
+    st->istrm.next_out = st->expanded;
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&st->istrm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        return -1;
+    }
+    // We should have filled the output buffer exactly.
+    if (st->istrm.avail_out != 0) {
+        printf("source inflation short by %d bytes\n", st->istrm.avail_out);
+        return -1;
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    const unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    if (DecodeBSDiffPatch(st->pd, st->expanded, expanded_len,
+                          patch, patch_offset,
+                          &uncompressed_target_data,
+                          &uncompressed_target_size) != 0) {
+        return -1;
+    }
+
+    // Now compress the target data and append it to the output.
+
+    if (ReserveBuffer(&st->temp, &st->temp_size, 32768) != 0) {
+        printf("failed to allocate deflate output buffer\n");
+        return -1;
+    }
+
+    if (st->deflate_ready &&
+        st->level == level && st->method == method &&
+        st->windowBits == windowBits && st->memLevel == memLevel &&
+        st->strategy == strategy) {
+        deflateReset(&st->dstrm);
+    } else {
+        if (st->deflate_ready) {
+            deflateEnd(&st->dstrm);
+            st->deflate_ready = 0;
+        }
+        st->dstrm.zalloc = Z_NULL;
+        st->dstrm.zfree = Z_NULL;
+        st->dstrm.opaque = Z_NULL;
+        ret = deflateInit2(&st->dstrm, level, method, windowBits,
+                           memLevel, strategy);
+        if (ret != Z_OK) {
+            printf("failed to init deflate for chunk %d: %d\n", i, ret);
+            return -1;
+        }
+        st->deflate_ready = 1;
+        st->level = level;
+        st->method = method;
+        st->windowBits = windowBits;
+        st->memLevel = memLevel;
+        st->strategy = strategy;
+    }
+
+    st->dstrm.avail_in = uncompressed_target_size;
+    st->dstrm.next_in = (unsigned char*)uncompressed_target_data;
+    do {
+        st->dstrm.avail_out = st->temp_size;
+        st->dstrm.next_out = st->temp;
+        ret = deflate(&st->dstrm, Z_FINISH);
+        ssize_t have = st->temp_size - st->dstrm.avail_out;
+
+        if (sink(st->temp, have, token) != have) {
+            printf("failed to write %ld compressed bytes to output\n",
+                   (long)have);
+            return -1;
+        }
+        SHA_update(ctx, st->temp, have);
+    } while (ret != Z_STREAM_END);
+
+    return 0;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
@@ -47,20 +208,32 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
 
     // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
     // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+    // CHUNK_GZIP.)  IMGDIFF3 has the same chunk types; only the
+    // embedded bsdiff patches differ, and DecodeBSDiffPatch() tells
+    // those apart by their own magic numbers.
+    if (memcmp(header, IMGDIFF2_MAGIC, 8) != 0 &&
+        memcmp(header, IMGDIFF3_MAGIC, 8) != 0) {
         printf("corrupt patch file header (magic number)\n");
         return -1;
     }
 
     int num_chunks = Read4(header+8);
 
+    ImagePatchState st;
+    memset(&st, 0, sizeof(st));
+    st.pd = NewPatchDecoder();
+    if (st.pd == NULL) {
+        printf("failed to allocate patch decoder\n");
+        return -1;
+    }
+
+    int result = -1;
     int i;
     for (i = 0; i < num_chunks; ++i) {
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto done;
         }
         int type = Read4(patch->data + pos);
         pos += 4;
@@ -70,34 +243,37 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto done;
             }
 
             size_t src_start = Read8(normal_header);
             size_t src_len = Read8(normal_header+8);
             size_t patch_offset = Read8(normal_header+16);
 
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
+            if (ApplyBSDiffPatch(st.pd, old_data + src_start, src_len,
+                                 patch, patch_offset, sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d normal patch\n", i);
+                goto done;
+            }
         } else if (type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto done;
             }
 
             ssize_t data_len = Read4(raw_header);
 
             if (pos + data_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
+                goto done;
             }
             SHA_update(ctx, patch->data + pos, data_len);
             if (sink((unsigned char*)patch->data + pos,
                      data_len, token) != data_len) {
                 printf("failed to write chunk %d raw data\n", i);
-                return -1;
+                goto done;
             }
             pos += data_len;
         } else if (type == CHUNK_DEFLATE) {
@@ -106,114 +282,21 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
-            }
-
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
-
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
+                goto done;
             }
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
+            if (ApplyDeflateChunk(&st, i, old_data, patch, deflate_header,
+                                  sink, token, ctx) != 0) {
+                goto done;
             }
-            // We should have filled the output buffer exactly.
-            if (strm.avail_out != 0) {
-                printf("source inflation short by %d bytes\n", strm.avail_out);
-                return -1;
-            }
-            inflateEnd(&strm);
-
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
-
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
-
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
         } else {
             printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            goto done;
         }
     }
+    result = 0;
 
-    return 0;
+  done:
+    FreeImagePatchState(&st);
+    return result;
 }
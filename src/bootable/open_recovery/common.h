@@ -18,6 +18,7 @@
 #define RECOVERY_COMMON_H
 
 #include <stdio.h>
+#include <sys/time.h>
 
 #define LOGE(...) ui_print("E:" __VA_ARGS__)
 #define LOGW(...) fprintf(stderr, "W:" __VA_ARGS__)
@@ -110,10 +111,12 @@ void ui_init();
 
 // Use KEY_* codes from <linux/input.h> or KEY_DREAM_* from "minui/minui.h".
 int ui_get_key();							// returns keycode if a key event is pending
+int ui_get_key_event(struct timeval* when); // same, also returns when the kernel reported it
 int ui_wait_key();            // waits for a key/button press, returns the code
 int ui_key_pressed(int key);  // returns >0 if the code is currently pressed
 int ui_text_visible();        // returns >0 if text log is currently visible
 void ui_clear_key_queue();
+int ui_get_key_fd();          // readable (for poll) when a key event may be pending
 
 // Write a message to the on-screen log shown with Alt-L (also to stderr).
 // The screen is small, and users may need to report these messages to support,
@@ -21,6 +21,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -29,6 +30,7 @@
 #include <sys/ioctl.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -62,6 +64,12 @@
 
 #define ESC 27
 
+//output of bash is shown in batches of up to this many bytes
+#define CONSOLE_READ_BUFFER 16384
+
+//with nothing to do, how often to check if bash has exited
+#define CONSOLE_IDLE_TIMEOUT_MS 1000
+
 typedef struct
 {
 	char normal[KEY_MAX+1];
@@ -428,7 +436,7 @@ int run_console(const char* command)
 	int shell_error = 0;
 	
 	//buffer for pipe
-	char buffer[1024+1];
+	static char buffer[CONSOLE_READ_BUFFER+1];
 	
 	//set pipe to nonblocking
 	set_nonblocking(childfd);
@@ -458,8 +466,23 @@ int run_console(const char* command)
 	ui_console_set_system_front_color(CONSOLE_DEFAULT_FRONT_COLOR);
 	int force_quit = 0;
 	
+	//key input latency, in microseconds
+	int key_count = 0;
+	long long key_latency_sum = 0;
+	long long key_latency_max = 0;
+	
 	//handle the i/o between the recovery and bash
-	//manage the items to print here, but the actual printing is done in another thread
+	//sleep until bash writes something or a key is pressed, then handle all of it at once
+	struct pollfd fds[2];
+	fds[0].fd = childfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = ui_get_key_fd();
+	fds[1].events = POLLIN;
+	
+	//without the key queue descriptor, check for keys now and then
+	int nfds = fds[1].fd >= 0 ? 2 : 1;
+	int timeout = fds[1].fd >= 0 ? CONSOLE_IDLE_TIMEOUT_MS : 20;
+	
 	while (1)
 	{
 		if (force_quit)
@@ -469,37 +492,74 @@ int run_console(const char* command)
 			waitpid(child, &sts, 0);
 			break;
 		}
-	
-		int rv = read(childfd, buffer, 1024);		
 		
+		int rv = poll(fds, nfds, timeout);
+		
+		if (rv < 0 && errno != EINTR)
+			fprintf(stderr, "run_console: poll failed %d.\n", errno);
+		
+		//bash may have exited while a background job still holds the terminal
 		if (rv <= 0)
 		{
-			if(errno == EAGAIN)
+			if (waitpid(child, &sts, WNOHANG))
+				break;
+				
+			if (nfds == 2)
+				continue;
+		}
+		
+		if (rv > 0 && fds[0].revents)
+		{
+			//read everything there is, so that it is printed in one go
+			int len = 0;
+			int closed = 0;
+			
+			while (len < CONSOLE_READ_BUFFER)
 			{
-				if (waitpid(child, &sts, WNOHANG))
+				rv = read(childfd, buffer + len, CONSOLE_READ_BUFFER - len);
+				
+				if (rv > 0)
+					len += rv;
+				else if (rv < 0 && errno == EINTR)
+					continue;
+				else
+				{
+					closed = rv == 0 || errno != EAGAIN;
 					break;
+				}
 			}
-			else		
+			
+			if (len > 0)
+			{
+				//if the string is read only partially, it won't be null terminated
+				buffer[len] = 0;
+				ui_console_print(buffer);
+			}
+			
+			if (closed)
 			{
 				//not necessarilly an error (bash could have quit)
-				fprintf(stderr, "run_console: there was a read error %d.\n", errno);
+				if (rv < 0)
+					fprintf(stderr, "run_console: there was a read error %d.\n", errno);
 				waitpid(child, &sts, 0);
 				break;
 			}
 		}
-		else
-		{	
-			//if the string is read only partially, it won't be null terminated		  		
-			buffer[rv] = 0;
-			fprintf(stderr, "run_console: received input of %d characters.\n", rv);
-			ui_console_print(buffer);
-			fprintf(stderr, "run_console: input succesfully displayed.\n");
-		}
 		
-		//evaluate one keyevent
-		int keycode = ui_get_key();
-		if (keycode != -1)
+		//evaluate all pending keyevents
+		int keycode;
+		struct timeval key_time;
+		while (!force_quit && (keycode = ui_get_key_event(&key_time)) != -1)
 		{
+			//how long the key waited to be handled
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			long long latency = (now.tv_sec - key_time.tv_sec) * 1000000LL + (now.tv_usec - key_time.tv_usec);
+			key_count++;
+			key_latency_sum += latency;
+			if (latency > key_latency_max)
+				key_latency_max = latency;
+			
 			//alt + menu + c --> forcibly terminate bash
 			//TODO: othewise menu acts as ctrl
 			if (ui_key_pressed(KEY_SOFT1))
@@ -567,7 +627,6 @@ int run_console(const char* command)
 					break;
 												
 				default:
-					fprintf(stderr, "run_console: Received key \"%c\".\n", key);
 					write(childfd, &key, 1);
 					break;
 			}
@@ -595,6 +654,10 @@ int run_console(const char* command)
 			shell_error = 1;
 	}
 	
+	if (key_count > 0)
+		fprintf(stderr, "run_console: %d keys, latency %lld us on average, %lld us at most.\n",
+			key_count, key_latency_sum / key_count, key_latency_max);
+	
 	close(childfd);
 	exit_console();
 	return shell_error;
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
@@ -42,6 +43,10 @@
 #define OR_SCRIPT_UPDATER_NAME					"/sbin/script-updater"
 #define PUBLIC_KEYS_FILE "/res/keys"
 
+//the native nandroid engine reports its progress on this descriptor
+#define PROGRESS_FD_ENV									"OR_PROGRESS_FD"
+#define PROGRESS_BUFFER_SIZE						256
+
 static interactive_menu_struct* interactive_menu;
 static const char *SHELL_FILE = PHONE_SHELL;
 
@@ -376,6 +381,65 @@ handle_update_package(const char *path, ZipArchive *zip)
     return result;
 }
 
+//handles the progress protocol commands (see try_update_binary) that
+//arrived on fd, keeping an unfinished line in buffer
+//returns 1 if any command was handled
+static int
+handle_progress_commands(int fd, char* buffer, int* len)
+{
+	int handled = 0;
+	int rv;
+	
+	while ((rv = read(fd, buffer + *len, PROGRESS_BUFFER_SIZE - 1 - *len)) > 0)
+	{
+		*len += rv;
+		buffer[*len] = '\0';
+		
+		char* line = buffer;
+		char* end;
+		
+		while ((end = strchr(line, '\n')) != NULL)
+		{
+			*end = '\0';
+			char* command = strtok(line, " ");
+			
+			if (command == NULL)
+				;
+			else if (strcmp(command, "progress") == 0)
+			{
+				char* fraction_s = strtok(NULL, " ");
+				char* seconds_s = strtok(NULL, " ");
+				
+				if (fraction_s != NULL && seconds_s != NULL)
+				{
+					ui_show_progress(strtof(fraction_s, NULL), strtol(seconds_s, NULL, 10));
+					handled = 1;
+				}
+			}
+			else if (strcmp(command, "set_progress") == 0)
+			{
+				char* fraction_s = strtok(NULL, " ");
+				
+				if (fraction_s != NULL)
+				{
+					ui_set_progress(strtof(fraction_s, NULL));
+					handled = 1;
+				}
+			}
+			
+			line = end + 1;
+		}
+		
+		//keep the rest for the next time, drop lines that can't fit
+		*len = strlen(line);
+		if (*len == PROGRESS_BUFFER_SIZE - 1)
+			*len = 0;
+		memmove(buffer, line, *len);
+	}
+	
+	return handled;
+}
+
 void run_shell_script(const char *command, int stdoutToUI, char** extra_env_variables) 
 {
 	char *argp[] = {PHONE_SHELL, "-c", NULL, NULL};
@@ -393,10 +457,12 @@ void run_shell_script(const char *command, int stdoutToUI, char** extra_env_vari
 	
 	//pipes
 	int script_pipefd[2];
+	int progress_pipefd[2] = { -1, -1 };
 		
 	if (stdoutToUI)
 	{
   	pipe(script_pipefd);
+  	pipe(progress_pipefd);
   	
   	if((imenu_fd = open(INTERACTIVE_MENU_SHM, (O_CREAT | O_RDWR),
 				             666)) < 0 ) 
@@ -432,6 +498,15 @@ void run_shell_script(const char *command, int stdoutToUI, char** extra_env_vari
 			//put stdout to the pipe only
 			close(script_pipefd[0]);
 			dup2(script_pipefd[1], 1); 
+			
+			//let the helpers find the progress pipe
+			if (progress_pipefd[1] >= 0)
+			{
+				static char progress_env[32];
+				close(progress_pipefd[0]);
+				snprintf(progress_env, sizeof(progress_env), PROGRESS_FD_ENV "=%d", progress_pipefd[1]);
+				putenv(progress_env);
+			}
 		}
 		
 		if (extra_env_variables != NULL)
@@ -455,6 +530,9 @@ void run_shell_script(const char *command, int stdoutToUI, char** extra_env_vari
 	if (stdoutToUI)
 	{				
 		char buffer[1024+1];
+		char progress_buffer[PROGRESS_BUFFER_SIZE];
+		int progress_len = 0;
+		int progress_shown = 0;
 		
 		//nonblocking mode
 		int f = fcntl(script_pipefd[0], F_GETFL, 0);
@@ -463,6 +541,13 @@ void run_shell_script(const char *command, int stdoutToUI, char** extra_env_vari
   	// Change flags on fd
   	fcntl(script_pipefd[0], F_SETFL, f);
   	
+  	if (progress_pipefd[0] >= 0)
+  	{
+  		close(progress_pipefd[1]);
+  		progress_pipefd[1] = -1;
+  		fcntl(progress_pipefd[0], F_SETFL, fcntl(progress_pipefd[0], F_GETFL, 0) | O_NONBLOCK);
+  	}
+  	
 								
   	while (1)
   	{
@@ -504,6 +589,10 @@ void run_shell_script(const char *command, int stdoutToUI, char** extra_env_vari
         interactive_menu->out_trigger = chosen_item;   
   		}
   	
+  		if (progress_pipefd[0] >= 0 &&
+  		    handle_progress_commands(progress_pipefd[0], progress_buffer, &progress_len))
+  			progress_shown = 1;
+  		
   		int rv = read(script_pipefd[0], buffer, 1024);		
   		
   		if (rv <= 0)
@@ -536,6 +625,15 @@ void run_shell_script(const char *command, int stdoutToUI, char** extra_env_vari
 			buffer[rv] = 0;	
 			ui_print_raw(buffer);
   	}
+  	
+  	if (progress_pipefd[0] >= 0)
+  	{
+  		close(progress_pipefd[0]);
+  		progress_pipefd[0] = -1;
+  	}
+  	
+  	if (progress_shown)
+  		ui_reset_progress();
 	}
 	else
 		waitpid(child, &sts, 0);
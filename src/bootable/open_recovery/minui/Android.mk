@@ -11,3 +11,18 @@ LOCAL_C_INCLUDES +=\
 LOCAL_MODULE := libminui_orcvr
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Host tool preconverting theme images, see mksurface.c
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := mksurface.c resources.c
+
+LOCAL_C_INCLUDES +=\
+    external/libpng\
+    external/zlib
+
+LOCAL_STATIC_LIBRARIES := libpng libz
+
+LOCAL_MODULE := mksurface_orcvr
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -16,9 +16,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/poll.h>
+#include <sys/time.h>
 
 #include <linux/input.h>
 
@@ -29,12 +32,135 @@
 static struct pollfd ev_fds[MAX_DEVICES];
 static unsigned ev_count = 0;
 
+/* Scripted input (MINUI_KEYS_ENV), one event per line:
+ *
+ *   [+<ms>] <key> [down|up]
+ *   quit
+ *
+ * <key> is a name from the table below without KEY_, or a key code.
+ * Without down or up the key is pressed and released.  +<ms> waits
+ * that long first; quit ends the process.  '#' starts a comment. */
+static FILE *ev_script = NULL;
+static struct input_event ev_pending;       /* the release, if any */
+static int ev_has_pending = 0;
+
+#define EV_KEY_NAME(k) { #k, KEY_##k }
+static const struct { const char *name; int code; } ev_key_names[] = {
+    EV_KEY_NAME(A), EV_KEY_NAME(B), EV_KEY_NAME(C), EV_KEY_NAME(D),
+    EV_KEY_NAME(E), EV_KEY_NAME(F), EV_KEY_NAME(G), EV_KEY_NAME(H),
+    EV_KEY_NAME(I), EV_KEY_NAME(J), EV_KEY_NAME(K), EV_KEY_NAME(L),
+    EV_KEY_NAME(M), EV_KEY_NAME(N), EV_KEY_NAME(O), EV_KEY_NAME(P),
+    EV_KEY_NAME(Q), EV_KEY_NAME(R), EV_KEY_NAME(S), EV_KEY_NAME(T),
+    EV_KEY_NAME(U), EV_KEY_NAME(V), EV_KEY_NAME(W), EV_KEY_NAME(X),
+    EV_KEY_NAME(Y), EV_KEY_NAME(Z),
+    EV_KEY_NAME(0), EV_KEY_NAME(1), EV_KEY_NAME(2), EV_KEY_NAME(3),
+    EV_KEY_NAME(4), EV_KEY_NAME(5), EV_KEY_NAME(6), EV_KEY_NAME(7),
+    EV_KEY_NAME(8), EV_KEY_NAME(9),
+    EV_KEY_NAME(UP), EV_KEY_NAME(DOWN), EV_KEY_NAME(LEFT), EV_KEY_NAME(RIGHT),
+    EV_KEY_NAME(ENTER), EV_KEY_NAME(SPACE), EV_KEY_NAME(BACKSPACE),
+    EV_KEY_NAME(TAB), EV_KEY_NAME(DOT), EV_KEY_NAME(COMMA),
+    EV_KEY_NAME(MINUS), EV_KEY_NAME(SLASH), EV_KEY_NAME(EQUAL),
+    EV_KEY_NAME(LEFTSHIFT), EV_KEY_NAME(RIGHTSHIFT),
+    EV_KEY_NAME(LEFTALT), EV_KEY_NAME(RIGHTALT),
+    EV_KEY_NAME(VOLUMEUP), EV_KEY_NAME(VOLUMEDOWN), EV_KEY_NAME(CAMERA),
+    EV_KEY_NAME(POWER), EV_KEY_NAME(BACK), EV_KEY_NAME(MENU),
+    EV_KEY_NAME(HOME), EV_KEY_NAME(SEARCH),
+#ifdef KEY_CENTER
+    EV_KEY_NAME(CENTER),
+#endif
+#ifdef KEY_SOFT1
+    EV_KEY_NAME(SOFT1),
+#endif
+};
+
+static int ev_script_key(const char *name)
+{
+    unsigned i;
+    char *end;
+    long code = strtol(name, &end, 0);
+    if (*end == '\0' && end != name)
+        return code >= 0 && code <= KEY_MAX ? (int) code : -1;
+    for (i = 0; i < sizeof(ev_key_names) / sizeof(ev_key_names[0]); i++) {
+        if (!strcasecmp(name, ev_key_names[i].name))
+            return ev_key_names[i].code;
+    }
+    return -1;
+}
+
+/* The next event of the script, waiting as it says; -1 at its end. */
+static int ev_script_get(struct input_event *ev)
+{
+    char line[128];
+
+    if (ev_has_pending) {
+        ev_has_pending = 0;
+        *ev = ev_pending;
+        gettimeofday(&ev->time, NULL);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), ev_script)) {
+        char *words[3], *p = line;
+        int count = 0, delay = 0;
+
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        for (p = strtok(line, " \t\r\n"); p != NULL && count < 3;
+             p = strtok(NULL, " \t\r\n"))
+            words[count++] = p;
+        if (count == 0)
+            continue;
+
+        if (words[0][0] == '+') {
+            delay = atoi(words[0] + 1);
+            memmove(words, words + 1, --count * sizeof(words[0]));
+            if (delay > 0)
+                usleep(delay * 1000);
+            if (count == 0)
+                continue;
+        }
+
+        if (!strcmp(words[0], "quit"))
+            exit(0);
+
+        int code = ev_script_key(words[0]);
+        if (code < 0) {
+            fprintf(stderr, "minui: unknown key \"%s\" in the input script\n", words[0]);
+            continue;
+        }
+
+        memset(ev, 0, sizeof(*ev));
+        gettimeofday(&ev->time, NULL);
+        ev->type = EV_KEY;
+        ev->code = code;
+        ev->value = count < 2 || strcmp(words[1], "up") ? 1 : 0;
+
+        if (count < 2) {
+            ev_pending = *ev;
+            ev_pending.value = 0;
+            ev_has_pending = 1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
 int ev_init(void)
 {
     DIR *dir;
     struct dirent *de;
     int fd;
 
+    const char *script = getenv(MINUI_KEYS_ENV);
+    if (script != NULL) {
+        ev_script = fopen(script, "r");
+        if (ev_script == NULL) {
+            perror("cannot open the input script");
+            return -1;
+        }
+        return 0;
+    }
+
     dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
@@ -55,6 +181,10 @@ int ev_init(void)
 
 void ev_exit(void)
 {
+    if (ev_script != NULL) {
+        fclose(ev_script);
+        ev_script = NULL;
+    }
     while (ev_count > 0) {
         close(ev_fds[--ev_count].fd);
     }
@@ -65,6 +195,13 @@ int ev_get(struct input_event *ev, unsigned dont_wait)
     int r;
     unsigned n;
 
+    if (ev_script != NULL) {
+        if (ev_script_get(ev) == 0) return 0;
+        /* the script is over: nothing more will ever happen */
+        while (dont_wait == 0) pause();
+        return -1;
+    }
+
     do {
         r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
 
@@ -17,8 +17,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -32,8 +36,15 @@
 #include "font_10x18.h"
 #include "minui.h"
 
+/* The font, expanded once into a bit mask per glyph row: bit i of a row
+ * is the i-th pixel along it.  The landscape font is the same glyphs
+ * turned a quarter clockwise, so its rows run down the screen. */
 typedef struct {
-    GGLSurface texture;
+    unsigned *glyphs;       /* 96 glyphs of rows masks each */
+    unsigned blank[32];     /* for characters the font doesn't have */
+    unsigned rows;          /* rows per glyph */
+    unsigned width;         /* bits per row */
+    unsigned full;          /* all width bits set */
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
@@ -42,7 +53,7 @@ typedef struct {
 static GRFont *gr_font = 0;
 static GRFont *gr_font_l = 0;
 static GGLContext *gr_context = 0;
-static GGLSurface gr_font_texture;
+static gr_pixel gr_current_color = 0;
 static GGLSurface gr_framebuffer[2];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
@@ -50,8 +61,55 @@ static unsigned gr_active_fb = 0;
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
+/* Set when MINUI_HEADLESS_ENV asks for the framebuffer in memory, see
+ * minui.h; then each page shown can be dumped to MINUI_DUMP_ENV. */
+static int gr_headless = 0;
+static const char *gr_dump_dir = NULL;
+static unsigned gr_dump_count = 0;
+static int gr_dump_page = -1;       /* shown but not dumped yet */
+
 static struct fb_var_screeninfo vi;
 
+/* The parts of the memory surface drawn into since each page was last
+ * brought up to date with it.  Drawing adds to both lists; a flip only
+ * copies the new page's list into it, so pages stay consistent without
+ * ever copying the whole screen for a progress bar or a line of text. */
+#define MAX_DIRTY_RECTS 16
+
+typedef struct {
+    int x0, y0, x1, y1;     /* [x0, x1) x [y0, y1) */
+} GRRect;
+
+typedef struct {
+    GRRect rects[MAX_DIRTY_RECTS];
+    int count;
+} GRDamage;
+
+static GRDamage gr_damage[2];
+static int gr_pan_failed = 0;
+
+/* Older kernel headers don't have it; drivers that don't either fail it
+ * with ENOTTY, and the render loop paces itself by the clock instead. */
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
+
+/* The render loop: producers ask for frames with gr_request_frame(),
+ * and one thread draws and flips them, never more than once per
+ * refresh however many were asked for meanwhile. */
+static pthread_mutex_t gr_render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gr_render_cond = PTHREAD_COND_INITIALIZER;
+static int gr_frame_requested = 0;
+static gr_render_fn gr_render = NULL;
+static void *gr_render_cookie = NULL;
+static int gr_vsync_failed = 0;
+static long long gr_refresh_us = 1000000 / 60;
+static long long gr_last_vsync = 0;
+static gr_frame_stats gr_stats;     /* under gr_render_lock */
+
+/* print the counters to the log every so many frames */
+#define STATS_LOG_FRAMES 1000
+
 static int get_framebuffer(GGLSurface *fb)
 {
     int fd;
@@ -106,6 +164,75 @@ static int get_framebuffer(GGLSurface *fb)
     return fd;
 }
 
+static int get_headless_framebuffer(GGLSurface *fb, const char *size)
+{
+    unsigned width = 480, height = 854;
+    if (sscanf(size, "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+        width = 480;
+        height = 854;
+    }
+
+    void *bits = calloc(2, width * height * 2);
+    if (bits == NULL) {
+        fprintf(stderr, "failed to allocate the headless framebuffer\n");
+        return -1;
+    }
+
+    memset(&vi, 0, sizeof(vi));
+    vi.xres = vi.xres_virtual = width;
+    vi.yres = height;
+    vi.yres_virtual = height * 2;
+    vi.bits_per_pixel = 16;
+
+    fb[0].version = fb[1].version = sizeof(*fb);
+    fb[0].width = fb[1].width = width;
+    fb[0].height = fb[1].height = height;
+    fb[0].stride = fb[1].stride = width;
+    fb[0].data = bits;
+    fb[1].data = (unsigned short *) bits + width * height;
+    fb[0].format = fb[1].format = GGL_PIXEL_FORMAT_RGB_565;
+
+    gr_dump_dir = getenv(MINUI_DUMP_ENV);
+    return 0;
+}
+
+/* Write the page as it would be on the screen, as a binary ppm. */
+static void dump_framebuffer(unsigned n)
+{
+    char path[256];
+    unsigned x, y;
+
+    snprintf(path, sizeof(path), "%s/frame-%05u.ppm", gr_dump_dir, gr_dump_count++);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror("cannot dump the frame");
+        return;
+    }
+    fprintf(f, "P6\n%u %u\n255\n", vi.xres, vi.yres);
+    const unsigned short *data = gr_framebuffer[n].data;
+    for (y = 0; y < vi.yres; y++) {
+        unsigned char row[3 * vi.xres];
+        for (x = 0; x < vi.xres; x++) {
+            unsigned short p = data[y * vi.xres + x];
+            row[x * 3] = ((p >> 11) & 0x1f) * 255 / 31;
+            row[x * 3 + 1] = ((p >> 5) & 0x3f) * 255 / 63;
+            row[x * 3 + 2] = (p & 0x1f) * 255 / 31;
+        }
+        fwrite(row, 1, sizeof(row), f);
+    }
+    fclose(f);
+}
+
+/* Dumping is kept out of the timed part of a frame, so that the disk
+ * doesn't end up in the numbers the headless runs are there to give. */
+static void dump_shown_page(void)
+{
+    if (gr_dump_page >= 0) {
+        dump_framebuffer(gr_dump_page);
+        gr_dump_page = -1;
+    }
+}
+
 static void get_memory_surface(GGLSurface* ms) {
   ms->version = sizeof(*ms);
   ms->width = vi.xres;
@@ -118,6 +245,10 @@ static void get_memory_surface(GGLSurface* ms) {
 static void set_active_framebuffer(unsigned n)
 {
     if (n > 1) return;
+    if (gr_headless) {
+        if (gr_dump_dir != NULL) gr_dump_page = n;
+        return;
+    }
     vi.yres_virtual = vi.yres * 2;
     vi.yoffset = n * vi.yres;
     vi.bits_per_pixel = 16;
@@ -126,20 +257,225 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+static void pan_framebuffer(unsigned n)
+{
+    /* Panning just moves the scanout; only fall back to a full mode set
+     * on drivers that can't pan. */
+    if (!gr_pan_failed && !gr_headless) {
+        vi.yoffset = n * vi.yres;
+        if (ioctl(gr_fb_fd, FBIOPAN_DISPLAY, &vi) == 0) return;
+        gr_pan_failed = 1;
+    }
+    set_active_framebuffer(n);
+}
+
+static void add_damage(GRDamage *d, const GRRect *r)
+{
+    int i;
+    for (i = 0; i < d->count; i++) {
+        GRRect *o = &d->rects[i];
+        if (r->x0 > o->x1 || r->x1 < o->x0 || r->y0 > o->y1 || r->y1 < o->y0)
+            continue;
+        /* overlapping or touching: grow the old one */
+        if (r->x0 < o->x0) o->x0 = r->x0;
+        if (r->y0 < o->y0) o->y0 = r->y0;
+        if (r->x1 > o->x1) o->x1 = r->x1;
+        if (r->y1 > o->y1) o->y1 = r->y1;
+        return;
+    }
+    if (d->count < MAX_DIRTY_RECTS) {
+        d->rects[d->count++] = *r;
+        return;
+    }
+    /* too scattered to be worth tracking: copy the bounding box */
+    GRRect *b = &d->rects[0];
+    for (i = 1; i <= d->count; i++) {
+        const GRRect *o = i < d->count ? &d->rects[i] : r;
+        if (o->x0 < b->x0) b->x0 = o->x0;
+        if (o->y0 < b->y0) b->y0 = o->y0;
+        if (o->x1 > b->x1) b->x1 = o->x1;
+        if (o->y1 > b->y1) b->y1 = o->y1;
+    }
+    d->count = 1;
+}
+
+static void mark_dirty(int x0, int y0, int x1, int y1)
+{
+    GRRect r;
+    r.x0 = x0 < 0 ? 0 : x0;
+    r.y0 = y0 < 0 ? 0 : y0;
+    r.x1 = x1 > (int) vi.xres ? (int) vi.xres : x1;
+    r.y1 = y1 > (int) vi.yres ? (int) vi.yres : y1;
+    if (r.x0 >= r.x1 || r.y0 >= r.y1) return;
+    add_damage(&gr_damage[0], &r);
+    add_damage(&gr_damage[1], &r);
+}
+
+static void copy_damage(GRDamage *d, GGLSurface *fb)
+{
+    int i, y;
+    for (i = 0; i < d->count; i++) {
+        const GRRect *r = &d->rects[i];
+        unsigned short *src = (unsigned short *) gr_mem_surface.data;
+        unsigned short *dst = (unsigned short *) fb->data;
+        if (r->x0 == 0 && r->x1 == (int) vi.xres) {
+            /* whole rows are contiguous */
+            memcpy(dst + r->y0 * vi.xres, src + r->y0 * vi.xres,
+                   (r->y1 - r->y0) * vi.xres * 2);
+            continue;
+        }
+        for (y = r->y0; y < r->y1; y++) {
+            memcpy(dst + y * vi.xres + r->x0, src + y * vi.xres + r->x0,
+                   (r->x1 - r->x0) * 2);
+        }
+    }
+    d->count = 0;
+}
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 void gr_flip(void)
 {
-    GGLContext *gl = gr_context;
+    /* nothing drawn since the last flip: the page on screen is current */
+    if (gr_damage[gr_active_fb].count == 0) return;
+
+    long long start = now_us();
 
     /* swap front and back buffers */
     gr_active_fb = (gr_active_fb + 1) & 1;
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres * vi.yres * 2);
+    /* bring the buffer we're about to make active up to date with the
+     * in-memory surface: this frame's damage plus the last one's. */
+    copy_damage(&gr_damage[gr_active_fb], &gr_framebuffer[gr_active_fb]);
 
     /* inform the display driver */
-    set_active_framebuffer(gr_active_fb);
+    pan_framebuffer(gr_active_fb);
+
+    pthread_mutex_lock(&gr_render_lock);
+    gr_stats.frames++;
+    gr_stats.copy_us += now_us() - start;
+    pthread_mutex_unlock(&gr_render_lock);
+
+    /* the render loop dumps once it has taken the frame's times */
+    if (gr_render == NULL) dump_shown_page();
+}
+
+/* Block until the start of the next refresh, or, if the driver can't
+ * tell, until a refresh period after the last one. */
+static void wait_for_vsync(void)
+{
+    if (!gr_vsync_failed) {
+        __u32 crtc = 0;
+        if (ioctl(gr_fb_fd, FBIO_WAITFORVSYNC, &crtc) == 0) {
+            gr_last_vsync = now_us();
+            return;
+        }
+        if (errno != EINTR) {
+            gr_vsync_failed = 1;
+        }
+    }
+
+    long long now = now_us();
+    long long next = gr_last_vsync + gr_refresh_us;
+    if (next > now) {
+        usleep(next - now);
+        now = next;
+    }
+    gr_last_vsync = now;
+}
+
+static void *render_thread(void *cookie)
+{
+    for (;;) {
+        pthread_mutex_lock(&gr_render_lock);
+        while (!gr_frame_requested)
+            pthread_cond_wait(&gr_render_cond, &gr_render_lock);
+        gr_frame_requested = 0;
+        long long copy_before = gr_stats.copy_us;
+        pthread_mutex_unlock(&gr_render_lock);
+
+        wait_for_vsync();
+
+        long long start = now_us();
+        gr_render(gr_render_cookie);
+        long long elapsed = now_us() - start;
+
+        pthread_mutex_lock(&gr_render_lock);
+        /* the flip in it counts as copying, not rendering */
+        gr_stats.render_us += elapsed - (gr_stats.copy_us - copy_before);
+        int log = gr_stats.frames > 0 && gr_stats.frames % STATS_LOG_FRAMES == 0 &&
+                  gr_stats.copy_us != copy_before;
+        gr_frame_stats stats = gr_stats;
+        pthread_mutex_unlock(&gr_render_lock);
+
+        dump_shown_page();
+
+        if (gr_headless && stats.copy_us != copy_before) {
+            fprintf(stderr, "minui: frame %lu: %lld us rendering, %lld us copying\n",
+                    stats.frames, elapsed - (stats.copy_us - copy_before),
+                    stats.copy_us - copy_before);
+        } else if (log) {
+            fprintf(stderr, "minui: %lu frames for %lu requests, "
+                    "%lld us rendering and %lld us copying per frame\n",
+                    stats.frames, stats.requests,
+                    stats.render_us / stats.frames, stats.copy_us / stats.frames);
+        }
+    }
+    return NULL;
+}
+
+int gr_render_start(gr_render_fn fn, void *cookie)
+{
+    pthread_t t;
+
+    /* the refresh rate from the mode timings, for when there's no vsync */
+    unsigned long long line = vi.xres + vi.left_margin + vi.right_margin + vi.hsync_len;
+    unsigned long long frame = vi.yres + vi.upper_margin + vi.lower_margin + vi.vsync_len;
+    if (vi.pixclock > 0) {
+        /* pixclock is in picoseconds */
+        long long us = line * frame * vi.pixclock / 1000000;
+        if (us >= 1000000 / 120 && us <= 1000000 / 20)
+            gr_refresh_us = us;
+    }
+
+    gr_render = fn;
+    gr_render_cookie = cookie;
+    if (pthread_create(&t, NULL, render_thread, NULL) != 0) {
+        gr_render = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void gr_request_frame(void)
+{
+    pthread_mutex_lock(&gr_render_lock);
+    gr_stats.requests++;
+    gr_frame_requested = 1;
+    pthread_cond_signal(&gr_render_cond);
+    pthread_mutex_unlock(&gr_render_lock);
+}
+
+/* at exit, for the headless benchmarks */
+static void print_frame_stats(void)
+{
+    gr_frame_stats stats;
+    gr_get_frame_stats(&stats);
+    fprintf(stderr, "minui: %lu frames for %lu requests, %lld us rendering "
+            "and %lld us copying in all\n",
+            stats.frames, stats.requests, stats.render_us, stats.copy_us);
+}
+
+void gr_get_frame_stats(gr_frame_stats *stats)
+{
+    pthread_mutex_lock(&gr_render_lock);
+    *stats = gr_stats;
+    pthread_mutex_unlock(&gr_render_lock);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -151,6 +487,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    gr_current_color = gr_rgb(r, g, b);
 }
 
 int gr_measure(const char *s)
@@ -158,60 +495,108 @@ int gr_measure(const char *s)
     return gr_font->cwidth * strlen(s);
 }
 
-int gr_text(int x, int y, const char *s)
+gr_pixel gr_rgb(unsigned char r, unsigned char g, unsigned char b)
+{
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+/* Draw one glyph, given as rows of bits, into the memory surface: bit i
+ * of row r lands at dst + r * stride + i.  Pixels outside the surface
+ * (rows outside [r0, r1), bits outside clip) are left alone. */
+static void blit_glyph(gr_pixel *dst, int stride, const unsigned *glyph,
+                       int r0, int r1, unsigned clip,
+                       gr_pixel fg, const gr_pixel *bg)
 {
-	GGLContext *gl = gr_context;
-	GRFont *font = gr_font;
-	unsigned off;
+    int r;
+    for (r = r0; r < r1; r++) {
+        gr_pixel *p = dst + r * stride;
+        unsigned m = glyph[r];
+        if (bg != NULL) {
+            unsigned b = clip;
+            while (b) {
+                int i = __builtin_ctz(b);
+                p[i] = (m >> i) & 1 ? fg : *bg;
+                b &= b - 1;
+            }
+        } else {
+            m &= clip;
+            while (m) {
+                p[__builtin_ctz(m)] = fg;
+                m &= m - 1;
+            }
+        }
+    }
+}
 
-	y -= font->ascent;
+/* Lay out a run of character cells.  Each cell is the glyph's rows (of
+ * width bits each) starting at (col, row) on the surface; step moves to
+ * the next cell along the rows (portrait) or down the columns
+ * (landscape). */
+static void blit_cells(GRFont *font, const char *s, int col, int row,
+                       int col_step, int row_step,
+                       const gr_pixel *fg, const gr_pixel *bg)
+{
+    gr_pixel *surface = (gr_pixel *) gr_mem_surface.data;
+    int stride = gr_mem_surface.stride;
+    int width = gr_mem_surface.width;
+    int height = gr_mem_surface.height;
+    unsigned off;
+    int i;
+
+    for (i = 0; (off = (unsigned char) s[i]) != 0;
+         i++, col += col_step, row += row_step) {
+        off -= 32;
+        if (off >= 96 && bg == NULL) continue;
+        if (col >= width || col + (int) font->width <= 0) continue;
+
+        int r0 = row < 0 ? -row : 0;
+        int r1 = row + (int) font->rows > height ? height - row : (int) font->rows;
+        if (r0 >= r1) continue;
+        unsigned clip = font->full;
+        if (col < 0) clip &= ~0u << -col;
+        if (col + (int) font->width > width) clip &= (1u << (width - col)) - 1;
+
+        const unsigned *glyph = off < 96 ? font->glyphs + off * font->rows
+                                         : font->blank;
+        blit_glyph(surface + row * stride + col, stride, glyph, r0, r1, clip,
+                   fg != NULL ? fg[i] : gr_current_color, bg);
+    }
+}
 
-	gl->bindTexture(gl, &font->texture);
-	gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-	gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-	gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-	gl->enable(gl, GGL_TEXTURE_2D);
+int gr_text_cells(int x, int y, const char *s,
+                  const gr_pixel *fg, const gr_pixel *bg)
+{
+    GRFont *font = gr_font;
+    int n = strlen(s);
 
-	while((off = *s++)) 
-	{
-		off -= 32;
-		if (off < 96) 
-		{
-			gl->texCoord2i(gl, (off * font->cwidth) - x, 0 - y);
-			gl->recti(gl, x, y, x + font->cwidth, y + font->cheight);
-		}
-		x += font->cwidth;
-	}
+    y -= font->ascent;
+    blit_cells(font, s, x, y, font->cwidth, 0, fg, bg);
+    mark_dirty(x, y, x + n * font->cwidth, y + font->cheight);
 
-	return x;
+    return x + n * font->cwidth;
 }
 
-int gr_text_l(int x, int y, const char *s)
+int gr_text_cells_l(int x, int y, const char *s,
+                    const gr_pixel *fg, const gr_pixel *bg)
 {
-	GGLContext *gl = gr_context;
-	GRFont *font = gr_font_l;
-	unsigned off;
+    GRFont *font = gr_font_l;
+    int n = strlen(s);
+    int left = gr_fb_width() - (y - (int) font->ascent) - font->cheight;
+
+    blit_cells(font, s, left, x, 0, font->cwidth, fg, bg);
+    mark_dirty(left, x, left + font->width, x + n * font->cwidth);
 
-	y -= font->ascent;
+    return x + n * font->cwidth;
+}
 
-	gl->bindTexture(gl, &font->texture);
-	gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-	gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-	gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-	gl->enable(gl, GGL_TEXTURE_2D);
-	
-	while((off = *s++)) 
-	{
-		off -= 32;
-		if (off < 96) 
-		{
-		  gl->texCoord2i(gl, 0 - (gr_fb_width() - y), (off * font->cwidth) - x + 1);
-		  gl->recti(gl, gr_fb_width() - y - font->cheight, x, gr_fb_width() - 1 - y, x + font->cwidth);
-		}
-		x += font->cwidth;
-	}
+int gr_text(int x, int y, const char *s)
+{
+    return gr_text_cells(x, y, s, NULL, NULL);
+}
 
-	return x;
+int gr_text_l(int x, int y, const char *s)
+{
+    return gr_text_cells_l(x, y, s, NULL, NULL);
 }
 
 void gr_fill(int x, int y, int w, int h)
@@ -219,6 +604,7 @@ void gr_fill(int x, int y, int w, int h)
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x, y, w, h);
+    mark_dirty(x, y, w, h);
 }
 
 void gr_fill_l(int x, int y, int w, int h)
@@ -226,6 +612,7 @@ void gr_fill_l(int x, int y, int w, int h)
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, gr_fb_width() - h, x, gr_fb_width() - y, w);
+    mark_dirty(gr_fb_width() - h, x, gr_fb_width() - y, w);
 }
 
 void gr_clear()
@@ -247,6 +634,29 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     gl->enable(gl, GGL_TEXTURE_2D);
     gl->texCoord2i(gl, sx - dx, sy - dy);
     gl->recti(gl, dx, dy, dx + w, dy + h);
+    mark_dirty(dx, dy, dx + w, dy + h);
+}
+
+void gr_move(int sx, int sy, int w, int h, int dx, int dy) {
+    gr_pixel *data = (gr_pixel *) gr_mem_surface.data;
+    int stride = gr_mem_surface.stride;
+    int y;
+
+    if (w <= 0 || h <= 0 || sx < 0 || sy < 0 || dx < 0 || dy < 0 ||
+        sx + w > (int) gr_mem_surface.width || dx + w > (int) gr_mem_surface.width ||
+        sy + h > (int) gr_mem_surface.height || dy + h > (int) gr_mem_surface.height) {
+        return;
+    }
+
+    /* rows in the order that doesn't overwrite ones still to be moved */
+    if (dy > sy) {
+        for (y = h - 1; y >= 0; y--)
+            memmove(data + (dy + y) * stride + dx, data + (sy + y) * stride + sx, w * 2);
+    } else {
+        for (y = 0; y < h; y++)
+            memmove(data + (dy + y) * stride + dx, data + (sy + y) * stride + sx, w * 2);
+    }
+    mark_dirty(dx, dy, dx + w, dy + h);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -265,36 +675,12 @@ unsigned int gr_get_height(gr_surface surface) {
 
 static void gr_init_font(void)
 {
-    GGLSurface *ftex, *ftex_l;
-    unsigned char *bits, *bits_l, *load_data, *rle;
+    unsigned char *bits, *load_data;
     unsigned char *in, data;
-
-		//portrait
-    gr_font = calloc(sizeof(*gr_font), 1);
-    ftex = &gr_font->texture;
+    unsigned c, r, i;
 
     bits = malloc(font.width * font.height);
-		load_data = bits;
-
-    ftex->version = sizeof(*ftex);
-    ftex->width = font.width;
-    ftex->height = font.height;
-    ftex->stride = font.width;
-    ftex->data = (void*) bits;
-    ftex->format = GGL_PIXEL_FORMAT_A_8;
-		
-		//landscape
-		gr_font_l = calloc(sizeof(*gr_font_l), 1);
-    ftex_l = &gr_font_l->texture;
-    
-		bits_l = malloc(font.width * font.height);
-
-    ftex_l->version = sizeof(*ftex);
-    ftex_l->width = font.height;
-    ftex_l->height = font.width;
-    ftex_l->stride = font.height;
-    ftex_l->data = (void*) bits_l;
-    ftex_l->format = GGL_PIXEL_FORMAT_A_8;
+    load_data = bits;
 
     in = font.rundata;
     while((data = *in++)) {
@@ -302,27 +688,47 @@ static void gr_init_font(void)
         load_data += (data & 0x7f);
     }
 
-		//landscape transformation
-		unsigned int i,j;
-		for (i = 0; i < font.height; i++)
-			for (j = 0; j < font.width; j++)
-				bits_l[j * font.height + i] = bits[(font.height - 1 - i) * font.width + j];
-
+    //portrait: a row of the glyph per row of the screen
+    gr_font = calloc(sizeof(*gr_font), 1);
+    gr_font->rows = font.cheight;
+    gr_font->width = font.cwidth;
+    gr_font->glyphs = calloc(96 * gr_font->rows, sizeof(unsigned));
+    for (c = 0; c < 96; c++)
+        for (r = 0; r < font.cheight; r++)
+            for (i = 0; i < font.cwidth; i++)
+                if (bits[r * font.width + c * font.cwidth + i])
+                    gr_font->glyphs[c * gr_font->rows + r] |= 1u << i;
+
+    //landscape: a column of the glyph per row of the screen, bottom row
+    //leftmost.  This is how the rotated texture has always been sampled:
+    //a column to the right, and without the glyph's top row.
+    gr_font_l = calloc(sizeof(*gr_font_l), 1);
+    gr_font_l->rows = font.cwidth;
+    gr_font_l->width = font.cheight;
+    gr_font_l->glyphs = calloc(96 * gr_font_l->rows, sizeof(unsigned));
+    for (c = 0; c < 96; c++)
+        for (r = 0; r < font.cwidth; r++)
+            for (i = 0; i < font.cheight - 1; i++) {
+                unsigned column = (c * font.cwidth + r + 1) % font.width;
+                if (bits[(font.cheight - 1 - i) * font.width + column])
+                    gr_font_l->glyphs[c * gr_font_l->rows + r] |= 1u << i;
+            }
+
+    free(bits);
+
+    gr_font->full = (1u << gr_font->width) - 1;
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
     
+    gr_font_l->full = (1u << gr_font_l->width) - 1;
     gr_font_l->cwidth = font.cwidth;
     gr_font_l->cheight = font.cheight;
     gr_font_l->ascent = font.cheight - 2;
 }
 
-int gr_init(void)
+static int open_display(void)
 {
-    gglInit(&gr_context);
-    GGLContext *gl = gr_context;
-
-    gr_init_font();
     gr_vt_fd = open("/dev/tty0", O_RDWR | O_SYNC);
     if (gr_vt_fd < 0) {
         // This is non-fatal; post-Cupcake kernels don't have tty0.
@@ -340,8 +746,30 @@ int gr_init(void)
         gr_exit();
         return -1;
     }
+    return 0;
+}
+
+int gr_init(void)
+{
+    gglInit(&gr_context);
+    GGLContext *gl = gr_context;
+
+    gr_init_font();
+
+    const char *headless = getenv(MINUI_HEADLESS_ENV);
+    if (headless != NULL) {
+        gr_headless = 1;
+        if (get_headless_framebuffer(gr_framebuffer, headless) < 0) {
+            return -1;
+        }
+        atexit(print_frame_stats);
+    } else if (open_display() < 0) {
+        return -1;
+    }
 
     get_memory_surface(&gr_mem_surface);
+    /* neither page has anything of ours in it yet */
+    mark_dirty(0, 0, vi.xres, vi.yres);
 
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
@@ -349,6 +777,7 @@ int gr_init(void)
         /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
     set_active_framebuffer(0);
+    dump_shown_page();
     gl->colorBuffer(gl, &gr_mem_surface);
 
 
@@ -361,6 +790,10 @@ int gr_init(void)
 
 void gr_exit(void)
 {
+    if (gr_headless) {
+        free(gr_framebuffer[0].data);
+        gr_framebuffer[0].data = gr_framebuffer[1].data = NULL;
+    }
     close(gr_fb_fd);
     gr_fb_fd = -1;
 
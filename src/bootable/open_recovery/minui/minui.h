@@ -20,6 +20,18 @@
 typedef void* gr_surface;
 typedef unsigned short gr_pixel;
 
+// Off the phone, the ui can run on a framebuffer in memory and scripted
+// keys, chosen with these environment variables:
+//   MINUI_HEADLESS=<width>x<height>  no fb0 or tty0; the frame time of
+//                                    every frame goes to stderr
+//   MINUI_DUMP=<dir>                 with it, every frame shown is written
+//                                    there as frame-NNNNN.ppm
+//   MINUI_KEYS=<file>                keys come from the file instead of
+//                                    /dev/input (see events.c)
+#define MINUI_HEADLESS_ENV "MINUI_HEADLESS"
+#define MINUI_DUMP_ENV     "MINUI_DUMP"
+#define MINUI_KEYS_ENV     "MINUI_KEYS"
+
 int gr_init(void);
 void gr_exit(void);
 
@@ -28,6 +40,25 @@ int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
 
+// The render loop.  Once started, fn is called on a thread of its own,
+// at the start of a display refresh, whenever a frame has been asked
+// for; it draws and calls gr_flip().  Any number of requests made in
+// between result in a single frame.  Returns negative if it can't
+// start; then the callers have to draw and flip themselves.
+typedef void (*gr_render_fn)(void *cookie);
+int gr_render_start(gr_render_fn fn, void *cookie);
+void gr_request_frame(void);
+
+// Counters since gr_init(): frames flipped, frames asked for, and the
+// total time spent drawing them and copying them to the framebuffer.
+typedef struct {
+    unsigned long frames;
+    unsigned long requests;
+    long long render_us;
+    long long copy_us;
+} gr_frame_stats;
+void gr_get_frame_stats(gr_frame_stats *stats);
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_fill(int x, int y, int w, int h);
 int gr_text(int x, int y, const char *s);
@@ -39,7 +70,19 @@ void gr_clear();
 void gr_fill_l(int x, int y, int w, int h);
 int gr_text_l(int x, int y, const char *s);
 
+// Text as a run of character cells, written straight into the surface:
+// character i in fg[i] (or the current color if fg is NULL), over a
+// solid bg (or over what is already there if bg is NULL).  Much cheaper
+// than a gr_color() and gr_text() per character.
+gr_pixel gr_rgb(unsigned char r, unsigned char g, unsigned char b);
+int gr_text_cells(int x, int y, const char *s,
+                  const gr_pixel *fg, const gr_pixel *bg);
+int gr_text_cells_l(int x, int y, const char *s,
+                    const gr_pixel *fg, const gr_pixel *bg);
+
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
+// Move a rectangle of the screen to (dx, dy); the two may overlap.
+void gr_move(int sx, int sy, int w, int h, int dx, int dy);
 unsigned int gr_get_width(gr_surface surface);
 unsigned int gr_get_height(gr_surface surface);
 
@@ -54,7 +97,12 @@ int ev_get(struct input_event *ev, unsigned dont_wait);
 // Resources
 
 // Returns 0 if no error, else negative.
+// Loads /res/images/<name>.sfc if it is there and up to date, otherwise
+// decodes <name>.png and leaves the .sfc behind for the next time.
 int res_create_surface(const char* name, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 
+// Decodes a png into the .sfc format res_create_surface() maps.
+int res_make_surface_cache(const char* pngPath, const char* cachePath);
+
 #endif
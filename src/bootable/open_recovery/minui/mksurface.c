@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Surface Cache Tool
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Converts theme images to the .sfc files res_create_surface() maps, so
+// that a theme can ship them and the recovery never decodes a png:
+//
+//   mksurface_orcvr images/*.png
+//
+// writes images/<name>.sfc next to every images/<name>.png.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "minui.h"
+
+int main(int argc, char** argv)
+{
+    char cachePath[256];
+    int i, failed = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: mksurface_orcvr <image.png> ...\n");
+        return 2;
+    }
+
+    for (i = 1; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        if (len < 4 || strcmp(argv[i] + len - 4, ".png") != 0 ||
+            len >= sizeof(cachePath)) {
+            fprintf(stderr, "%s: not a .png\n", argv[i]);
+            failed = 1;
+            continue;
+        }
+        strcpy(cachePath, argv[i]);
+        strcpy(cachePath + len - 4, ".sfc");
+
+        int result = res_make_surface_cache(argv[i], cachePath);
+        if (result < 0) {
+            fprintf(stderr, "%s: can't convert (code %d)\n", argv[i], result);
+            failed = 1;
+        }
+    }
+    return failed;
+}
@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -22,6 +24,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -30,6 +33,7 @@
 #include <pixelflinger/pixelflinger.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "minui.h"
 
@@ -41,17 +45,57 @@ double pow(double x, double y) {
     return x;
 }
 
-int res_create_surface(const char* name, gr_surface* pSurface) {
-    char resPath[256];
-    GGLSurface* surface = NULL;
+// Decoded images are cached next to the png, as <name>.sfc: this
+// header followed by the pixels exactly as pixelflinger reads them, so
+// that the next start (or a theme shipping them) only has to map the
+// file.  Opaque images are stored as RGB 565, which is what the
+// framebuffer holds anyway, and ones with alpha as RGBA 8888.  The
+// header and pixels are in the byte order of the phone, so a host
+// building them has to be little endian too.
+//
+// The cache is tied to its png by the png's size and crc32; not by its
+// mtime, which doesn't survive a theme being unpacked or copied.
+#define SURFACE_CACHE_MAGIC   0x4653524f    // "ORSF"
+#define SURFACE_CACHE_VERSION 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t png_size;      // size of the png it was made from
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // in pixels
+    uint32_t format;        // GGL_PIXEL_FORMAT_*
+    uint32_t png_crc;       // crc32 of the png
+} SurfaceCacheHeader;
+
+// What a cache is checked against; size is -1 if there's no png.
+typedef struct {
+    off_t size;
+    uint32_t crc;
+} PngId;
+
+// What gr_surface points to.  The pixels either follow it in the same
+// allocation, or are in a mapped cache file.
+typedef struct {
+    GGLSurface surface;
+    void* map;
+    size_t map_size;
+} ResSurface;
+
+static int bytes_per_pixel(int format) {
+    return format == GGL_PIXEL_FORMAT_RGB_565 ? 2 : 4;
+}
+
+static int decode_png(const char* path, ResSurface** pSurface) {
+    ResSurface* surface = NULL;
+    unsigned char* rgb = NULL;
     int result = 0;
     unsigned char header[8];
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
 
-    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
-    resPath[sizeof(resPath)-1] = '\0';
-    FILE* fp = fopen(resPath, "rb");
+    FILE* fp = fopen(path, "rb");
     if (fp == NULL) {
         result = -1;
         goto exit;
@@ -89,53 +133,56 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
     png_set_sig_bytes(png_ptr, sizeof(header));
     png_read_info(png_ptr, info_ptr);
 
-    size_t width = info_ptr->width;
-    size_t height = info_ptr->height;
-    size_t stride = 4 * width;
-    size_t pixelSize = stride * height;
+    size_t width = png_get_image_width(png_ptr, info_ptr);
+    size_t height = png_get_image_height(png_ptr, info_ptr);
 
-    int color_type = info_ptr->color_type;
-    int bit_depth = info_ptr->bit_depth;
-    int channels = info_ptr->channels;
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    int channels = png_get_channels(png_ptr, info_ptr);
     if (bit_depth != 8 || (channels != 3 && channels != 4) ||
         (color_type != PNG_COLOR_TYPE_RGB &&
          color_type != PNG_COLOR_TYPE_RGBA)) {
-        return -7;
+        result = -7;
         goto exit;
     }
 
-    surface = malloc(sizeof(GGLSurface) + pixelSize);
+    int format = (channels == 3) ?
+            GGL_PIXEL_FORMAT_RGB_565 : GGL_PIXEL_FORMAT_RGBA_8888;
+    size_t stride = bytes_per_pixel(format) * width;
+    size_t pixelSize = stride * height;
+
+    surface = malloc(sizeof(ResSurface) + pixelSize);
     if (surface == NULL) {
         result = -8;
         goto exit;
     }
     unsigned char* pData = (unsigned char*) (surface + 1);
-    surface->version = sizeof(GGLSurface);
-    surface->width = width;
-    surface->height = height;
-    surface->stride = width; /* Yes, pixels, not bytes */
-    surface->data = pData;
-    surface->format = (channels == 3) ?
-            GGL_PIXEL_FORMAT_RGBX_8888 : GGL_PIXEL_FORMAT_RGBA_8888;
+    surface->surface.version = sizeof(GGLSurface);
+    surface->surface.width = width;
+    surface->surface.height = height;
+    surface->surface.stride = width; /* Yes, pixels, not bytes */
+    surface->surface.data = pData;
+    surface->surface.format = format;
+    surface->map = NULL;
+    surface->map_size = 0;
 
     int y;
     if (channels == 3) {
+        rgb = malloc(3 * width);
+        if (rgb == NULL) {
+            result = -8;
+            goto exit;
+        }
         for (y = 0; y < height; ++y) {
-            unsigned char* pRow = pData + y * stride;
-            png_read_row(png_ptr, pRow, NULL);
+            uint16_t* pRow = (uint16_t*) (pData + y * stride);
+            png_read_row(png_ptr, rgb, NULL);
 
             int x;
-            for(x = width - 1; x >= 0; x--) {
-                int sx = x * 3;
-                int dx = x * 4;
-                unsigned char r = pRow[sx];
-                unsigned char g = pRow[sx + 1];
-                unsigned char b = pRow[sx + 2];
-                unsigned char a = 0xff;
-                pRow[dx    ] = r; // r
-                pRow[dx + 1] = g; // g
-                pRow[dx + 2] = b; // b
-                pRow[dx + 3] = a;
+            for (x = 0; x < width; x++) {
+                unsigned char r = rgb[x * 3];
+                unsigned char g = rgb[x * 3 + 1];
+                unsigned char b = rgb[x * 3 + 2];
+                pRow[x] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
             }
         }
     } else {
@@ -145,7 +192,7 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
         }
     }
 
-    *pSurface = (gr_surface) surface;
+    *pSurface = surface;
 
 exit:
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
@@ -153,6 +200,7 @@ exit:
     if (fp != NULL) {
         fclose(fp);
     }
+    free(rgb);
     if (result < 0) {
         if (surface) {
             free(surface);
@@ -161,9 +209,160 @@ exit:
     return result;
 }
 
+// Reading the png is cheap next to decoding it.
+static int identify_png(const char* path, PngId* id) {
+    unsigned char buffer[4096];
+    size_t n;
+    FILE* fp = fopen(path, "rb");
+
+    id->size = -1;
+    id->crc = crc32(0L, Z_NULL, 0);
+    if (fp == NULL) {
+        return -1;
+    }
+    id->size = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        id->crc = crc32(id->crc, buffer, n);
+        id->size += n;
+    }
+    if (ferror(fp)) {
+        id->size = -1;
+    }
+    fclose(fp);
+    return id->size < 0 ? -1 : 0;
+}
+
+static int map_surface_cache(const char* path, const PngId* png, ResSurface** pSurface) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    SurfaceCacheHeader header;
+    if (fstat(fd, &st) < 0 ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != SURFACE_CACHE_MAGIC ||
+        header.version != SURFACE_CACHE_VERSION ||
+        (png->size >= 0 &&
+         (header.png_size != png->size || header.png_crc != png->crc)) ||
+        (header.format != GGL_PIXEL_FORMAT_RGB_565 &&
+         header.format != GGL_PIXEL_FORMAT_RGBA_8888) ||
+        header.stride < header.width ||
+        st.st_size != sizeof(header) +
+            (off_t) header.stride * header.height * bytes_per_pixel(header.format)) {
+        close(fd);
+        return -1;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    ResSurface* surface = malloc(sizeof(ResSurface));
+    if (surface == NULL) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    surface->surface.version = sizeof(GGLSurface);
+    surface->surface.width = header.width;
+    surface->surface.height = header.height;
+    surface->surface.stride = header.stride;
+    surface->surface.data = (unsigned char*) map + sizeof(header);
+    surface->surface.format = header.format;
+    surface->map = map;
+    surface->map_size = st.st_size;
+
+    *pSurface = surface;
+    return 0;
+}
+
+static int write_surface_cache(const char* path, const PngId* png, const ResSurface* surface) {
+    const GGLSurface* s = &surface->surface;
+    SurfaceCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SURFACE_CACHE_MAGIC;
+    header.version = SURFACE_CACHE_VERSION;
+    header.png_size = png->size;
+    header.png_crc = png->crc;
+    header.width = s->width;
+    header.height = s->height;
+    header.stride = s->stride;
+    header.format = s->format;
+
+    // Written aside and renamed, so that a crash (or a full disk) never
+    // leaves a short file that looks like a cache.
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    size_t pixelSize = (size_t) s->stride * s->height * bytes_per_pixel(s->format);
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(s->data, 1, pixelSize, fp) == pixelSize;
+    if (fclose(fp) != 0 || !ok || rename(tmpPath, path) < 0) {
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
+}
+
+int res_create_surface(const char* name, gr_surface* pSurface) {
+    char resPath[256];
+    char cachePath[256];
+    ResSurface* surface = NULL;
+
+    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
+    resPath[sizeof(resPath)-1] = '\0';
+    snprintf(cachePath, sizeof(cachePath)-1, "/res/images/%s.sfc", name);
+    cachePath[sizeof(cachePath)-1] = '\0';
+
+    // A theme may ship only the caches; if it has the png, the cache
+    // has to have been made from it.
+    PngId png;
+    identify_png(resPath, &png);
+
+    if (map_surface_cache(cachePath, &png, &surface) == 0) {
+        *pSurface = (gr_surface) surface;
+        return 0;
+    }
+
+    int result = decode_png(resPath, &surface);
+    if (result < 0) {
+        return result;
+    }
+    if (write_surface_cache(cachePath, &png, surface) < 0) {
+        unlink(cachePath);
+    }
+
+    *pSurface = (gr_surface) surface;
+    return 0;
+}
+
+int res_make_surface_cache(const char* pngPath, const char* cachePath) {
+    PngId png;
+    ResSurface* surface = NULL;
+    if (identify_png(pngPath, &png) < 0) {
+        return -1;
+    }
+    int result = decode_png(pngPath, &surface);
+    if (result < 0) {
+        return result;
+    }
+    result = write_surface_cache(cachePath, &png, surface);
+    res_free_surface((gr_surface) surface);
+    return result;
+}
+
 void res_free_surface(gr_surface surface) {
-    GGLSurface* pSurface = (GGLSurface*) surface;
+    ResSurface* pSurface = (ResSurface*) surface;
     if (pSurface) {
+        if (pSurface->map != NULL) {
+            munmap(pSurface->map, pSurface->map_size);
+        }
         free(pSurface);
     }
 }
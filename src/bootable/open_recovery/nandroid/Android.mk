@@ -0,0 +1,20 @@
+ifneq ($(TARGET_SIMULATOR),true)
+ifeq ($(TARGET_ARCH),arm)
+
+#open recovery nandroid (backup engine and incremental backup store)
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := nandroid.c store.c engine.c backup.c restore.c plan.c md5.c
+LOCAL_CFLAGS := -Os
+LOCAL_MODULE := nandroid-or
+LOCAL_MODULE_TAGS := eng
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_PATH := $(TARGET_RECOVERY_OUT)
+LOCAL_UNSTRIPPED_PATH := $(TARGET_OUT_UNSTRIPPED)/recovery/
+LOCAL_C_INCLUDES += external/bzip2 bootable/open_recovery
+LOCAL_STATIC_LIBRARIES := libmtdutils_orcvr libmincrypt libbz libcutils libc
+include $(BUILD_EXECUTABLE)
+
+endif	# TARGET_ARCH == arm
+endif	# !TARGET_SIMULATOR
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// nandroid-or backup: each partition is read once and goes straight
+// through the md5, the compressor or the chunk store, and onto the
+// sdcard.  Partitions are backed up on several threads at once.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+#include "engine.h"
+#include "md5.h"
+#include "mtdutils/mtdutils.h"
+#include "store.h"
+
+#define BUFFER_SIZE    (128*1024)
+#define MTD_ATTEMPTS   5
+
+typedef struct {
+    const PartitionInfo* part;
+    long long estimate;             // bytes to read, for the progress bar
+    int done;
+    long long in;                   // what was measured, for the plan
+    long long out;
+    long long msec;
+} BackupJob;
+
+typedef struct {
+    const char* dir;
+    int compress;
+    const char* store;              // incremental backups only
+    BackupMode mode;
+    BackupJob* jobs;
+} Backup;
+
+// Where a partition's data comes from: the MTD device itself, or the
+// stdout of mkyaffs2image or tar.
+typedef struct {
+    MtdReadContext* mtd;
+    size_t erase_size;
+    int fd;
+    pid_t pid;
+    const char* program;
+} Source;
+
+static int OpenSource(Source* s, const PartitionInfo* p) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->pid = -1;
+
+    if (p->type == PART_MTD) {
+        const MtdPartition* mtd = mtd_find_partition_by_name(p->mtd);
+        if (mtd == NULL ||
+            mtd_partition_info(mtd, NULL, &s->erase_size, NULL) < 0) {
+            fprintf(stderr, "can't find %s partition\n", p->mtd);
+            return -1;
+        }
+        if (s->erase_size > BUFFER_SIZE) {
+            fprintf(stderr, "%s: erase size %u is too large\n", p->mtd,
+                    (unsigned) s->erase_size);
+            return -1;
+        }
+        s->mtd = mtd_read_partition(mtd);
+        if (s->mtd == NULL) {
+            fprintf(stderr, "can't read %s: %s\n", p->mtd, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (p->type == PART_YAFFS2) {
+        char* argv[] = { "mkyaffs2image", (char*) p->mount_point, "-", NULL };
+        s->program = argv[0];
+        s->pid = SpawnChild(argv, "mkyaffs2image-or", NULL, 1, &s->fd);
+    } else {
+        char* argv[] = { "tar", "-cf", "-", ".", NULL };
+        s->program = argv[0];
+        s->pid = SpawnChild(argv, NULL, p->mount_point, 1, &s->fd);
+    }
+    return s->pid < 0 ? -1 : 0;
+}
+
+// Return up to BUFFER_SIZE bytes, 0 at the end, or -1 on error.
+static ssize_t ReadSource(Source* s, unsigned char* buf) {
+    if (s->mtd != NULL) {
+        // One erase block at a time: mtd_read_data() throws away
+        // everything it read in a call that runs off the end.
+        ssize_t n = mtd_read_data(s->mtd, (char*) buf, s->erase_size);
+        if (n < 0 && errno == ENOSPC) return 0;
+        return n;
+    }
+    return ReadFully(s->fd, buf, BUFFER_SIZE);
+}
+
+static int CloseSource(Source* s, int complete) {
+    if (s->mtd != NULL) {
+        mtd_read_close(s->mtd);
+        return 0;
+    }
+    if (s->pid < 0) return -1;
+    if (!complete) kill(s->pid, SIGTERM);
+    close(s->fd);
+    return WaitChild(s->pid, s->program);
+}
+
+// Where it goes: <name>.img, <name>.img.bz2, or the store and
+// <name>.manifest.
+typedef struct {
+    char path[PATH_MAX];
+    int fd;
+    long long written;
+    int compress;
+    bz_stream bz;
+    unsigned char* zbuf;
+    int incremental;
+    StoreWriter store;
+} Output;
+
+static int OpenOutput(Output* o, const Backup* b, const PartitionInfo* p) {
+    char image[32];
+    ImageName(p, image, sizeof(image));
+
+    memset(o, 0, sizeof(*o));
+    o->fd = -1;
+    if (b->store != NULL) {
+        o->incremental = 1;
+        snprintf(o->path, sizeof(o->path), "%s/%s.manifest", b->dir, p->name);
+        return StoreWriterInit(&o->store, b->store);
+    }
+
+    snprintf(o->path, sizeof(o->path), "%s/%s%s", b->dir, image,
+             b->compress ? ".bz2" : "");
+    o->fd = open(o->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (o->fd < 0) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", o->path, strerror(errno));
+        return -1;
+    }
+    if (b->compress) {
+        // bzip2 -6, as the backups have always been compressed.
+        o->zbuf = malloc(BUFFER_SIZE);
+        if (o->zbuf == NULL || BZ2_bzCompressInit(&o->bz, 6, 0, 0) != BZ_OK) {
+            fprintf(stderr, "failed to start bzip2 for \"%s\"\n", o->path);
+            return -1;
+        }
+        o->compress = 1;
+    }
+    return 0;
+}
+
+static int Compress(Output* o, const unsigned char* data, size_t len,
+                    int action) {
+    o->bz.next_in = (char*) data;
+    o->bz.avail_in = len;
+    for (;;) {
+        o->bz.next_out = (char*) o->zbuf;
+        o->bz.avail_out = BUFFER_SIZE;
+        int r = BZ2_bzCompress(&o->bz, action);
+        if (r < 0) {
+            fprintf(stderr, "bzip2 error %d on \"%s\"\n", r, o->path);
+            return -1;
+        }
+        size_t have = BUFFER_SIZE - o->bz.avail_out;
+        if (have > 0 && WriteFully(o->fd, o->zbuf, have) < 0) {
+            fprintf(stderr, "failed to write \"%s\": %s\n", o->path, strerror(errno));
+            return -1;
+        }
+        o->written += have;
+        if (action == BZ_RUN ? o->bz.avail_in == 0 : r == BZ_STREAM_END) {
+            return 0;
+        }
+    }
+}
+
+static int WriteOutput(Output* o, const unsigned char* data, size_t len) {
+    if (o->incremental) return StoreWriterAdd(&o->store, data, len);
+    if (o->compress) return Compress(o, data, len, BZ_RUN);
+    if (WriteFully(o->fd, data, len) < 0) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", o->path, strerror(errno));
+        return -1;
+    }
+    o->written += len;
+    return 0;
+}
+
+// Finish the output if ok, or remove it.  Return 0 if it's complete.
+static int CloseOutput(Output* o, int ok) {
+    if (o->incremental) {
+        if (ok && (StoreWriterFinish(&o->store) < 0 ||
+                   WriteManifest(o->path, &o->store.manifest) < 0)) {
+            ok = 0;
+        }
+        o->written = o->store.added_bytes;
+        StoreWriterFree(&o->store);
+        return ok ? 0 : -1;
+    }
+
+    if (o->compress) {
+        if (ok && Compress(o, NULL, 0, BZ_FINISH) < 0) ok = 0;
+        BZ2_bzCompressEnd(&o->bz);
+    }
+    free(o->zbuf);
+    if (o->fd >= 0) {
+        if (ok && (fsync(o->fd) < 0 || close(o->fd) < 0)) {
+            fprintf(stderr, "failed to write \"%s\": %s\n", o->path, strerror(errno));
+            ok = 0;
+        } else if (!ok) {
+            close(o->fd);
+        }
+    }
+    if (!ok && o->path[0] != '\0') unlink(o->path);
+    return ok ? 0 : -1;
+}
+
+// Copy a partition to its output, hashing it on the way.
+static int DumpPartition(const Backup* b, BackupJob* job,
+                         unsigned char* buf, uint8_t* md5) {
+    const PartitionInfo* p = job->part;
+    Source s;
+    Output o;
+    if (OpenSource(&s, p) < 0) return -1;
+    if (OpenOutput(&o, b, p) < 0) {
+        CloseSource(&s, 0);
+        CloseOutput(&o, 0);
+        return -1;
+    }
+
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    int ok = 1;
+    ssize_t n;
+    while ((n = ReadSource(&s, buf)) > 0) {
+        MD5_update(&ctx, buf, n);
+        if (WriteOutput(&o, buf, n) < 0) {
+            ok = 0;
+            break;
+        }
+        ProgressAdd(n);
+    }
+    if (n < 0) {
+        fprintf(stderr, "failed to read %s: %s\n", p->name, strerror(errno));
+        ok = 0;
+    }
+    if (CloseSource(&s, ok) < 0) ok = 0;
+    if (CloseOutput(&o, ok) < 0) ok = 0;
+    memcpy(md5, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    job->in = ctx.count;
+    job->out = o.written;
+    return ok ? 0 : -1;
+}
+
+// Read a raw partition again.  Reads of some of these partitions are
+// flaky, so a dump is only trusted when a second read agrees with it.
+static int HashPartition(const PartitionInfo* p, unsigned char* buf,
+                         uint8_t* md5) {
+    Source s;
+    if (OpenSource(&s, p) < 0) return -1;
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    ssize_t n;
+    while ((n = ReadSource(&s, buf)) > 0) {
+        MD5_update(&ctx, buf, n);
+        ProgressAdd(n);
+    }
+    CloseSource(&s, n == 0);
+    memcpy(md5, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    return n == 0 ? 0 : -1;
+}
+
+// <name>.md5 in md5sum's format, for the restore to check.
+static int WriteMd5File(const Backup* b, const PartitionInfo* p,
+                        const uint8_t* md5) {
+    char path[PATH_MAX];
+    char image[32];
+    char hex[MD5_DIGEST_SIZE*2+1];
+    ImageName(p, image, sizeof(image));
+    HexBytes(md5, MD5_DIGEST_SIZE, hex);
+    snprintf(path, sizeof(path), "%s/%s.md5", b->dir, p->name);
+
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "%s  %s\n", hex, image);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int BackupJobFn(int index, void* cookie) {
+    const Backup* b = cookie;
+    BackupJob* job = b->jobs + index;
+    const PartitionInfo* p = job->part;
+    unsigned char* buf = malloc(BUFFER_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    Message("%s: %s...\n", p->name, b->store ? "Storing" : "Dumping");
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    uint8_t md5[MD5_DIGEST_SIZE];
+    int attempts = p->type == PART_MTD ? MTD_ATTEMPTS : 1;
+    int ok = 0;
+    while (!ok && attempts-- > 0) {
+        if (DumpPartition(b, job, buf, md5) < 0) continue;
+        if (p->type == PART_MTD) {
+            uint8_t again[MD5_DIGEST_SIZE];
+            if (HashPartition(p, buf, again) < 0 ||
+                memcmp(md5, again, MD5_DIGEST_SIZE) != 0) {
+                fprintf(stderr, "%s: reads disagree, retrying\n", p->name);
+                continue;
+            }
+        }
+        ok = 1;
+    }
+    if (ok && b->store == NULL && WriteMd5File(b, p, md5) < 0) ok = 0;
+    free(buf);
+
+    if (!ok) {
+        Message("E:Fatal error while trying to dump %s, aborting.\n", p->name);
+        return -1;
+    }
+    job->msec = ElapsedMs(&start);
+    job->done = 1;
+    Message("%s: done\n", p->name);
+    return 0;
+}
+
+// Remember how the partitions went, for the next plan.
+static void RecordStats(const Backup* b, int count) {
+    Throughput stats[BACKUP_MODES][PART_TYPES];
+    ReadStats(DEFAULT_STATS, stats);
+    int i;
+    for (i = 0; i < count; ++i) {
+        const BackupJob* job = b->jobs + i;
+        if (!job->done || job->in == 0) continue;
+        AddStats(&stats[b->mode][job->part->type], job->in, job->out, job->msec);
+    }
+    WriteStats(DEFAULT_STATS, stats);
+}
+
+// Biggest first, so that the small ones fill in around it.
+static int CompareJobs(const void* a, const void* b) {
+    long long x = ((const BackupJob*) a)->estimate;
+    long long y = ((const BackupJob*) b)->estimate;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int BackupUsage(void) {
+    fprintf(stderr, "usage: nandroid-or backup [-c] [-i <store>] [-j <jobs>] "
+            "<dir> <partition> ...\n");
+    return 2;
+}
+
+int BackupCommand(int argc, char** argv) {
+    Backup b;
+    memset(&b, 0, sizeof(b));
+    int threads = DEFAULT_JOBS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ci:j:")) != -1) {
+        switch (opt) {
+            case 'c': b.compress = 1; break;
+            case 'i': b.store = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            default: return BackupUsage();
+        }
+    }
+    if (argc - optind < 2 || threads < 1) return BackupUsage();
+    if (b.store != NULL) b.compress = 0;
+    b.mode = b.store ? BACKUP_STORE : b.compress ? BACKUP_BZIP2 : BACKUP_PLAIN;
+    b.dir = argv[optind++];
+
+    int count = argc - optind;
+    b.jobs = calloc(count, sizeof(BackupJob));
+    if (b.jobs == NULL) return 1;
+
+    int i;
+    int need_mtd = 0;
+    for (i = 0; i < count; ++i) {
+        b.jobs[i].part = FindPartitionInfo(argv[optind + i]);
+        if (b.jobs[i].part == NULL) {
+            fprintf(stderr, "unknown partition \"%s\"\n", argv[optind + i]);
+            return 2;
+        }
+        if (b.jobs[i].part->type == PART_MTD) need_mtd = 1;
+    }
+    if (need_mtd && mtd_scan_partitions() <= 0) {
+        fprintf(stderr, "error scanning partitions\n");
+        return 1;
+    }
+
+    long long total = 0;
+    for (i = 0; i < count; ++i) {
+        b.jobs[i].estimate = StreamSize(b.jobs[i].part);
+        if (b.jobs[i].part->type == PART_MTD) {
+            b.jobs[i].estimate *= 2;        // dumped, then read again
+        }
+        total += b.jobs[i].estimate;
+    }
+    qsort(b.jobs, count, sizeof(BackupJob), CompareJobs);
+
+    ProgressStart(total);
+    int failed = RunJobs(BackupJobFn, &b, count, threads);
+    sync();
+    RecordStats(&b, count);
+
+    free(b.jobs);
+    return failed ? 1 : 0;
+}
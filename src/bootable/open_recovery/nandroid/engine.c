@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "engine.h"
+
+static const PartitionInfo partitions[] = {
+    { "boot",    PART_MTD,    "boot",     NULL },
+    { "bpsw",    PART_MTD,    "bpsw",     NULL },
+    { "lbl",     PART_MTD,    "lbl",      NULL },
+    { "logo",    PART_MTD,    "logo",     NULL },
+    { "devtree", PART_MTD,    "devtree",  NULL },
+    { "system",  PART_YAFFS2, "system",   "/system" },
+    { "data",    PART_YAFFS2, "userdata", "/data" },
+    { "cache",   PART_YAFFS2, "cache",    "/cache" },
+    { "cust",    PART_YAFFS2, "cust",     "/cust" },
+    { "cdrom",   PART_YAFFS2, "cdrom",    "/cdrom" },
+    { "ext2",    PART_TAR,    NULL,       "/sddata", "/dev/block/mmcblk0p2" },
+};
+
+const PartitionInfo* FindPartitionInfo(const char* name) {
+    size_t i;
+    for (i = 0; i < sizeof(partitions) / sizeof(partitions[0]); ++i) {
+        if (strcmp(partitions[i].name, name) == 0) return partitions + i;
+    }
+    return NULL;
+}
+
+void ImageName(const PartitionInfo* p, char* out, size_t size) {
+    snprintf(out, size, "%s.%s", p->name, p->type == PART_TAR ? "tar" : "img");
+}
+
+//
+// Progress
+//
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static int progress_fd = -1;
+static long long progress_total;
+static long long progress_done;
+static int progress_shown;          // in steps of 1/PROGRESS_STEPS
+
+#define PROGRESS_STEPS 200
+
+static void ProgressCommand(const char* fmt, ...) {
+    char line[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (WriteFully(progress_fd, (unsigned char*) line, len) < 0) {
+        // The recovery went away; carry on without it.
+        close(progress_fd);
+        progress_fd = -1;
+    }
+}
+
+void ProgressStart(long long total) {
+    const char* env = getenv(PROGRESS_FD_ENV);
+    if (env == NULL || total <= 0) return;
+    progress_fd = atoi(env);
+    if (progress_fd <= 2 || fcntl(progress_fd, F_GETFD) < 0) {
+        progress_fd = -1;
+        return;
+    }
+    fcntl(progress_fd, F_SETFD, FD_CLOEXEC);
+    progress_total = total;
+    progress_done = 0;
+    progress_shown = 0;
+    ProgressCommand("progress 1.0 0\n");
+}
+
+void ProgressAdd(long long bytes) {
+    pthread_mutex_lock(&progress_lock);
+    if (progress_fd >= 0) {
+        progress_done += bytes;
+        if (progress_done > progress_total) progress_done = progress_total;
+        // Only talk to the recovery when the bar would visibly move.
+        int step = (int) (progress_done * PROGRESS_STEPS / progress_total);
+        if (step != progress_shown) {
+            progress_shown = step;
+            ProgressCommand("set_progress %.3f\n", (float) step / PROGRESS_STEPS);
+        }
+    }
+    pthread_mutex_unlock(&progress_lock);
+}
+
+void Message(const char* fmt, ...) {
+    static pthread_mutex_t message_lock = PTHREAD_MUTEX_INITIALIZER;
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    pthread_mutex_lock(&message_lock);
+    fputs(line, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&message_lock);
+}
+
+//
+// Child processes
+//
+
+// Held from pipe() to fork(), so that no child started by another job
+// inherits our end of the pipe (and keeps it from ever seeing EOF).
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pid_t SpawnChild(char* const argv[], const char* alternate, const char* dir,
+                 int child_fd, int* fd) {
+    int pipefd[2];
+    // pipefd[0] is the read end: ours if the child writes to stdout.
+    int ours = child_fd == 1 ? 0 : 1;
+
+    pthread_mutex_lock(&spawn_lock);
+    if (pipe(pipefd) < 0) {
+        pthread_mutex_unlock(&spawn_lock);
+        fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(pipefd[ours], F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, 2);
+            if (child_fd == 0) dup2(null, 1);
+        }
+        dup2(pipefd[1 - ours], child_fd);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (dir != NULL && chdir(dir) < 0) _exit(127);
+        execvp(argv[0], argv);
+        if (alternate != NULL) execvp(alternate, argv);
+        _exit(127);
+    }
+    close(pipefd[1 - ours]);
+    pthread_mutex_unlock(&spawn_lock);
+
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        close(pipefd[ours]);
+        return -1;
+    }
+    *fd = pipefd[ours];
+    return pid;
+}
+
+int WaitChild(pid_t pid, const char* name) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "waitpid %s failed: %s\n", name, strerror(errno));
+            return -1;
+        }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return 0;
+    if (WIFEXITED(status)) {
+        fprintf(stderr, "%s exited with status %d\n", name, WEXITSTATUS(status));
+    } else {
+        fprintf(stderr, "%s terminated by signal %d\n", name, WTERMSIG(status));
+    }
+    return -1;
+}
+
+//
+// Jobs
+//
+
+typedef struct {
+    pthread_mutex_t lock;
+    JobFn fn;
+    void* cookie;
+    int count;
+    int next;
+    int failed;
+} JobQueue;
+
+static void* JobThread(void* arg) {
+    JobQueue* q = arg;
+    pthread_mutex_lock(&q->lock);
+    while (q->next < q->count && q->failed == 0) {
+        int index = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        int r = q->fn(index, q->cookie);
+        pthread_mutex_lock(&q->lock);
+        if (r != 0) ++q->failed;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+int RunJobs(JobFn fn, void* cookie, int count, int threads) {
+    JobQueue q;
+    pthread_mutex_init(&q.lock, NULL);
+    q.fn = fn;
+    q.cookie = cookie;
+    q.count = count;
+    q.next = 0;
+    q.failed = 0;
+
+    if (threads > count) threads = count;
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    while (tids != NULL && started < threads - 1 &&
+           pthread_create(tids + started, NULL, JobThread, &q) == 0) {
+        ++started;
+    }
+    // This thread is always one of the workers.
+    JobThread(&q);
+
+    int i;
+    for (i = 0; i < started; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    pthread_mutex_destroy(&q.lock);
+    return q.failed;
+}
+
+ssize_t ReadFully(int fd, unsigned char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+int WriteFully(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int ParseHexBytes(const char* str, uint8_t* out, int len) {
+    int i;
+    for (i = 0; i < len*2; ++i) {
+        char c = str[i];
+        int v;
+        if (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+        else return -1;
+        if (i & 1) out[i/2] |= v;
+        else out[i/2] = v << 4;
+    }
+    return 0;
+}
+
+void HexBytes(const uint8_t* data, int len, char* out) {
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < len; ++i) {
+        out[i*2] = hex[data[i] >> 4];
+        out[i*2+1] = hex[data[i] & 0xf];
+    }
+    out[len*2] = '\0';
+}
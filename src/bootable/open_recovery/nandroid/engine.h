@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_ENGINE_H
+#define _NANDROID_ENGINE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+// Pieces shared by the native backup and restore commands.
+
+typedef enum {
+    PART_MTD,       // raw dump of an MTD partition, <name>.img
+    PART_YAFFS2,    // mkyaffs2image of a mounted partition, <name>.img
+    PART_TAR,       // tarball of a mounted filesystem, <name>.tar
+    PART_TYPES
+} PartitionType;
+
+typedef struct {
+    const char* name;           // as used in the backup's file names
+    PartitionType type;
+    const char* mtd;            // MTD partition, or NULL
+    const char* mount_point;    // NULL for raw partitions
+    const char* device;         // block device of a PART_TAR, or NULL
+} PartitionInfo;
+
+const PartitionInfo* FindPartitionInfo(const char* name);
+
+// The uncompressed image name, as in the .md5 file: "boot.img".
+void ImageName(const PartitionInfo* p, char* out, size_t size);
+
+// How many bytes a backup of the partition reads (the raw partition,
+// the yaffs2 image or the tarball), as far as it can be told up front.
+long long StreamSize(const PartitionInfo* p);
+
+typedef enum {
+    BACKUP_PLAIN,
+    BACKUP_BZIP2,
+    BACKUP_STORE,
+    BACKUP_MODES
+} BackupMode;
+
+// Partitions backed up or restored at a time.
+#define DEFAULT_JOBS 2
+
+// What earlier backups of one kind of partition in one mode measured:
+// bytes read, bytes written, and the time taken.  Kept in
+// DEFAULT_STATS for the plan.
+typedef struct {
+    long long in;
+    long long out;
+    long long msec;
+} Throughput;
+
+#define DEFAULT_STATS "/sdcard/nandroid/stats"
+
+void ReadStats(const char* path, Throughput stats[BACKUP_MODES][PART_TYPES]);
+int WriteStats(const char* path, Throughput stats[BACKUP_MODES][PART_TYPES]);
+void AddStats(Throughput* s, long long in, long long out, long long msec);
+
+long long ElapsedMs(const struct timeval* start);
+
+// Progress goes to the recovery over the progress protocol (see
+// try_update_binary() in install.c), on the file descriptor named by
+// this variable.  Without it nothing is reported.
+#define PROGRESS_FD_ENV "OR_PROGRESS_FD"
+
+void ProgressStart(long long total);
+void ProgressAdd(long long bytes);
+
+// Print a whole line to stdout (which is the recovery's screen), so
+// that lines from concurrent jobs don't get mixed up.
+void Message(const char* fmt, ...);
+
+// Run argv (or, if argv[0] isn't found, alternate with the same
+// arguments) in dir, with child_fd (0 or 1) connected to a pipe whose
+// other end is returned in *fd.  stderr, and stdout if it isn't the
+// pipe, go to /dev/null.  Return the pid, or -1.
+pid_t SpawnChild(char* const argv[], const char* alternate, const char* dir,
+                 int child_fd, int* fd);
+
+// Wait for a child from SpawnChild().  Return 0 if it exited with 0.
+int WaitChild(pid_t pid, const char* name);
+
+// Call fn(0..count-1, cookie) on up to threads threads.  Once one call
+// fails no new ones are started.  Return the number that failed.
+typedef int (*JobFn)(int index, void* cookie);
+int RunJobs(JobFn fn, void* cookie, int count, int threads);
+
+ssize_t ReadFully(int fd, unsigned char* buf, size_t len);
+int WriteFully(int fd, const unsigned char* data, size_t len);
+
+void HexBytes(const uint8_t* data, int len, char* out);   // 2*len+1 bytes
+int ParseHexBytes(const char* str, uint8_t* out, int len);
+
+// Subcommands of nandroid-or; see nandroid.c.
+int BackupCommand(int argc, char** argv);
+int RestoreCommand(int argc, char** argv);
+int PlanCommand(int argc, char** argv);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "md5.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t R[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void MD5_transform(MD5_CTX* ctx, const uint8_t* block) {
+    uint32_t W[16];
+    int i;
+    for (i = 0; i < 16; ++i) {
+        W[i] = block[i*4] | (block[i*4+1] << 8) |
+            (block[i*4+2] << 16) | ((uint32_t)block[i*4+3] << 24);
+    }
+
+    uint32_t A = ctx->state[0];
+    uint32_t B = ctx->state[1];
+    uint32_t C = ctx->state[2];
+    uint32_t D = ctx->state[3];
+
+    for (i = 0; i < 64; ++i) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (B & C) | (~B & D);
+            g = i;
+        } else if (i < 32) {
+            f = (D & B) | (~D & C);
+            g = (5*i + 1) & 15;
+        } else if (i < 48) {
+            f = B ^ C ^ D;
+            g = (3*i + 5) & 15;
+        } else {
+            f = C ^ (B | ~D);
+            g = (7*i) & 15;
+        }
+        uint32_t tmp = D;
+        D = C;
+        C = B;
+        B = B + ROL(A + f + K[i] + W[g], R[i]);
+        A = tmp;
+    }
+
+    ctx->state[0] += A;
+    ctx->state[1] += B;
+    ctx->state[2] += C;
+    ctx->state[3] += D;
+}
+
+void MD5_init(MD5_CTX* ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void MD5_update(MD5_CTX* ctx, const void* data, int len) {
+    const uint8_t* p = data;
+    int i = (int) (ctx->count & 63);
+    ctx->count += len;
+
+    if (i > 0) {
+        int take = 64 - i < len ? 64 - i : len;
+        memcpy(ctx->buf + i, p, take);
+        p += take;
+        len -= take;
+        if (i + take < 64) return;
+        MD5_transform(ctx, ctx->buf);
+    }
+    while (len >= 64) {
+        MD5_transform(ctx, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+const uint8_t* MD5_final(MD5_CTX* ctx) {
+    uint64_t bits = ctx->count * 8;
+    static const uint8_t pad = 0x80;
+    static const uint8_t zero[64];
+    int i;
+
+    MD5_update(ctx, &pad, 1);
+    MD5_update(ctx, zero, (int) ((56 - (ctx->count & 63)) & 63));
+    for (i = 0; i < 8; ++i) {
+        uint8_t b = (uint8_t) (bits >> (i * 8));
+        MD5_update(ctx, &b, 1);
+    }
+
+    for (i = 0; i < 4; ++i) {
+        uint32_t s = ctx->state[i];
+        ctx->buf[i*4] = s;
+        ctx->buf[i*4+1] = s >> 8;
+        ctx->buf[i*4+2] = s >> 16;
+        ctx->buf[i*4+3] = s >> 24;
+    }
+    return ctx->buf;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_MD5_H
+#define _NANDROID_MD5_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// MD5 (RFC 1321), with the same shape as mincrypt's SHA_CTX.  Backups
+// keep their md5sum-compatible .md5 files, so the engine needs it.
+
+#define MD5_DIGEST_SIZE 16
+
+typedef struct {
+    uint64_t count;
+    uint32_t state[4];
+    uint8_t buf[64];
+} MD5_CTX;
+
+void MD5_init(MD5_CTX* ctx);
+void MD5_update(MD5_CTX* ctx, const void* data, int len);
+const uint8_t* MD5_final(MD5_CTX* ctx);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Native side of the nandroid backups.
+//
+//   nandroid-or backup [-c] [-i <store>] [-j <jobs>] <dir> <partition> ...
+//       Back up the partitions into dir, <jobs> (2) at a time: raw MTD
+//       partitions (boot, bpsw, lbl, logo, devtree) are dumped and read
+//       back, yaffs2 ones (system, data, cache, cust, cdrom) go through
+//       mkyaffs2image and ext2 through tar.  Each one gets a .md5 file;
+//       -c compresses the images with bzip2 on the way and -i puts them
+//       into the chunk store (see store.h) instead.  What each backup
+//       measured is kept in /sdcard/nandroid/stats for the plan.
+//   nandroid-or plan [-c] [-i <store>] [-j <jobs>] <dir> <partition> ...
+//       Estimate how much space and time the same backup would take, and
+//       exit with 1 if it won't fit on the filesystem that dir is on.
+//   nandroid-or restore [-f] [-s <store>] [-j <jobs>] <dir> <partition> ...
+//       Restore the partitions from a backup, checking every image
+//       against its .md5 or manifest.  Raw images are checked before
+//       flashing and read back after; yaffs2 and ext2 ones are checked
+//       before the partition is erased, and again while they are
+//       unpacked.  -f skips the first check, at the risk of leaving a
+//       partition partly restored from a bad image.
+//   nandroid-or put <store> <manifest> <file|->
+//       Chunk a stream into the store and write its manifest.  Prints
+//       the sha1 of the stream.
+//   nandroid-or get <store> <manifest> <file|->
+//       Reassemble a stream from the store, checking every chunk and
+//       the stream as a whole.  Exits with 1 if anything is wrong.
+//   nandroid-or sha1 <file|->
+//       Print the sha1 of a stream.
+//   nandroid-or gc <store> [<manifest> ...]
+//       Delete the chunks that none of the given manifests use.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "store.h"
+
+#define READ_SIZE (64*1024)
+
+static int OpenInput(const char* name) {
+    if (strcmp(name, "-") == 0) return 0;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open \"%s\": %s\n", name, strerror(errno));
+    }
+    return fd;
+}
+
+static void PrintDigest(const uint8_t* sha1) {
+    char hex[SHA_DIGEST_SIZE*2+1];
+    HexBytes(sha1, SHA_DIGEST_SIZE, hex);
+    printf("%s\n", hex);
+}
+
+static int PutCommand(const char* store, const char* manifest_name,
+                      const char* input) {
+    unsigned char* buffer = malloc(READ_SIZE);
+    if (buffer == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    int fd = OpenInput(input);
+    if (fd < 0) return 1;
+
+    StoreWriter w;
+    if (StoreWriterInit(&w, store) < 0) return 1;
+
+    ssize_t n;
+    while ((n = ReadFully(fd, buffer, READ_SIZE)) > 0) {
+        if (StoreWriterAdd(&w, buffer, n) < 0) return 1;
+    }
+    if (n < 0) {
+        fprintf(stderr, "failed to read \"%s\": %s\n", input, strerror(errno));
+        return 1;
+    }
+    if (fd != 0) close(fd);
+
+    if (StoreWriterFinish(&w) < 0 ||
+        WriteManifest(manifest_name, &w.manifest) < 0) return 1;
+
+    fprintf(stderr, "%lld bytes in %d chunks; %d new chunks, %lld bytes\n",
+            w.manifest.size, w.manifest.count, w.added, w.added_bytes);
+    PrintDigest(w.manifest.sha1);
+    StoreWriterFree(&w);
+    free(buffer);
+    return 0;
+}
+
+static int GetCommand(const char* store, const char* manifest_name,
+                      const char* output) {
+    Manifest m;
+    if (ReadManifest(manifest_name, &m) < 0) return 1;
+
+    int fd;
+    if (strcmp(output, "-") == 0) {
+        fd = 1;
+    } else {
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "failed to create \"%s\": %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+
+    unsigned char* chunk = malloc(STORE_CHUNK_MAX);
+    SHA_CTX whole;
+    SHA_init(&whole);
+    int i;
+    for (i = 0; i < m.count; ++i) {
+        const ChunkRef* ref = m.chunks + i;
+        if (chunk == NULL || StoreGetChunk(store, ref, chunk) < 0) break;
+        SHA_update(&whole, chunk, ref->length);
+
+        size_t done = 0;
+        while (done < ref->length) {
+            ssize_t w = write(fd, chunk + done, ref->length - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;
+            done += w;
+        }
+        if (done != ref->length) {
+            fprintf(stderr, "failed to write \"%s\": %s\n", output, strerror(errno));
+            break;
+        }
+    }
+
+    int ok = i == m.count &&
+        memcmp(SHA_final(&whole), m.sha1, SHA_DIGEST_SIZE) == 0;
+    if (i == m.count && !ok) {
+        fprintf(stderr, "\"%s\" doesn't match its manifest\n", output);
+    }
+    if (fd != 1 && close(fd) < 0) ok = 0;
+    if (!ok && fd != 1) unlink(output);
+
+    free(chunk);
+    FreeManifest(&m);
+    return ok ? 0 : 1;
+}
+
+static int Sha1Command(const char* input) {
+    unsigned char* buffer = malloc(READ_SIZE);
+    int fd = OpenInput(input);
+    if (buffer == NULL || fd < 0) return 1;
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    ssize_t n;
+    while ((n = ReadFully(fd, buffer, READ_SIZE)) > 0) {
+        SHA_update(&ctx, buffer, n);
+    }
+    if (n < 0) {
+        fprintf(stderr, "failed to read \"%s\": %s\n", input, strerror(errno));
+        return 1;
+    }
+    PrintDigest(SHA_final(&ctx));
+    free(buffer);
+    return 0;
+}
+
+static int Usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s backup [-c] [-i <store>] [-j <jobs>] <dir> <partition> ...\n"
+            "       %s plan [-c] [-i <store>] [-j <jobs>] <dir> <partition> ...\n"
+            "       %s restore [-f] [-s <store>] [-j <jobs>] <dir> <partition> ...\n"
+            "       %s put <store> <manifest> <file|->\n"
+            "       %s get <store> <manifest> <file|->\n"
+            "       %s sha1 <file|->\n"
+            "       %s gc <store> [<manifest> ...]\n"
+            "The store is normally " DEFAULT_STORE ".\n",
+            name, name, name, name, name, name, name);
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) return Usage(argv[0]);
+
+    ChunkerInit();
+    // A child that dies early shouldn't take us with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strcmp(argv[1], "backup") == 0) {
+        return BackupCommand(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "plan") == 0) {
+        return PlanCommand(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "restore") == 0) {
+        return RestoreCommand(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[1], "put") == 0 && argc == 5) {
+        return PutCommand(argv[2], argv[3], argv[4]);
+    }
+    if (strcmp(argv[1], "get") == 0 && argc == 5) {
+        return GetCommand(argv[2], argv[3], argv[4]);
+    }
+    if (strcmp(argv[1], "sha1") == 0 && argc == 3) {
+        return Sha1Command(argv[2]);
+    }
+    if (strcmp(argv[1], "gc") == 0 && argc >= 3) {
+        int deleted = StoreCollectGarbage(argv[2], argv + 3, argc - 3);
+        if (deleted < 0) return 1;
+        fprintf(stderr, "deleted %d unused chunks\n", deleted);
+        return 0;
+    }
+    return Usage(argv[0]);
+}
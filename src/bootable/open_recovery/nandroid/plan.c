@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// nandroid-or plan: work out how much space a backup will take and how
+// long it will run, before starting it.
+//
+// The stream sizes come from the partitions themselves.  How well each
+// kind of stream compresses (or how much of it is new to the store) and
+// how fast it goes are taken from the earlier backups, which record
+// what they measured in a small stats file; until there are any, some
+// conservative guesses stand in.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "mtdutils/mtdutils.h"
+#include "store.h"
+
+#define MiB (1024*1024)
+
+static const char* mode_names[BACKUP_MODES] = { "plain", "bzip2", "store" };
+static const char* type_names[PART_TYPES] = { "mtd", "yaffs2", "tar" };
+
+// Used until a backup of the kind has been measured: output/input in
+// percent, and input bytes per second.
+static const int default_ratio[BACKUP_MODES] = { 100, 75, 100 };
+static const int default_rate[BACKUP_MODES] = { 3*MiB, 800*1024, 2*MiB };
+
+// Bytes the backup keeps free on top of its estimate, for the .md5
+// files, the directory and any misjudgement.
+#define MARGIN_PERCENT 10
+#define MARGIN_BYTES   (4*MiB)
+
+long long StreamSize(const PartitionInfo* p) {
+    if (p->type == PART_MTD) {
+        const MtdPartition* mtd = mtd_find_partition_by_name(p->mtd);
+        size_t size;
+        if (mtd == NULL || mtd_partition_info(mtd, &size, NULL, NULL) < 0) {
+            return 0;
+        }
+        return size;
+    }
+
+    struct statfs st;
+    if (statfs(p->mount_point, &st) < 0) return 0;
+    long long used = (long long) (st.f_blocks - st.f_bfree) * st.f_bsize;
+    long long files = st.f_files - st.f_ffree;
+    if (p->type == PART_YAFFS2) {
+        // Every 2048 byte chunk carries 64 bytes of tags, and every
+        // object has a header chunk of its own.
+        return used + used / 32 + files * (2048 + 64);
+    }
+    // A 512 byte tar header per file, and the padding after it.
+    return used + files * 1024;
+}
+
+long long ElapsedMs(const struct timeval* start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000LL +
+        (now.tv_usec - start->tv_usec) / 1000;
+}
+
+void ReadStats(const char* path, Throughput stats[BACKUP_MODES][PART_TYPES]) {
+    memset(stats, 0, sizeof(Throughput) * BACKUP_MODES * PART_TYPES);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return;
+
+    char mode[16], type[16];
+    long long in, out, msec;
+    while (fscanf(f, "%15s %15s %lld %lld %lld", mode, type, &in, &out, &msec) == 5) {
+        int m, t;
+        for (m = 0; m < BACKUP_MODES && strcmp(mode, mode_names[m]) != 0; ++m) ;
+        for (t = 0; t < PART_TYPES && strcmp(type, type_names[t]) != 0; ++t) ;
+        if (m == BACKUP_MODES || t == PART_TYPES || in <= 0 || out < 0 || msec < 0) {
+            continue;
+        }
+        stats[m][t].in = in;
+        stats[m][t].out = out;
+        stats[m][t].msec = msec;
+    }
+    fclose(f);
+}
+
+int WriteStats(const char* path, Throughput stats[BACKUP_MODES][PART_TYPES]) {
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE* f = fopen(temp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", temp, strerror(errno));
+        return -1;
+    }
+    int m, t;
+    for (m = 0; m < BACKUP_MODES; ++m) {
+        for (t = 0; t < PART_TYPES; ++t) {
+            const Throughput* s = &stats[m][t];
+            if (s->in <= 0) continue;
+            fprintf(f, "%s %s %lld %lld %lld\n", mode_names[m], type_names[t],
+                    s->in, s->out, s->msec);
+        }
+    }
+    if (fclose(f) != 0 || rename(temp, path) < 0) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", path, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+void AddStats(Throughput* s, long long in, long long out, long long msec) {
+    // Halve the history each time, so that the estimate follows the
+    // phone as it fills up or as the sdcard changes.
+    s->in = s->in / 2 + in;
+    s->out = s->out / 2 + out;
+    s->msec = s->msec / 2 + msec;
+}
+
+// How much space the stream will take, and how long it will take.
+static void Estimate(const Throughput* s, BackupMode mode, long long size,
+                     long long* bytes, long long* msec) {
+    if (s->in > 0) {
+        *bytes = size * (double) s->out / s->in;
+        *msec = size * (double) s->msec / s->in;
+    } else {
+        *bytes = size * default_ratio[mode] / 100;
+        *msec = size * 1000 / default_rate[mode];
+    }
+}
+
+// Free space on the filesystem that dir is (or will be) on.
+static long long FreeSpace(const char* dir) {
+    char path[PATH_MAX];
+    struct statfs st;
+    strncpy(path, dir, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    while (statfs(path, &st) < 0) {
+        char* slash = strrchr(path, '/');
+        if (slash == NULL) return -1;
+        if (slash == path) {
+            slash[1] = '\0';
+            if (statfs(path, &st) < 0) return -1;
+            break;
+        }
+        *slash = '\0';
+    }
+    return (long long) st.f_bavail * st.f_bsize;
+}
+
+static int PlanUsage(void) {
+    fprintf(stderr, "usage: nandroid-or plan [-c] [-i <store>] [-j <jobs>] "
+            "<dir> <partition> ...\n");
+    return 2;
+}
+
+int PlanCommand(int argc, char** argv) {
+    BackupMode mode = BACKUP_PLAIN;
+    const char* store = NULL;
+    int threads = DEFAULT_JOBS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ci:j:")) != -1) {
+        switch (opt) {
+            case 'c': if (mode == BACKUP_PLAIN) mode = BACKUP_BZIP2; break;
+            case 'i': mode = BACKUP_STORE; store = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            default: return PlanUsage();
+        }
+    }
+    if (argc - optind < 2 || threads < 1) return PlanUsage();
+    const char* dir = argv[optind++];
+
+    int i;
+    for (i = optind; i < argc; ++i) {
+        const PartitionInfo* p = FindPartitionInfo(argv[i]);
+        if (p == NULL) {
+            fprintf(stderr, "unknown partition \"%s\"\n", argv[i]);
+            return 2;
+        }
+        if (p->type == PART_MTD) {
+            if (mtd_scan_partitions() <= 0) {
+                fprintf(stderr, "error scanning partitions\n");
+                return 1;
+            }
+            break;
+        }
+    }
+
+    Throughput stats[BACKUP_MODES][PART_TYPES];
+    ReadStats(DEFAULT_STATS, stats);
+
+    long long total = 0;
+    long long total_msec = 0;
+    long long longest = 0;
+    for (i = optind; i < argc; ++i) {
+        const PartitionInfo* p = FindPartitionInfo(argv[i]);
+        long long bytes, msec;
+        Estimate(&stats[mode][p->type], mode, StreamSize(p), &bytes, &msec);
+        Message("%s: about %lld MiB, %lld s\n", p->name,
+                (bytes + MiB - 1) / MiB, (msec + 999) / 1000);
+        total += bytes;
+        total_msec += msec;
+        if (msec > longest) longest = msec;
+    }
+    // The partitions are backed up a few at a time, but a backup can't
+    // finish before its longest partition does.
+    long long msec = total_msec / threads;
+    if (msec < longest) msec = longest;
+
+    long long needed = total + total * MARGIN_PERCENT / 100 + MARGIN_BYTES;
+    long long available = FreeSpace(store != NULL ? store : dir);
+    if (available < 0) {
+        fprintf(stderr, "can't find the free space for \"%s\"\n", dir);
+        return 1;
+    }
+
+    Message("The backup needs about %lld MiB, %lld MiB are free.\n",
+            (needed + MiB - 1) / MiB, available / MiB);
+    if (needed > available) {
+        Message("E:Not enough free space available on sdcard for backing up.\n");
+        return 1;
+    }
+    Message("It should take about %lld min %02lld s.\n",
+            (msec / 1000) / 60, (msec / 1000) % 60);
+    return 0;
+}
@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// nandroid-or restore: each image is decompressed or reassembled from
+// the store on the fly, and checked against its .md5 (or its manifest)
+// without needing a copy of it.
+//
+// Raw partitions are small, so the whole image is read and checked
+// before the flash is touched; after flashing it is read back.  The
+// yaffs2 and ext2 ones don't fit in memory, so their image is read and
+// checked once before the partition is erased (or formatted), and a bad
+// image leaves the partition as it was.  Then it is streamed into
+// unyaffs or tar, and checked again on the way.  If reading the image
+// fails they are erased and unpacked again; a checksum mismatch won't go
+// away by reading the same file again, so that stops the restore at
+// once.  With -f the first pass is skipped, which halves the reading
+// but means a bad image is only found once the partition is half
+// restored.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+#include "engine.h"
+#include "md5.h"
+#include "mtdutils/mtdutils.h"
+#include "store.h"
+
+#define BUFFER_SIZE       (128*1024)
+#define RESTORE_ATTEMPTS  3
+
+typedef enum { IMAGE_PLAIN, IMAGE_BZIP2, IMAGE_STORE } ImageFormat;
+
+typedef struct {
+    const PartitionInfo* part;
+    char path[PATH_MAX];            // the image, or its manifest
+    ImageFormat format;
+    Manifest manifest;
+    int have_md5;
+    uint8_t md5[MD5_DIGEST_SIZE];
+    long long estimate;             // bytes to read, for the progress bar
+    const char* error;              // why the restore failed
+} RestoreJob;
+
+typedef struct {
+    const char* dir;
+    const char* store;
+    int check_first;                // check filesystem images before erasing
+    RestoreJob* jobs;
+} Restore;
+
+// Find the md5 of image in an md5sum file: either <name>.md5, or the
+// nandroid.md5 of the old backup format, which lists every image.
+static int ReadMd5File(const char* path, const char* image, uint8_t* md5) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    char line[PATH_MAX + 64];
+    int found = -1;
+    while (found < 0 && fgets(line, sizeof(line), f) != NULL) {
+        char* name = line + MD5_DIGEST_SIZE*2;
+        if (strlen(line) < MD5_DIGEST_SIZE*2 + 2 || *name != ' ') continue;
+        name += strspn(name, " *");
+        name[strcspn(name, "\r\n")] = '\0';
+        const char* base = strrchr(name, '/');
+        base = base ? base + 1 : name;
+        if (strcmp(base, image) == 0 &&
+            ParseHexBytes(line, md5, MD5_DIGEST_SIZE) == 0) {
+            found = 0;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Work out where a partition's image is and how to check it.  Return
+// 1 if there is one, 0 if it wasn't backed up, -1 if it's unusable.
+static int FindImage(const Restore* r, RestoreJob* job) {
+    char image[32];
+    char path[PATH_MAX];
+    struct stat st;
+    const PartitionInfo* p = job->part;
+    ImageName(p, image, sizeof(image));
+
+    snprintf(job->path, sizeof(job->path), "%s/%s.manifest", r->dir, p->name);
+    if (stat(job->path, &st) == 0) {
+        job->format = IMAGE_STORE;
+        if (ReadManifest(job->path, &job->manifest) < 0) {
+            job->error = "Backup store damaged.";
+            return -1;
+        }
+        job->estimate = job->manifest.size;
+    } else {
+        snprintf(job->path, sizeof(job->path), "%s/%s.bz2", r->dir, image);
+        job->format = IMAGE_BZIP2;
+        if (stat(job->path, &st) < 0) {
+            snprintf(job->path, sizeof(job->path), "%s/%s", r->dir, image);
+            job->format = IMAGE_PLAIN;
+            if (stat(job->path, &st) < 0) return 0;
+        }
+        job->estimate = st.st_size;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s.md5", r->dir, p->name);
+    job->have_md5 = ReadMd5File(path, image, job->md5) == 0;
+    if (!job->have_md5) {
+        snprintf(path, sizeof(path), "%s/nandroid.md5", r->dir);
+        job->have_md5 = ReadMd5File(path, image, job->md5) == 0;
+    }
+    if (!job->have_md5 && job->format != IMAGE_STORE) {
+        job->error = "MD5 checksum file missing.";
+        return -1;
+    }
+    return 1;
+}
+
+// The stream of an image, uncompressed or reassembled from the store,
+// and hashed as it is read.
+typedef struct {
+    const RestoreJob* job;
+    const char* store;
+    int fd;
+    int bzip2;
+    bz_stream bz;
+    unsigned char* zbuf;
+    int ended;
+    unsigned char* chunk;
+    size_t chunk_pos;
+    size_t chunk_len;
+    int next_chunk;
+    MD5_CTX md5;
+    SHA_CTX sha1;
+    long long size;
+} Input;
+
+static int OpenInput(Input* in, const Restore* r, const RestoreJob* job) {
+    memset(in, 0, sizeof(*in));
+    in->job = job;
+    in->store = r->store;
+    in->fd = -1;
+    MD5_init(&in->md5);
+    SHA_init(&in->sha1);
+
+    if (job->format == IMAGE_STORE) {
+        in->chunk = malloc(STORE_CHUNK_MAX);
+        return in->chunk == NULL ? -1 : 0;
+    }
+    in->fd = open(job->path, O_RDONLY);
+    if (in->fd < 0) {
+        fprintf(stderr, "failed to open \"%s\": %s\n", job->path, strerror(errno));
+        return -1;
+    }
+    if (job->format == IMAGE_BZIP2) {
+        in->zbuf = malloc(BUFFER_SIZE);
+        if (in->zbuf == NULL || BZ2_bzDecompressInit(&in->bz, 0, 0) != BZ_OK) {
+            return -1;
+        }
+        in->bzip2 = 1;
+    }
+    return 0;
+}
+
+static ssize_t ReadStore(Input* in, unsigned char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (in->chunk_pos == in->chunk_len) {
+            const Manifest* m = &in->job->manifest;
+            if (in->next_chunk == m->count) break;
+            const ChunkRef* ref = m->chunks + in->next_chunk++;
+            // Every chunk is checked here, before any of it is written.
+            if (StoreGetChunk(in->store, ref, in->chunk) < 0) return -1;
+            in->chunk_pos = 0;
+            in->chunk_len = ref->length;
+            ProgressAdd(ref->length);
+        }
+        size_t take = in->chunk_len - in->chunk_pos;
+        if (take > len - done) take = len - done;
+        memcpy(buf + done, in->chunk + in->chunk_pos, take);
+        in->chunk_pos += take;
+        done += take;
+    }
+    return done;
+}
+
+static ssize_t ReadBzip2(Input* in, unsigned char* buf, size_t len) {
+    in->bz.next_out = (char*) buf;
+    in->bz.avail_out = len;
+    while (in->bz.avail_out > 0 && !in->ended) {
+        if (in->bz.avail_in == 0) {
+            ssize_t n = ReadFully(in->fd, in->zbuf, BUFFER_SIZE);
+            if (n < 0) return -1;
+            if (n == 0) {
+                fprintf(stderr, "\"%s\" is truncated\n", in->job->path);
+                return -1;
+            }
+            in->bz.next_in = (char*) in->zbuf;
+            in->bz.avail_in = n;
+            ProgressAdd(n);
+        }
+        // bzip2 checks each block's crc as it goes, so a damaged
+        // file is usually caught well before the md5 would catch it.
+        int r = BZ2_bzDecompress(&in->bz);
+        if (r == BZ_STREAM_END) {
+            in->ended = 1;
+        } else if (r != BZ_OK) {
+            fprintf(stderr, "bzip2 error %d in \"%s\"\n", r, in->job->path);
+            return -1;
+        }
+    }
+    return len - in->bz.avail_out;
+}
+
+// Return up to len bytes, 0 at the end, or -1 on error.
+static ssize_t ReadInput(Input* in, unsigned char* buf, size_t len) {
+    ssize_t n;
+    if (in->job->format == IMAGE_STORE) {
+        n = ReadStore(in, buf, len);
+    } else if (in->bzip2) {
+        n = ReadBzip2(in, buf, len);
+    } else {
+        n = ReadFully(in->fd, buf, len);
+        if (n > 0) ProgressAdd(n);
+    }
+    if (n > 0) {
+        MD5_update(&in->md5, buf, n);
+        if (in->job->format == IMAGE_STORE) SHA_update(&in->sha1, buf, n);
+        in->size += n;
+    }
+    return n;
+}
+
+// Close the stream and check what came out of it against the backup.
+// The md5 of everything read is left in md5.
+static int CloseInput(Input* in, uint8_t* md5) {
+    const RestoreJob* job = in->job;
+    int ok = 1;
+
+    memcpy(md5, MD5_final(&in->md5), MD5_DIGEST_SIZE);
+    if (job->have_md5 && memcmp(md5, job->md5, MD5_DIGEST_SIZE) != 0) ok = 0;
+    if (job->format == IMAGE_STORE &&
+        (in->size != job->manifest.size ||
+         memcmp(SHA_final(&in->sha1), job->manifest.sha1, SHA_DIGEST_SIZE) != 0)) {
+        ok = 0;
+    }
+
+    if (in->bzip2) BZ2_bzDecompressEnd(&in->bz);
+    if (in->fd >= 0) close(in->fd);
+    free(in->zbuf);
+    free(in->chunk);
+    return ok ? 0 : -1;
+}
+
+// Read the whole image into data (which holds max bytes) and check it.
+// Return its length, or -1.
+static ssize_t LoadImage(const Restore* r, RestoreJob* job,
+                         unsigned char* data, size_t max, uint8_t* md5) {
+    Input in;
+    if (OpenInput(&in, r, job) < 0) {
+        CloseInput(&in, md5);
+        job->error = "Cannot read the image.";
+        return -1;
+    }
+    ssize_t len = ReadInput(&in, data, max);
+    unsigned char extra;
+    ssize_t more = len < 0 ? -1 : ReadInput(&in, &extra, 1);
+    if (CloseInput(&in, md5) < 0 && len >= 0 && more == 0) {
+        job->error = "MD5 checksum mismatch.";
+        return -1;
+    }
+    if (len < 0 || more < 0) {
+        job->error = "Cannot read the image.";
+        return -1;
+    }
+    if (more > 0) {
+        job->error = "Image is larger than the partition.";
+        return -1;
+    }
+    return len;
+}
+
+// Write an image that's in memory, the way flash_image does: the first
+// block goes last, so an interrupted flash never leaves a valid header
+// in front of a partial image.
+static int FlashImage(const MtdPartition* mtd, const unsigned char* data,
+                      size_t len, size_t erase_size) {
+    size_t first = len < erase_size ? len : erase_size;
+    unsigned char* zero = calloc(1, first);
+    MtdWriteContext* out = mtd_write_partition(mtd);
+    if (zero == NULL || out == NULL) {
+        free(zero);
+        if (out != NULL) mtd_write_close(out);
+        return -1;
+    }
+    int ok = mtd_write_data(out, (const char*) zero, first) == (ssize_t) first &&
+        mtd_write_data(out, (const char*) data + first, len - first) ==
+            (ssize_t) (len - first);
+    if (mtd_write_close(out) < 0) ok = 0;
+    free(zero);
+    if (!ok) return -1;
+
+    out = mtd_write_partition(mtd);
+    if (out == NULL) return -1;
+    ok = mtd_write_data(out, (const char*) data, first) == (ssize_t) first;
+    if (mtd_write_close(out) < 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+// md5 of the first len bytes of the partition.
+static int ReadBack(const MtdPartition* mtd, size_t len, size_t erase_size,
+                    unsigned char* buf, uint8_t* md5) {
+    MtdReadContext* in = mtd_read_partition(mtd);
+    if (in == NULL) return -1;
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    while (len > 0) {
+        ssize_t n = mtd_read_data(in, (char*) buf, erase_size);
+        if (n <= 0) break;
+        if ((size_t) n > len) n = len;
+        MD5_update(&ctx, buf, n);
+        ProgressAdd(n);
+        len -= n;
+    }
+    mtd_read_close(in);
+    memcpy(md5, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    return len == 0 ? 0 : -1;
+}
+
+static int RestoreMtd(const Restore* r, RestoreJob* job, unsigned char* buf) {
+    const MtdPartition* mtd = mtd_find_partition_by_name(job->part->mtd);
+    size_t size, erase_size;
+    if (mtd == NULL || mtd_partition_info(mtd, &size, &erase_size, NULL) < 0 ||
+        erase_size > BUFFER_SIZE) {
+        job->error = "Cannot find the partition.";
+        return -1;
+    }
+    unsigned char* data = malloc(size);
+    if (data == NULL) {
+        job->error = "Out of memory.";
+        return -1;
+    }
+
+    uint8_t md5[MD5_DIGEST_SIZE];
+    ssize_t len = -1;
+    int attempts;
+    for (attempts = 0; len < 0 && attempts < RESTORE_ATTEMPTS; ++attempts) {
+        len = LoadImage(r, job, data, size, md5);
+    }
+    if (len < 0) {
+        // The partition hasn't been touched.
+        free(data);
+        return -1;
+    }
+
+    int ok = 0;
+    for (attempts = 0; !ok && attempts < RESTORE_ATTEMPTS; ++attempts) {
+        uint8_t flashed[MD5_DIGEST_SIZE];
+        ok = FlashImage(mtd, data, len, erase_size) == 0 &&
+            ReadBack(mtd, len, erase_size, buf, flashed) == 0 &&
+            memcmp(md5, flashed, MD5_DIGEST_SIZE) == 0;
+    }
+    free(data);
+    if (!ok) {
+        job->error = "Flash verification failed.";
+        return -1;
+    }
+    job->error = NULL;
+    return 0;
+}
+
+// Read the whole image and check it, without writing it anywhere.
+// Return 0 if it's good, -1 if reading it failed and it's worth another
+// try, or -2 if it's no use.
+static int VerifyImage(const Restore* r, RestoreJob* job, unsigned char* buf) {
+    Input in;
+    int ok = OpenInput(&in, r, job) == 0;
+    ssize_t n = 0;
+    while (ok && (n = ReadInput(&in, buf, BUFFER_SIZE)) > 0) {
+        // only the checksums are wanted
+    }
+
+    uint8_t md5[MD5_DIGEST_SIZE];
+    if (CloseInput(&in, md5) < 0 && ok && n == 0) {
+        job->error = "MD5 checksum mismatch.";
+        return -2;
+    }
+    if (!ok || n < 0) {
+        job->error = "Cannot read the image.";
+        return -1;
+    }
+    return 0;
+}
+
+static int ErasePartition(const PartitionInfo* p) {
+    const MtdPartition* mtd = mtd_find_partition_by_name(p->mtd);
+    if (mtd == NULL) return -1;
+    MtdWriteContext* out = mtd_write_partition(mtd);
+    if (out == NULL) return -1;
+    int ok = mtd_erase_blocks(out, -1) != (off_t) -1;
+    if (mtd_write_close(out) < 0) ok = 0;
+    if (!ok) return -1;
+    return mtd_mount_partition(mtd, p->mount_point, "yaffs2", 0);
+}
+
+// Make a fresh ext2 filesystem on the partition and mount it.
+static int FormatPartition(const PartitionInfo* p) {
+    char* argv[] = { "mkfs.ext2", "-c", (char*) p->device, NULL };
+    int fd;
+    pid_t pid = SpawnChild(argv, NULL, NULL, 0, &fd);
+    if (pid < 0) return -1;
+    close(fd);
+    if (WaitChild(pid, argv[0]) < 0) return -1;
+    return mount(p->device, p->mount_point, "ext2", MS_NOATIME | MS_NODEV, NULL);
+}
+
+// Stream the image into unyaffs or tar.  Return 0, -1 if reading the
+// image failed and it's worth another try, or -2 if it's no use.
+static int Unpack(const Restore* r, RestoreJob* job, unsigned char* buf) {
+    const PartitionInfo* p = job->part;
+    const char* program;
+    int fd;
+    pid_t pid;
+    if (p->type == PART_YAFFS2) {
+        char* argv[] = { "unyaffs", "-", (char*) p->mount_point, NULL };
+        program = argv[0];
+        pid = SpawnChild(argv, "unyaffs-or", NULL, 0, &fd);
+    } else {
+        char* argv[] = { "tar", "-xf", "-", NULL };
+        program = argv[0];
+        pid = SpawnChild(argv, NULL, p->mount_point, 0, &fd);
+    }
+    if (pid < 0) {
+        job->error = "Cannot start the unpacker.";
+        return -1;
+    }
+
+    Input in;
+    int ok = OpenInput(&in, r, job) == 0;
+    ssize_t n = 0;
+    while (ok && (n = ReadInput(&in, buf, BUFFER_SIZE)) > 0) {
+        if (WriteFully(fd, buf, n) < 0) ok = 0;
+    }
+    close(fd);
+    if (WaitChild(pid, program) < 0) ok = 0;
+
+    uint8_t md5[MD5_DIGEST_SIZE];
+    if (CloseInput(&in, md5) < 0 && ok && n == 0) {
+        job->error = "MD5 checksum mismatch, the partition is only partly restored.";
+        return -2;
+    }
+    if (!ok) {
+        job->error = "Cannot unpack the image, the partition is only partly restored.";
+        return -2;
+    }
+    if (n < 0) {
+        job->error = "Cannot read the image, the partition is only partly restored.";
+        return -1;
+    }
+    job->error = NULL;
+    return 0;
+}
+
+static int RestoreFilesystem(const Restore* r, RestoreJob* job,
+                             unsigned char* buf) {
+    int attempts;
+    int result = -1;
+    for (attempts = 0; r->check_first && result == -1 &&
+             attempts < RESTORE_ATTEMPTS; ++attempts) {
+        result = VerifyImage(r, job, buf);
+    }
+    if (r->check_first && result < 0) {
+        // The partition hasn't been touched.
+        return -1;
+    }
+
+    for (attempts = 0; attempts < RESTORE_ATTEMPTS; ++attempts) {
+        if (attempts > 0) {
+            fprintf(stderr, "%s: %s Retrying.\n", job->part->name, job->error);
+        }
+        if (umount(job->part->mount_point) < 0 && errno != EINVAL &&
+            errno != ENOENT) {
+            job->error = "Cannot unmount.";
+            return -1;
+        }
+        if (job->part->type == PART_YAFFS2) {
+            if (ErasePartition(job->part) < 0) {
+                job->error = "Failed to erase.";
+                return -1;
+            }
+        } else if (FormatPartition(job->part) < 0) {
+            job->error = "Failed to format.";
+            return -1;
+        }
+        result = Unpack(r, job, buf);
+        if (result == 0) return 0;
+        if (result == -2) break;
+    }
+    return -1;
+}
+
+static int RestoreJobFn(int index, void* cookie) {
+    const Restore* r = cookie;
+    RestoreJob* job = r->jobs + index;
+    unsigned char* buf = malloc(BUFFER_SIZE);
+
+    Message("%s: Restoring...\n", job->part->name);
+    int result = -1;
+    if (buf == NULL) {
+        job->error = "Out of memory.";
+    } else if (job->part->type == PART_MTD) {
+        result = RestoreMtd(r, job, buf);
+    } else {
+        result = RestoreFilesystem(r, job, buf);
+    }
+    free(buf);
+
+    if (result < 0) {
+        Message("%s: %s\n", job->part->name, job->error);
+    } else {
+        Message("%s: done\n", job->part->name);
+    }
+    // Carry on with the other partitions either way.
+    return 0;
+}
+
+// Biggest first, so that the small ones fill in around it.
+static int CompareJobs(const void* a, const void* b) {
+    long long x = ((const RestoreJob*) a)->estimate;
+    long long y = ((const RestoreJob*) b)->estimate;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int RestoreUsage(void) {
+    fprintf(stderr, "usage: nandroid-or restore [-f] [-s <store>] [-j <jobs>] "
+            "<dir> <partition> ...\n");
+    return 2;
+}
+
+int RestoreCommand(int argc, char** argv) {
+    Restore r;
+    memset(&r, 0, sizeof(r));
+    r.store = DEFAULT_STORE;
+    r.check_first = 1;
+    int threads = DEFAULT_JOBS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "fs:j:")) != -1) {
+        switch (opt) {
+            case 'f': r.check_first = 0; break;
+            case 's': r.store = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            default: return RestoreUsage();
+        }
+    }
+    if (argc - optind < 2 || threads < 1) return RestoreUsage();
+    r.dir = argv[optind++];
+
+    r.jobs = calloc(argc - optind, sizeof(RestoreJob));
+    if (r.jobs == NULL) return 1;
+
+    int i;
+    int count = 0;
+    int errors = 0;
+    int need_mtd = 0;
+    for (; optind < argc; ++optind) {
+        RestoreJob* job = r.jobs + count;
+        memset(job, 0, sizeof(*job));
+        job->part = FindPartitionInfo(argv[optind]);
+        if (job->part == NULL) {
+            fprintf(stderr, "unknown partition \"%s\"\n", argv[optind]);
+            return 2;
+        }
+        int found = FindImage(&r, job);
+        if (found == 0) {
+            Message("%s: Not backed up.\n", job->part->name);
+        } else if (found < 0) {
+            Message("%s: %s\n", job->part->name, job->error);
+            ++errors;
+        } else {
+            if (job->part->type != PART_TAR) need_mtd = 1;
+            ++count;
+        }
+    }
+    if (need_mtd && mtd_scan_partitions() <= 0) {
+        fprintf(stderr, "error scanning partitions\n");
+        return 1;
+    }
+
+    long long total = 0;
+    for (i = 0; i < count; ++i) {
+        RestoreJob* job = r.jobs + i;
+        if (job->part->type == PART_MTD) {
+            // Read back after flashing.
+            job->estimate += job->format == IMAGE_BZIP2 ?
+                job->estimate * 2 : job->estimate;
+        } else if (r.check_first) {
+            // Read once to check, once to unpack.
+            job->estimate *= 2;
+        }
+        total += job->estimate;
+    }
+    qsort(r.jobs, count, sizeof(RestoreJob), CompareJobs);
+
+    if (count > 0) {
+        ProgressStart(total);
+        RunJobs(RestoreJobFn, &r, count, threads);
+        sync();
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (r.jobs[i].error != NULL) ++errors;
+        FreeManifest(&r.jobs[i].manifest);
+    }
+    free(r.jobs);
+    return errors ? 1 : 0;
+}
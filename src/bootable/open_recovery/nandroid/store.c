@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "store.h"
+
+#define MANIFEST_MAGIC "nandroid-manifest 1"
+
+static uint32_t gear[256];
+
+// The gear table only has to be random-looking and the same on every
+// run (otherwise chunk boundaries, and so deduplication, would change),
+// so it is generated with a fixed xorshift sequence.
+void ChunkerInit(void) {
+    uint32_t x = 0x2545f491;
+    int i;
+    for (i = 0; i < 256; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gear[i] = x;
+    }
+}
+
+void ChunkerReset(Chunker* c) {
+    c->hash = 0;
+    c->length = 0;
+}
+
+size_t ChunkerScan(Chunker* c, const unsigned char* data, size_t len,
+                   int* boundary) {
+    size_t i = 0;
+    *boundary = 0;
+
+    // The hash only depends on the last 32 bytes, so there's no need to
+    // run it over the start of a chunk, where no boundary can fall.
+    if (c->length + 32 < STORE_CHUNK_MIN) {
+        i = STORE_CHUNK_MIN - 32 - c->length;
+        if (i > len) i = len;
+        c->length += i;
+    }
+
+    for (; i < len; ++i) {
+        c->hash = (c->hash << 1) + gear[data[i]];
+        ++c->length;
+        if ((c->length >= STORE_CHUNK_MIN && (c->hash & STORE_CHUNK_MASK) == 0) ||
+            c->length >= STORE_CHUNK_MAX) {
+            *boundary = 1;
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+// <store>/ab/cdef...
+static void ChunkPath(const char* store, const uint8_t* sha1, char* path,
+                      size_t size) {
+    char hex[SHA_DIGEST_SIZE*2+1];
+    HexBytes(sha1, SHA_DIGEST_SIZE, hex);
+    snprintf(path, size, "%s/%.2s/%s", store, hex, hex+2);
+}
+
+int StorePutChunk(const char* store, const uint8_t* sha1,
+                  const unsigned char* data, size_t len) {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    struct stat st;
+
+    ChunkPath(store, sha1, path, sizeof(path));
+    if (stat(path, &st) == 0 && st.st_size == (off_t)len) {
+        return 0;
+    }
+
+    // Make the two-digit directory if it's not there yet.
+    char* slash = strrchr(path, '/');
+    *slash = '\0';
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+    *slash = '/';
+
+    // Write under a temporary name, sync and rename into place, so that
+    // a chunk that exists is always complete, even after a power loss
+    // (FAT may otherwise get the rename to the card before the data).
+    // Streams backed up at the same time can share chunks (runs of
+    // 0xff, say), so the name has to be unique per call and not just
+    // per process.
+    static pthread_mutex_t temp_lock = PTHREAD_MUTEX_INITIALIZER;
+    static unsigned int temp_serial = 0;
+    pthread_mutex_lock(&temp_lock);
+    unsigned int serial = temp_serial++;
+    pthread_mutex_unlock(&temp_lock);
+    snprintf(temp, sizeof(temp), "%s.tmp%d.%u", path, getpid(), serial);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", temp, strerror(errno));
+        return -1;
+    }
+    if (WriteFully(fd, data, len) < 0 || fsync(fd) < 0 || close(fd) < 0) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", temp, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    if (rename(temp, path) < 0) {
+        fprintf(stderr, "failed to rename \"%s\": %s\n", temp, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    return 1;
+}
+
+int StoreGetChunk(const char* store, const ChunkRef* ref, unsigned char* buf) {
+    char path[PATH_MAX];
+    char hex[SHA_DIGEST_SIZE*2+1];
+
+    ChunkPath(store, ref->sha1, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "missing chunk \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < ref->length) {
+        ssize_t n = read(fd, buf + done, ref->length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    char extra;
+    int too_long = done == ref->length && read(fd, &extra, 1) > 0;
+    close(fd);
+
+    if (done != ref->length || too_long) {
+        fprintf(stderr, "chunk \"%s\" has the wrong length\n", path);
+        return -1;
+    }
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA(buf, ref->length, digest);
+    if (memcmp(digest, ref->sha1, SHA_DIGEST_SIZE) != 0) {
+        HexBytes(ref->sha1, SHA_DIGEST_SIZE, hex);
+        fprintf(stderr, "chunk %s is corrupt\n", hex);
+        return -1;
+    }
+    return 0;
+}
+
+int StoreWriterInit(StoreWriter* w, const char* store) {
+    memset(w, 0, sizeof(*w));
+    w->store = store;
+    InitManifest(&w->manifest);
+    ChunkerReset(&w->chunker);
+    SHA_init(&w->whole);
+    w->chunk = malloc(STORE_CHUNK_MAX);
+    if (w->chunk == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    if (mkdir(store, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", store, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int StoreWriterFlush(StoreWriter* w) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    SHA(w->chunk, w->fill, sha1);
+    int r = StorePutChunk(w->store, sha1, w->chunk, w->fill);
+    if (r < 0 || AddChunk(&w->manifest, sha1, w->fill) < 0) return -1;
+    if (r > 0) {
+        ++w->added;
+        w->added_bytes += w->fill;
+    }
+    w->fill = 0;
+    ChunkerReset(&w->chunker);
+    return 0;
+}
+
+int StoreWriterAdd(StoreWriter* w, const unsigned char* data, size_t len) {
+    SHA_update(&w->whole, data, len);
+    w->manifest.size += len;
+
+    while (len > 0) {
+        int boundary;
+        size_t take = ChunkerScan(&w->chunker, data, len, &boundary);
+        memcpy(w->chunk + w->fill, data, take);
+        w->fill += take;
+        data += take;
+        len -= take;
+        if (boundary && StoreWriterFlush(w) < 0) return -1;
+    }
+    return 0;
+}
+
+int StoreWriterFinish(StoreWriter* w) {
+    if (w->fill > 0 && StoreWriterFlush(w) < 0) return -1;
+    memcpy(w->manifest.sha1, SHA_final(&w->whole), SHA_DIGEST_SIZE);
+    return 0;
+}
+
+void StoreWriterFree(StoreWriter* w) {
+    FreeManifest(&w->manifest);
+    free(w->chunk);
+    w->chunk = NULL;
+}
+
+void InitManifest(Manifest* m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void FreeManifest(Manifest* m) {
+    free(m->chunks);
+    InitManifest(m);
+}
+
+int AddChunk(Manifest* m, const uint8_t* sha1, unsigned int length) {
+    if (m->count == m->alloc) {
+        int alloc = m->alloc ? m->alloc * 2 : 256;
+        ChunkRef* chunks = realloc(m->chunks, alloc * sizeof(ChunkRef));
+        if (chunks == NULL) return -1;
+        m->chunks = chunks;
+        m->alloc = alloc;
+    }
+    memcpy(m->chunks[m->count].sha1, sha1, SHA_DIGEST_SIZE);
+    m->chunks[m->count].length = length;
+    ++m->count;
+    return 0;
+}
+
+// A manifest looks like:
+//
+//   nandroid-manifest 1
+//   size <bytes>
+//   sha1 <sha1 of the whole stream>
+//   chunk <sha1> <bytes>
+//   ...
+int ReadManifest(const char* path, Manifest* m) {
+    char line[256];
+    char hex[64];
+    unsigned int length;
+    long long total = 0;
+
+    InitManifest(m);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open manifest \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int ok = fgets(line, sizeof(line), f) != NULL &&
+        strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) == 0;
+    int have_size = 0, have_sha1 = 0;
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "chunk %63s %u", hex, &length) == 2) {
+            uint8_t sha1[SHA_DIGEST_SIZE];
+            ok = strlen(hex) == SHA_DIGEST_SIZE*2 &&
+                ParseHexBytes(hex, sha1, SHA_DIGEST_SIZE) == 0 &&
+                length <= STORE_CHUNK_MAX &&
+                AddChunk(m, sha1, length) == 0;
+            total += length;
+        } else if (sscanf(line, "size %lld", &m->size) == 1) {
+            have_size = 1;
+        } else if (sscanf(line, "sha1 %63s", hex) == 1) {
+            ok = ParseHexBytes(hex, m->sha1, SHA_DIGEST_SIZE) == 0;
+            have_sha1 = 1;
+        } else {
+            ok = 0;
+        }
+    }
+    fclose(f);
+
+    if (!ok || !have_size || !have_sha1 || total != m->size) {
+        fprintf(stderr, "manifest \"%s\" is damaged\n", path);
+        FreeManifest(m);
+        return -1;
+    }
+    return 0;
+}
+
+int WriteManifest(const char* path, const Manifest* m) {
+    char temp[PATH_MAX];
+    char hex[SHA_DIGEST_SIZE*2+1];
+    int i;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE* f = fopen(temp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", temp, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "%s\nsize %lld\n", MANIFEST_MAGIC, m->size);
+    HexBytes(m->sha1, SHA_DIGEST_SIZE, hex);
+    fprintf(f, "sha1 %s\n", hex);
+    for (i = 0; i < m->count; ++i) {
+        HexBytes(m->chunks[i].sha1, SHA_DIGEST_SIZE, hex);
+        fprintf(f, "chunk %s %u\n", hex, m->chunks[i].length);
+    }
+    // Synced before the rename, like the chunks.
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "failed to write \"%s\"\n", temp);
+        unlink(temp);
+        return -1;
+    }
+    if (rename(temp, path) < 0) {
+        fprintf(stderr, "failed to rename \"%s\": %s\n", temp, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+static int CompareDigests(const void* a, const void* b) {
+    return memcmp(a, b, SHA_DIGEST_SIZE);
+}
+
+int StoreCollectGarbage(const char* store, char** manifests, int count) {
+    uint8_t* live = NULL;
+    int live_count = 0, live_alloc = 0;
+    int i, j, deleted = 0;
+
+    for (i = 0; i < count; ++i) {
+        Manifest m;
+        if (ReadManifest(manifests[i], &m) < 0) {
+            free(live);
+            return -1;
+        }
+        for (j = 0; j < m.count; ++j) {
+            if (live_count == live_alloc) {
+                live_alloc = live_alloc ? live_alloc * 2 : 4096;
+                uint8_t* p = realloc(live, live_alloc * SHA_DIGEST_SIZE);
+                if (p == NULL) {
+                    FreeManifest(&m);
+                    free(live);
+                    return -1;
+                }
+                live = p;
+            }
+            memcpy(live + live_count * SHA_DIGEST_SIZE, m.chunks[j].sha1,
+                   SHA_DIGEST_SIZE);
+            ++live_count;
+        }
+        FreeManifest(&m);
+    }
+    qsort(live, live_count, SHA_DIGEST_SIZE, CompareDigests);
+
+    for (i = 0; i < 256; ++i) {
+        char dir[PATH_MAX];
+        char path[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%02x", store, i);
+        DIR* d = opendir(dir);
+        if (d == NULL) continue;
+
+        struct dirent* de;
+        while ((de = readdir(d)) != NULL) {
+            char hex[SHA_DIGEST_SIZE*2+1];
+            uint8_t sha1[SHA_DIGEST_SIZE];
+            if (de->d_name[0] == '.') continue;
+
+            snprintf(hex, sizeof(hex), "%02x%s", i, de->d_name);
+            if (strlen(de->d_name) == SHA_DIGEST_SIZE*2-2 &&
+                ParseHexBytes(hex, sha1, SHA_DIGEST_SIZE) == 0 &&
+                bsearch(sha1, live, live_count, SHA_DIGEST_SIZE,
+                        CompareDigests) != NULL) {
+                continue;
+            }
+            // Unreferenced chunks and leftover temporary files.
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            if (unlink(path) == 0) ++deleted;
+        }
+        closedir(d);
+        rmdir(dir);     // fails harmlessly unless it's now empty
+    }
+
+    free(live);
+    return deleted;
+}
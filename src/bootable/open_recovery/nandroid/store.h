@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery Nandroid
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_STORE_H
+#define _NANDROID_STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mincrypt/sha.h"
+
+// A content-addressed chunk store for incremental nandroid backups.
+//
+// Backup streams (raw partition dumps, yaffs2 images, tarballs) are cut
+// into variable-sized chunks at content-defined boundaries, so that an
+// insertion early in a stream only changes the chunks around it.  Each
+// chunk is stored once, as <store>/<first two hex digits of its
+// SHA-1>/<remaining 38 hex digits>, and a backup only records the list
+// of chunks that make up each of its streams in a small text manifest.
+
+#define STORE_CHUNK_MIN   (16*1024)
+#define STORE_CHUNK_MAX   (256*1024)
+#define STORE_CHUNK_MASK  0xffff      // average chunk of about 64 KiB
+
+#define DEFAULT_STORE     "/sdcard/nandroid/store"
+
+typedef struct {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    unsigned int length;
+} ChunkRef;
+
+typedef struct {
+    long long size;                   // total length of the stream
+    uint8_t sha1[SHA_DIGEST_SIZE];    // sha1 of the whole stream
+    int count;
+    int alloc;
+    ChunkRef* chunks;
+} Manifest;
+
+// Finds chunk boundaries in a stream with a "gear" rolling hash.
+typedef struct {
+    uint32_t hash;
+    size_t length;                    // bytes in the current chunk
+} Chunker;
+
+void ChunkerInit(void);
+void ChunkerReset(Chunker* c);
+
+// Scan up to len bytes that continue the current chunk.  Return how
+// many of them belong to it; *boundary is set if the chunk ends there.
+size_t ChunkerScan(Chunker* c, const unsigned char* data, size_t len,
+                   int* boundary);
+
+// Return 1 if the chunk was added, 0 if the store already had it, or
+// -1 on error.
+int StorePutChunk(const char* store, const uint8_t* sha1,
+                  const unsigned char* data, size_t len);
+
+// Read a chunk into buf (which must hold ref->length bytes) and check
+// its length and sha1.  Return 0 on success.
+int StoreGetChunk(const char* store, const ChunkRef* ref, unsigned char* buf);
+
+// Delete every chunk not referred to by one of the manifests, and any
+// partly written chunks.  Return the number of chunks deleted, or -1
+// if a manifest can't be read (in which case nothing is deleted).
+int StoreCollectGarbage(const char* store, char** manifests, int count);
+
+// Chunks a stream into the store as it arrives, building its manifest.
+typedef struct {
+    const char* store;
+    Manifest manifest;
+    Chunker chunker;
+    SHA_CTX whole;
+    unsigned char* chunk;             // STORE_CHUNK_MAX bytes
+    size_t fill;
+    int added;                        // chunks the store didn't have yet
+    long long added_bytes;
+} StoreWriter;
+
+int StoreWriterInit(StoreWriter* w, const char* store);
+int StoreWriterAdd(StoreWriter* w, const unsigned char* data, size_t len);
+int StoreWriterFinish(StoreWriter* w);    // completes w->manifest
+void StoreWriterFree(StoreWriter* w);
+
+void InitManifest(Manifest* m);
+void FreeManifest(Manifest* m);
+int AddChunk(Manifest* m, const uint8_t* sha1, unsigned int length);
+int ReadManifest(const char* path, Manifest* m);
+int WriteManifest(const char* path, const Manifest* m);
+
+#endif
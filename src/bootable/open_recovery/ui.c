@@ -17,10 +17,13 @@
 #include <linux/input.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/reboot.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -48,6 +51,10 @@
 #define PROGRESSBAR_INDETERMINATE_STATES 6
 #define PROGRESSBAR_INDETERMINATE_FPS 15
 
+// Printed text is shown at most this many times a second; the progress
+// thread shows whatever was printed since.
+#define TEXT_UPDATE_FPS 10
+
 #define LED_OFF   			0x00
 #define LED_ON					0x01
 #define LED_BLINK				0x02
@@ -81,11 +88,28 @@
 
 //max rows per screen
 #define CONSOLE_BUFFER_ROWS 26
-#define CONSOLE_TOTAL_ROWS (1000 + CONSOLE_BUFFER_ROWS)
+
+//lines kept for scrolling back, including the ones on the screen
+#define CONSOLE_SCROLLBACK_ROWS 1000
 
 //max supported columns per screen
 #define CONSOLE_MAX_COLUMNS 100
 
+//color changes kept per line, later ones take the color before them
+#define CONSOLE_LINE_RUNS 24
+
+//cursor blinking period
+#define CONSOLE_CURSOR_BLINK_MS 500
+
+//tracing of everything the console gets, for debugging only
+#define CONSOLE_TRACE 0
+
+#if CONSOLE_TRACE
+#define console_trace(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define console_trace(...) do { } while (0)
+#endif
+
 //characters
 #define CONSOLE_BEEP 7
 #define CONSOLE_ESC 27
@@ -165,6 +189,15 @@ static time_t gProgressScopeTime, gProgressScopeDuration;
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
 
+// Set when text was printed but not drawn yet
+static int gTextUpdatePending = 0;
+static struct timeval gLastScreenUpdate;
+
+// Set when the minui render loop draws the frames (see render_frame());
+// then these say what its next frame has to draw
+static int gRenderLoop = 0;
+static int gScreenDirty = 0, gProgressDirty = 0;
+
 //colors
 static color32 background_color = {.r = 0, .g = 0, .b = 0, .a = 160 };
 static color32 title_color = {.r = 255, .g = 55, .b = 5, .a = 255};
@@ -197,7 +230,12 @@ static int console_screen_columns = 0;
 
 //synced via gUpdateMutex
 static volatile int console_cursor_sts = 1;
-static volatile clock_t console_cursor_last_update_time = 0;
+static volatile long long console_cursor_last_update_time = 0;	//ms, see console_time()
+
+//the blinking thread sleeps on this, ui_console_end() wakes it to quit
+static pthread_cond_t console_cursor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t console_cursor_tid;
+static int console_cursor_running = 0;
 
 //console system colors
 static color24 console_header_color = {.r = 255, .g = 255, .b = 0};
@@ -225,10 +263,33 @@ static color24 console_term_colors[] =
 	{ .r=255, .g=255, .b=255 }, //CLR97
 };
 
-//Rows increased for printing history
-static char console_text[CONSOLE_TOTAL_ROWS][CONSOLE_MAX_COLUMNS];
-static color24 console_text_color[CONSOLE_TOTAL_ROWS][CONSOLE_MAX_COLUMNS];
+//a run of cells in one color, up to the start of the next one
+typedef struct
+{
+	unsigned char start;
+	unsigned char color;	//index to console_palette
+} console_color_run;
+
+typedef struct
+{
+	int row;								//the row stored here, or -1
+	int length;							//cells written, the rest are blank
+	int runs;
+	char text[CONSOLE_MAX_COLUMNS];
+	console_color_run run[CONSOLE_LINE_RUNS];
+} console_line;
+
+//the scrollback, a ring: row i is in console_lines[i % CONSOLE_SCROLLBACK_ROWS]
+//as long as it is there; rows count from ui_console_begin() and are never moved
+static console_line console_lines[CONSOLE_SCROLLBACK_ROWS];
+
+//every color the console has used, so that a cell color takes a byte
+static color24 console_palette[256];
+static gr_pixel console_palette_pixel[256];
+static int console_palette_size = 0;
+
 static color24 console_current_color;
+static unsigned char console_current_index;
 
 static int console_top_row = 0;
 static int console_force_top_row_on_text = 0;
@@ -238,16 +299,39 @@ static int console_cur_column = 0;
 
 static volatile int show_console = 0;
 static volatile int console_refresh = 1;
+
+//what the console looks like on the screen, so that only the cells that
+//differ from it are drawn again
+static char console_shown_text[CONSOLE_BUFFER_ROWS][CONSOLE_MAX_COLUMNS];
+static gr_pixel console_shown_color[CONSOLE_BUFFER_ROWS][CONSOLE_MAX_COLUMNS];
+static int console_shown_top = 0;
+static int console_shown_cursor_row = -1;
+static int console_shown_cursor_column = -1;
+static int console_shown_valid = 0;
+
 static int console_escaped_state = 0;
 static char console_escaped_buffer[64];
 static char* console_escaped_sequence;
 
 #endif //OPEN_RECOVERY_HAVE_CONSOLE
 
-// Key event input queue
-static pthread_mutex_t key_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t key_queue_cond = PTHREAD_COND_INITIALIZER;
-static int key_queue[256], key_queue_len = 0;
+// Key event input queue: a ring written only by input_thread and read
+// only by the thread running the menus or the console, so neither side
+// needs a lock; each only advances its own index, after a barrier
+#define KEY_QUEUE_SIZE 256	//a power of 2
+
+typedef struct {
+	int code;
+	struct timeval time;	//as reported by the kernel
+} key_event;
+
+static key_event key_queue[KEY_QUEUE_SIZE];
+static volatile unsigned key_queue_head = 0;	//written by input_thread
+static volatile unsigned key_queue_tail = 0;	//written by the reader
+
+// readable (for poll) after a key was queued: an eventfd, or a pipe on
+// kernels without one, in which case the two descriptors differ
+static int key_queue_fd[2] = { -1, -1 };
 static volatile char key_pressed[KEY_MAX + 1];
 
 /* reads a file with properties, making sure it is terminated with \n \0 */
@@ -592,67 +676,319 @@ draw_text_line(int row, const char* t) {
 }
 
 #if OPEN_RECOVERY_HAVE_CONSOLE
+static unsigned char
+console_color_index(color24 c)
+{
+	int i, best = 0, best_distance = INT_MAX;
+	for (i = 0; i < console_palette_size; i++)
+		if (console_palette[i].r == c.r && console_palette[i].g == c.g && console_palette[i].b == c.b)
+			return i;
+	
+	if (console_palette_size < 256)
+	{
+		console_palette[console_palette_size] = c;
+		console_palette_pixel[console_palette_size] = gr_rgb(c.r, c.g, c.b);
+		return console_palette_size++;
+	}
+	
+	//out of entries, take the closest
+	for (i = 0; i < console_palette_size; i++)
+	{
+		int dr = console_palette[i].r - c.r;
+		int dg = console_palette[i].g - c.g;
+		int db = console_palette[i].b - c.b;
+		int distance = dr * dr + dg * dg + db * db;
+		if (distance < best_distance)
+		{
+			best = i;
+			best_distance = distance;
+		}
+	}
+	return best;
+}
+
 static void
-draw_console_cursor(int row, int column, char letter)
+console_set_current_color(color24 c)
 {
-	if (!console_cursor_sts)
+	console_current_color = c;
+	console_current_index = console_color_index(c);
+}
+
+//the stored row, or NULL if it is blank (never written, or scrolled out)
+static console_line*
+console_get_line(int row)
+{
+	console_line* line = &console_lines[row % CONSOLE_SCROLLBACK_ROWS];
+	return row >= 0 && line->row == row ? line : NULL;
+}
+
+//the row to write to, taking over the slot of the oldest one if needed
+static console_line*
+console_write_line(int row)
+{
+	console_line* line = &console_lines[row % CONSOLE_SCROLLBACK_ROWS];
+	if (line->row != row)
+	{
+		line->row = row;
+		line->length = 0;
+		line->runs = 1;
+		line->run[0].start = 0;
+		line->run[0].color = 0;
+	}
+	return line;
+}
+
+//color the cells [from, to) of a line
+static void
+console_color_cells(console_line* line, int from, int to, unsigned char color)
+{
+	console_color_run* last = &line->run[line->runs - 1];
+	
+	//the usual case: writing at the end of the line
+	if (from >= last->start && to >= line->length)
+	{
+		if (last->color == color)
+			return;
+		
+		if (from == last->start)
+		{
+			last->color = color;
+			if (line->runs > 1 && last[-1].color == color)
+				line->runs--;
+			return;
+		}
+		
+		if (line->runs < CONSOLE_LINE_RUNS)
+		{
+			line->run[line->runs].start = from;
+			line->run[line->runs].color = color;
+			line->runs++;
+		}
 		return;
+	}
+	
+	//otherwise spell the colors out and make the runs again
+	unsigned char cells[CONSOLE_MAX_COLUMNS];
+	int i, r = 0;
+	for (i = 0; i < CONSOLE_MAX_COLUMNS; i++)
+	{
+		if (r + 1 < line->runs && line->run[r + 1].start == i)
+			r++;
+		cells[i] = (i >= from && i < to) ? color : line->run[r].color;
+	}
+	
+	line->runs = 1;
+	line->run[0].start = 0;
+	line->run[0].color = cells[0];
+	for (i = 1; i < CONSOLE_MAX_COLUMNS && line->runs < CONSOLE_LINE_RUNS; i++)
+	{
+		if (cells[i] == line->run[line->runs - 1].color)
+			continue;
+		line->run[line->runs].start = i;
+		line->run[line->runs].color = cells[i];
+		line->runs++;
+	}
+}
 
-	gr_color(console_front_color.r, console_front_color.g, console_front_color.b, 255);
-	gr_fill_l(column * CONSOLE_CHAR_WIDTH, row * CONSOLE_CHAR_HEIGHT, 
-					(column+1)*CONSOLE_CHAR_WIDTH, (row+1)*CONSOLE_CHAR_HEIGHT);
+static void
+console_put_cell(int row, int column, char c, int color)
+{
+	console_line* line = console_write_line(row);
 	
-	if (letter != '\0')
+	if (column >= line->length)
 	{
-		gr_color(console_background_color.r, console_background_color.g, console_background_color.b, 255);
+		memset(line->text + line->length, ' ', column - line->length);
+		line->length = column + 1;
+	}
+	line->text[column] = c;
+	
+	if (color >= 0)
+		console_color_cells(line, column, column + 1, color);
+}
+
+//blank the cells [from, to) of a row
+static void
+console_clear_cells(int row, int from, int to)
+{
+	console_line* line = console_get_line(row);
+	if (line == NULL || from >= line->length)
+		return;
+	
+	if (to >= line->length)
+		line->length = from;
+	else
+		memset(line->text + from, ' ', to - from);
+}
+
+static void
+console_forget_rows(int first, int last)
+{
+	int r;
+	for (r = first; r < last; r++)
+		memset(console_shown_text[r], 0, CONSOLE_MAX_COLUMNS);
+}
+
+//move what is on the screen along with a scroll, instead of drawing all
+//of it again; rows that come into view are left for the redraw
+static void
+console_scroll_shown(int top, int rows)
+{
+	int delta = top - console_shown_top;
+	console_shown_top = top;
 	
-		char text[2];
-		text[0] = letter;
-		text[1] = '\0';
+	if (delta == 0)
+		return;
 	
-		gr_text_l(column * CONSOLE_CHAR_WIDTH, (row+1)*CONSOLE_CHAR_HEIGHT-1, text);
+	if (console_shown_cursor_row >= 0)
+	{
+		console_shown_cursor_row -= delta;
+		if (console_shown_cursor_row < 0 || console_shown_cursor_row >= rows)
+			console_shown_cursor_row = -1;
+	}
+	
+	if (delta >= rows || delta <= -rows)
+	{
+		console_forget_rows(0, rows);
+		return;
+	}
+	
+	//landscape: row r takes the framebuffer columns
+	//[width - 1 - (r+1)*CONSOLE_CHAR_HEIGHT, width - 1 - r*CONSOLE_CHAR_HEIGHT)
+	int right = gr_fb_width() - 1;
+	int left = right - rows * CONSOLE_CHAR_HEIGHT;
+	int keep = rows - (delta > 0 ? delta : -delta);
+	int shift = (rows - keep) * CONSOLE_CHAR_HEIGHT;
+	
+	if (delta > 0)
+	{
+		//text goes up the console, that is right on the framebuffer
+		gr_move(left, 0, right - left - shift, gr_fb_height(), left + shift, 0);
+		memmove(console_shown_text[0], console_shown_text[delta], keep * sizeof(console_shown_text[0]));
+		memmove(console_shown_color[0], console_shown_color[delta], keep * sizeof(console_shown_color[0]));
+		console_forget_rows(keep, rows);
+	}
+	else
+	{
+		gr_move(left + shift, 0, right - left - shift, gr_fb_height(), left, 0);
+		memmove(console_shown_text[-delta], console_shown_text[0], keep * sizeof(console_shown_text[0]));
+		memmove(console_shown_color[-delta], console_shown_color[0], keep * sizeof(console_shown_color[0]));
+		console_forget_rows(0, -delta);
 	}
 }
 
-static void 
-draw_console_line(int row, const char* t, const color24* c) {
-  
-  char letter[2];
-  letter[1] = '\0';
-  
-  int i = 0;
-  
-  while(t[i] != '\0') 
-  {
-  	letter[0] = t[i];
-  	gr_color(c[i].r, c[i].g, c[i].b, 255);
-    gr_text_l(i * CONSOLE_CHAR_WIDTH, (row+1)*CONSOLE_CHAR_HEIGHT-1, letter);
-		i++;	
-  }
+static void
+draw_console_cells(int row, int column, const char* text, const gr_pixel* fg, int count, gr_pixel bg)
+{
+	char run[CONSOLE_MAX_COLUMNS + 1];
+	memcpy(run, text, count);
+	run[count] = '\0';
+	gr_text_cells_l(column * CONSOLE_CHAR_WIDTH, (row+1)*CONSOLE_CHAR_HEIGHT-1, run, fg, &bg);
 }
 
+//draw only the cells that differ from what is on the screen, in runs
 static void
 draw_console_locked()
 {
-	gr_color(console_background_color.r, console_background_color.g, console_background_color.b, 255);
-  gr_fill(0, 0, gr_fb_width(), gr_fb_height());
-
-	int draw_cursor = 0;
+	gr_pixel bg = gr_rgb(console_background_color.r, console_background_color.g, console_background_color.b);
+	int rows = console_screen_rows < CONSOLE_BUFFER_ROWS ? console_screen_rows : CONSOLE_BUFFER_ROWS;
+	int columns = console_screen_columns - 1;
 	
-	int i;	
-	for (i = console_top_row; i < console_top_row + console_screen_rows; i++)
+	if (!console_shown_valid)
 	{
-		draw_console_line(i - console_top_row, console_text[i], console_text_color[i]);
+		gr_color(console_background_color.r, console_background_color.g, console_background_color.b, 255);
+		gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 		
-		if (i == console_cur_row)
+		int r;
+		for (r = 0; r < rows; r++)
 		{
-			draw_cursor = 1;
-			break;
+			memset(console_shown_text[r], ' ', CONSOLE_MAX_COLUMNS);
+			memset(console_shown_color[r], 0, sizeof(console_shown_color[r]));
 		}
+		console_shown_top = console_top_row;
+		console_shown_cursor_row = -1;
+		console_shown_valid = 1;
 	}
+	else
+		console_scroll_shown(console_top_row, rows);
 	
-	if(draw_cursor)
-		draw_console_cursor(console_cur_row-console_top_row, console_cur_column, console_text[console_cur_row][console_cur_column]);
+	int cursor_row = -1;
+	int cursor_column = -1;
+	if (console_cursor_sts && console_cur_row >= console_top_row && console_cur_row < console_top_row + rows)
+	{
+		cursor_row = console_cur_row - console_top_row;
+		cursor_column = console_cur_column;
+	}
+	
+	//the old cursor cell goes back to normal
+	int cursor_moved = console_shown_cursor_row != cursor_row || console_shown_cursor_column != cursor_column;
+	if (console_shown_cursor_row >= 0 && cursor_moved)
+		console_shown_text[console_shown_cursor_row][console_shown_cursor_column] = 0;
+	
+	int r, c;
+	for (r = 0; r < rows; r++)
+	{
+		int i = console_top_row + r;
+		//rows below the cursor are not shown
+		console_line* line = i <= console_cur_row ? console_get_line(i) : NULL;
+		int length = line != NULL ? line->length : 0;
+		int color_run = 0;
+		char run_text[CONSOLE_MAX_COLUMNS];
+		gr_pixel run_color[CONSOLE_MAX_COLUMNS];
+		int run_start = 0;
+		int run_length = 0;
+		
+		for (c = 0; c < columns; c++)
+		{
+			char letter = c < length ? line->text[c] : ' ';
+			gr_pixel color = 0;
+			
+			if (line != NULL && color_run + 1 < line->runs && line->run[color_run + 1].start == c)
+				color_run++;
+			
+			if ((unsigned char)letter > ' ' && (unsigned char)letter < 128)
+				color = console_palette_pixel[line->run[color_run].color];
+			else
+				letter = ' ';
+			
+			int cursor = r == cursor_row && c == cursor_column;
+			int same = console_shown_text[r][c] == letter && console_shown_color[r][c] == color;
+			
+			if (same && !(cursor && cursor_moved))
+			{
+				if (run_length > 0)
+					draw_console_cells(r, run_start, run_text, run_color, run_length, bg);
+				run_length = 0;
+				continue;
+			}
+			
+			console_shown_text[r][c] = letter;
+			console_shown_color[r][c] = color;
+			
+			if (cursor)
+			{
+				//the cursor cell, inverted
+				gr_pixel front = gr_rgb(console_front_color.r, console_front_color.g, console_front_color.b);
+				
+				if (run_length > 0)
+					draw_console_cells(r, run_start, run_text, run_color, run_length, bg);
+				run_length = 0;
+				draw_console_cells(r, c, &letter, &bg, 1, front);
+				continue;
+			}
+			
+			if (run_length == 0)
+				run_start = c;
+			run_text[run_length] = letter;
+			run_color[run_length] = color;
+			run_length++;
+		}
+		
+		if (run_length > 0)
+			draw_console_cells(r, run_start, run_text, run_color, run_length, bg);
+	}
+	
+	console_shown_cursor_row = cursor_row;
+	console_shown_cursor_column = cursor_column;
 }
 #endif //OPEN_RECOVERY_HAVE_CONSOLE
 
@@ -778,16 +1114,42 @@ static void draw_screen_locked(void)
 }
 
 // Redraw everything on the screen and flip the screen (make it visible).
+// With the render loop running, that happens with its next frame.
 // Should only be called with gUpdateMutex locked.
 static void update_screen_locked(void)
 {
+  gTextUpdatePending = 0;
+  gettimeofday(&gLastScreenUpdate, NULL);
+  
+  if (gRenderLoop)
+  {
+    gScreenDirty = 1;
+    gr_request_frame();
+    return;
+  }
+  
   draw_screen_locked();
   gr_flip();
 }
 
-// Updates only the progress bar, if possible, otherwise redraws the screen.
+// Show printed text, unless the screen was updated too recently; then
+// the progress thread shows it a little later, along with anything
+// printed meanwhile.
 // Should only be called with gUpdateMutex locked.
-static void update_progress_locked(void)
+static void update_text_locked(void)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  long long elapsed = (now.tv_sec - gLastScreenUpdate.tv_sec) * 1000000LL +
+      (now.tv_usec - gLastScreenUpdate.tv_usec);
+  
+  if (elapsed >= 1000000 / TEXT_UPDATE_FPS || elapsed < 0)
+    update_screen_locked();
+  else
+    gTextUpdatePending = 1;
+}
+
+static void draw_progress_or_screen_locked(void)
 {
     if (show_text || !gPagesIdentical) {
         draw_screen_locked();    // Must redraw the whole screen
@@ -795,9 +1157,37 @@ static void update_progress_locked(void)
     } else {
         draw_progress_locked();  // Draw only the progress bar
     }
+}
+
+// Updates only the progress bar, if possible, otherwise redraws the screen.
+// Should only be called with gUpdateMutex locked.
+static void update_progress_locked(void)
+{
+    if (gRenderLoop) {
+        gProgressDirty = 1;
+        gr_request_frame();
+        return;
+    }
+    
+    draw_progress_or_screen_locked();
     gr_flip();
 }
 
+// Called by the minui render loop to draw and show whatever was asked
+// for since its last frame.
+static void render_frame(void *cookie)
+{
+    pthread_mutex_lock(&gUpdateMutex);
+    if (gScreenDirty) {
+        draw_screen_locked();
+    } else if (gProgressDirty) {
+        draw_progress_or_screen_locked();
+    }
+    gScreenDirty = gProgressDirty = 0;
+    gr_flip();
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
 // Keeps the progress bar updated, even when the process is otherwise busy.
 static void *progress_thread(void *cookie)
 {
@@ -805,6 +1195,11 @@ static void *progress_thread(void *cookie)
         usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
         pthread_mutex_lock(&gUpdateMutex);
 
+        // show the text printed since the last update
+        if (gTextUpdatePending) {
+            update_screen_locked();
+        }
+
         // update the progress bar animation, if active
         // skip this if we have a text overlay (too expensive to update)
         if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
@@ -855,38 +1250,36 @@ void ui_led_blink(int continuously)
   
 }
 
+//the led may not be there (e.g. running headless, see minui.h)
 static void
-led_on(FILE* ledfp_r, FILE* ledfp_g, FILE* ledfp_b)
+led_write(FILE* ledfp, const char* value)
 {
-	if (led_color.r)
+	if (ledfp != NULL)
 	{
-		fwrite("1", 1, 1, ledfp_r);
-		fflush(ledfp_r);
+		fwrite(value, 1, 1, ledfp);
+		fflush(ledfp);
 	}
+}
+
+static void
+led_on(FILE* ledfp_r, FILE* ledfp_g, FILE* ledfp_b)
+{
+	if (led_color.r)
+		led_write(ledfp_r, "1");
 	
 	if (led_color.g)
-	{
-		fwrite("1", 1, 1, ledfp_g);
-		fflush(ledfp_g);
-	}
+		led_write(ledfp_g, "1");
 		
 	if (led_color.b)
-	{
-		fwrite("1", 1, 1, ledfp_b);
-		fflush(ledfp_b);
-	}
+		led_write(ledfp_b, "1");
 }
 
 static void
 led_off(FILE* ledfp_r, FILE* ledfp_g, FILE* ledfp_b)
 {
-	fwrite("0", 1, 1, ledfp_r);
-	fwrite("0", 1, 1, ledfp_g);
-	fwrite("0", 1, 1, ledfp_b);
-	
-	fflush(ledfp_r);
-	fflush(ledfp_g);
-	fflush(ledfp_b);
+	led_write(ledfp_r, "0");
+	led_write(ledfp_g, "0");
+	led_write(ledfp_b, "0");
 }
 
 static void*
@@ -962,6 +1355,21 @@ led_thread(void *cookie)
 }
 
 // Reads input events, handles special hot keys, and adds to the key queue.
+// wakes up whoever polls ui_get_key_fd()
+static void key_queue_notify(void)
+{
+    uint64_t one = 1;
+    if (key_queue_fd[1] >= 0)
+        write(key_queue_fd[1], &one, key_queue_fd[0] == key_queue_fd[1] ? sizeof(one) : 1);
+}
+
+static void key_queue_drain(void)
+{
+    char buf[64];
+    if (key_queue_fd[0] >= 0)
+        while (read(key_queue_fd[0], buf, sizeof(buf)) > 0);
+}
+
 static void*
 input_thread(void *cookie)
 {
@@ -1003,7 +1411,6 @@ input_thread(void *cookie)
             }
         } while (ev.type != EV_KEY || ev.code > KEY_MAX);
 
-        pthread_mutex_lock(&key_queue_mutex);
         if (!fake_key) {
             // our "fake" keys only report a key-down event (no
             // key-up), so don't record them in the key_pressed
@@ -1011,12 +1418,16 @@ input_thread(void *cookie)
             key_pressed[ev.code] = ev.value;
         }
         fake_key = 0;
-        const int queue_max = sizeof(key_queue) / sizeof(key_queue[0]);
-        if (ev.value > 0 && key_queue_len < queue_max) {
-            key_queue[key_queue_len++] = ev.code;
-            pthread_cond_signal(&key_queue_cond);
+        unsigned head = key_queue_head;
+        if (ev.value > 0 && head - key_queue_tail < KEY_QUEUE_SIZE) {
+            key_event* k = &key_queue[head & (KEY_QUEUE_SIZE - 1)];
+            k->code = ev.code;
+            k->time = ev.time;
+            // the event has to be there before the reader can see it
+            __sync_synchronize();
+            key_queue_head = head + 1;
+            key_queue_notify();
         }
-        pthread_mutex_unlock(&key_queue_mutex);
 
 				//only in lite version
 #if OPEN_RCVR_VERSION_LITE
@@ -1038,24 +1449,43 @@ input_thread(void *cookie)
 
 #if OPEN_RECOVERY_HAVE_CONSOLE
 
+//monotonic milliseconds, for the cursor blinking
+static long long
+console_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//blinks the cursor every half a second, sleeping in between
 static void*
 console_cursor_thread(void *cookie)
 {
+	pthread_mutex_lock(&gUpdateMutex);
 	while (show_console)
 	{
-		clock_t time_now = clock();
-		double since_last_update = ((double)(time_now - console_cursor_last_update_time)) / CLOCKS_PER_SEC;
-	
-		if (since_last_update >= 0.5)
-		{		
-			pthread_mutex_lock(&gUpdateMutex);
+		long long time_now = console_time();
+		long long wait = console_cursor_last_update_time + CONSOLE_CURSOR_BLINK_MS - time_now;
+		
+		if (wait <= 0)
+		{
 			console_cursor_sts = console_cursor_sts ? 0 : 1;
 			console_cursor_last_update_time = time_now;
 			update_screen_locked();
-			pthread_mutex_unlock(&gUpdateMutex);
+			wait = CONSOLE_CURSOR_BLINK_MS;
 		}
-		usleep(20000);		
+		
+		//the wait itself is on the wall clock, a jump only delays one blink
+		struct timeval tv;
+		struct timespec deadline;
+		gettimeofday(&tv, NULL);
+		long long usec = tv.tv_usec + wait * 1000;
+		deadline.tv_sec = tv.tv_sec + usec / 1000000;
+		deadline.tv_nsec = (usec % 1000000) * 1000;
+		pthread_cond_timedwait(&console_cursor_cond, &gUpdateMutex, &deadline);
 	}
+	pthread_mutex_unlock(&gUpdateMutex);
 	
 	return NULL;
 }
@@ -1100,10 +1530,32 @@ void ui_init(void)
 		//enable keyboard backlight (only on console enabled phones)
 #if OPEN_RECOVERY_HAVE_CONSOLE
 		FILE* keyboardfd = fopen(KEYBOARD_BACKLIGHT_FILE, "w");
-		fwrite("1", 1, 1, keyboardfd);
-		fclose(keyboardfd);
+		if (keyboardfd != NULL)
+		{
+			fwrite("1", 1, 1, keyboardfd);
+			fclose(keyboardfd);
+		}
 #endif
 
+    key_queue_fd[0] = key_queue_fd[1] = -1;
+#ifdef __NR_eventfd
+    key_queue_fd[0] = key_queue_fd[1] = syscall(__NR_eventfd, 0);
+#endif
+    if (key_queue_fd[0] < 0 && pipe(key_queue_fd) < 0) {
+        LOGE("Can't create the key queue pipe\n");
+        key_queue_fd[0] = key_queue_fd[1] = -1;
+    } else {
+        fcntl(key_queue_fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(key_queue_fd[1], F_SETFL, O_NONBLOCK);
+        fcntl(key_queue_fd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(key_queue_fd[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    // from now on the screen is drawn by the render loop
+    pthread_mutex_lock(&gUpdateMutex);
+    gRenderLoop = gr_render_start(render_frame, NULL) == 0;
+    pthread_mutex_unlock(&gUpdateMutex);
+
     pthread_t t;
     pthread_create(&t, NULL, progress_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
@@ -1187,6 +1639,24 @@ void ui_reset_progress()
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
+// Add text to the log, scrolling it as needed.  Cheap: the screen is
+// redrawn separately, see update_text_locked().
+// Should only be called with gUpdateMutex locked.
+static void append_text_locked(const char *buf)
+{
+    const char *ptr;
+    for (ptr = buf; *ptr != '\0'; ++ptr) {
+        if (*ptr == '\n' || text_col >= text_cols) {
+            text[text_row][text_col] = '\0';
+            text_col = 0;
+            text_row = (text_row + 1) % text_rows;
+            if (text_row == text_top) text_top = (text_top + 1) % text_rows;
+        }
+        if (*ptr != '\n') text[text_row][text_col++] = *ptr;
+    }
+    text[text_row][text_col] = '\0';
+}
+
 void ui_print(const char *fmt, ...)
 {
     char buf[2048];
@@ -1195,46 +1665,18 @@ void ui_print(const char *fmt, ...)
     vsnprintf(buf, 2048, fmt, ap);
     va_end(ap);
 
-    fputs(buf, stderr);
-
-    // This can get called before ui_init(), so be careful.
-    pthread_mutex_lock(&gUpdateMutex);
-    if (text_rows > 0 && text_cols > 0) {
-        char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\n' || text_col >= text_cols) {
-                text[text_row][text_col] = '\0';
-                text_col = 0;
-                text_row = (text_row + 1) % text_rows;
-                if (text_row == text_top) text_top = (text_top + 1) % text_rows;
-            }
-            if (*ptr != '\n') text[text_row][text_col++] = *ptr;
-        }
-        text[text_row][text_col] = '\0';
-        update_screen_locked();
-    }
-    pthread_mutex_unlock(&gUpdateMutex);
+    ui_print_raw(buf);
 }
 
 void ui_print_raw(const char *buf)
 {
-   fputs(buf, stderr);
+    fputs(buf, stderr);
 
     // This can get called before ui_init(), so be careful.
     pthread_mutex_lock(&gUpdateMutex);
     if (text_rows > 0 && text_cols > 0) {
-        const char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\n' || text_col >= text_cols) {
-                text[text_row][text_col] = '\0';
-                text_col = 0;
-                text_row = (text_row + 1) % text_rows;
-                if (text_row == text_top) text_top = (text_top + 1) % text_rows;
-            }
-            if (*ptr != '\n') text[text_row][text_col++] = *ptr;
-        }
-        text[text_row][text_col] = '\0';
-        update_screen_locked();
+        append_text_locked(buf);
+        update_text_locked();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -1336,30 +1778,49 @@ int ui_text_visible()
   return visible;
 }
 
-int ui_get_key()
+int ui_get_key_event(struct timeval* when)
 {
-	int key = -1;
-	pthread_mutex_lock(&key_queue_mutex);
+	unsigned tail = key_queue_tail;
 	
-	if (key_queue_len != 0)
+	if (tail == key_queue_head)
 	{
-		key = key_queue[0];
-		memcpy(&key_queue[0], &key_queue[1], sizeof(int) * --key_queue_len);
+		// forget the wakeups for the keys already read, then look again
+		// for one queued meanwhile, whose wakeup may just have been lost
+		key_queue_drain();
+		if (tail == key_queue_head)
+			return -1;
 	}
 	
-	pthread_mutex_unlock(&key_queue_mutex); 
-	return key;
+	// see the event only after seeing it was queued
+	__sync_synchronize();
+	key_event k = key_queue[tail & (KEY_QUEUE_SIZE - 1)];
+	// and be done reading it before the slot can be reused
+	__sync_synchronize();
+	key_queue_tail = tail + 1;
+	
+	if (when != NULL)
+		*when = k.time;
+	return k.code;
 }
 
-int ui_wait_key()
+int ui_get_key()
 {
-	pthread_mutex_lock(&key_queue_mutex);
-	while (key_queue_len == 0) 
-		pthread_cond_wait(&key_queue_cond, &key_queue_mutex);
+	return ui_get_key_event(NULL);
+}
 
-	int key = key_queue[0];
-	memcpy(&key_queue[0], &key_queue[1], sizeof(int) * --key_queue_len);
-	pthread_mutex_unlock(&key_queue_mutex);
+int ui_wait_key()
+{
+	int key;
+	while ((key = ui_get_key()) == -1)
+	{
+		struct pollfd fd = { .fd = key_queue_fd[0], .events = POLLIN };
+		
+		if (fd.fd < 0)
+			usleep(20000);
+		else
+			poll(&fd, 1, -1);
+	}
+	
 	return key;
 }
 
@@ -1371,9 +1832,13 @@ int ui_key_pressed(int key)
 
 void ui_clear_key_queue() 
 {
-	pthread_mutex_lock(&key_queue_mutex);
-	key_queue_len = 0;
-	pthread_mutex_unlock(&key_queue_mutex);
+	key_queue_drain();
+	key_queue_tail = key_queue_head;
+}
+
+int ui_get_key_fd()
+{
+	return key_queue_fd[0];
 }
 
 int ui_get_num_columns()
@@ -1389,11 +1854,12 @@ void ui_console_begin()
 	show_console = 1;
 	console_refresh = 1;
 	console_cursor_sts = 1;
-	console_cursor_last_update_time = clock();
+	console_cursor_last_update_time = console_time();
 	console_top_row = 0;
 	console_cur_row = 0;
 	console_cur_column = 0;
 	console_escaped_state = 0;
+	console_shown_valid = 0;
 	
 	//calculate the number of columns and rows
 	console_screen_rows = ui_console_get_height() / CONSOLE_CHAR_HEIGHT;
@@ -1402,17 +1868,17 @@ void ui_console_begin()
 	console_force_top_row_on_text = 0;
 	console_force_top_row_reserve = 1 - console_screen_rows;
 	
-	memset(console_text, ' ', (CONSOLE_TOTAL_ROWS) * (console_screen_columns));
-	memset(console_text_color, 0, (CONSOLE_TOTAL_ROWS) * (console_screen_columns) * sizeof(color24));
-	
 	int i;
-	for (i = 0; i < (CONSOLE_TOTAL_ROWS); i++)
-		console_text[i][console_screen_columns - 1] = '\0'; 
+	for (i = 0; i < CONSOLE_SCROLLBACK_ROWS; i++)
+		console_lines[i].row = -1;
 	
-	console_current_color = console_front_color;
+	//index 0 is what cleared cells get
+	console_palette_size = 0;
+	console_color_index(console_background_color);
+	console_set_current_color(console_front_color);
 	
-	pthread_t t;
-	pthread_create(&t, NULL, console_cursor_thread, NULL);
+	console_cursor_running =
+		pthread_create(&console_cursor_tid, NULL, console_cursor_thread, NULL) == 0;
 	
 	update_screen_locked();
 	pthread_mutex_unlock(&gUpdateMutex);
@@ -1422,10 +1888,18 @@ void ui_console_end()
 {
 	pthread_mutex_lock(&gUpdateMutex);
 	show_console = 0;
+	pthread_cond_signal(&console_cursor_cond);
 	update_screen_locked();
 	console_screen_rows = 0;
 	console_screen_columns = 0;
 	pthread_mutex_unlock(&gUpdateMutex);
+	
+	//so that a ui_console_begin() right after doesn't get two of them
+	if (console_cursor_running)
+	{
+		pthread_join(console_cursor_tid, NULL);
+		console_cursor_running = 0;
+	}
 }
 
 void ui_console_begin_update()
@@ -1468,10 +1942,15 @@ void ui_console_scroll_up(int num_rows)
 {
 	pthread_mutex_lock(&gUpdateMutex);
 	
-	if (console_top_row - num_rows < 0)
-		console_top_row = 0;
-	else
-		console_top_row -= num_rows;
+	//no further back than the scrollback goes
+	int min_row_top = console_cur_row - CONSOLE_SCROLLBACK_ROWS + CONSOLE_BUFFER_ROWS;
+	
+	if (min_row_top < 0)
+		min_row_top = 0;
+	
+	console_top_row -= num_rows;
+	if (console_top_row < min_row_top)
+		console_top_row = min_row_top;
 	
 	update_screen_locked();
 	pthread_mutex_unlock(&gUpdateMutex);	
@@ -1526,15 +2005,15 @@ void ui_console_set_system_front_color(int which)
 	switch(which)
 	{
 		case CONSOLE_HEADER_COLOR:
-			console_current_color = console_header_color;
+			console_set_current_color(console_header_color);
 			break;
 			
 		case CONSOLE_DEFAULT_BACKGROUND_COLOR:
-			console_current_color = console_background_color;
+			console_set_current_color(console_background_color);
 			break;
 			
 		case CONSOLE_DEFAULT_FRONT_COLOR:
-			console_current_color = console_front_color;
+			console_set_current_color(console_front_color);
 			break;
 	}
 }
@@ -1548,9 +2027,8 @@ void ui_console_get_front_color(unsigned char* r, unsigned char* g, unsigned cha
 
 void ui_console_set_front_color(unsigned char r, unsigned char g, unsigned char b)
 {
-	console_current_color.r = r;
-	console_current_color.g = g;
-	console_current_color.b = b;
+	color24 c = {.r = r, .g = g, .b = b};
+	console_set_current_color(c);
 }
 
 void console_set_front_term_color(int ascii_code)
@@ -1573,18 +2051,18 @@ console_put_char(char c)
 	switch(c)
 	{
 		case '\n':
-			fprintf(stderr, "Row %d, Column %d, Char \"LINE BREAK\"\n", console_cur_row, console_cur_column);
+			console_trace("Row %d, Column %d, Char \"LINE BREAK\"\n", console_cur_row, console_cur_column);
 			console_cur_row++;
 			console_force_top_row_reserve++;
 			break;
 		
 		case '\r':
-			fprintf(stderr, "Row %d, Column %d, Char \"CARRIAGE RETURN\"\n", console_cur_row, console_cur_column);
+			console_trace("Row %d, Column %d, Char \"CARRIAGE RETURN\"\n", console_cur_row, console_cur_column);
 			console_cur_column = 0;
 			break;
 
 		case '\t':
-			fprintf(stderr, "Row %d, Column %d, Char \"TAB\"\n", console_cur_row, console_cur_column);
+			console_trace("Row %d, Column %d, Char \"TAB\"\n", console_cur_row, console_cur_column);
 			//tab is per 5
 			int end = console_cur_column + (5 - console_cur_column % 5);
 		
@@ -1592,7 +2070,7 @@ console_put_char(char c)
 			{
 				int i;
 				for (i = console_cur_column; i < console_screen_columns - 1; i++)
-					console_text[console_cur_row][i] = ' ';
+					console_put_cell(console_cur_row, i, ' ', -1);
 			
 				console_cur_column = 0;
 				console_cur_row++;
@@ -1602,14 +2080,14 @@ console_put_char(char c)
 			{
 				int i;
 				for (i = console_cur_column; i < end; i++)
-					console_text[console_cur_row][i] = ' ';
+					console_put_cell(console_cur_row, i, ' ', -1);
 				
 				console_cur_column = end;
 			}
 			break;
 		
 		case '\b':
-			fprintf(stderr, "Row %d, Column %d, Char \"BACKSPACE\"\n", console_cur_row, console_cur_column);
+			console_trace("Row %d, Column %d, Char \"BACKSPACE\"\n", console_cur_row, console_cur_column);
 			if (console_cur_column == 0)
 			{
 				if (console_cur_row == 0)
@@ -1627,9 +2105,8 @@ console_put_char(char c)
 			break;
 		
 		default:
-			console_text[console_cur_row][console_cur_column] = c;
-			console_text_color[console_cur_row][console_cur_column] = console_current_color;
-			fprintf(stderr, "Row %d, Column %d, Char %d\n", console_cur_row, console_cur_column, c);
+			console_put_cell(console_cur_row, console_cur_column, c, console_current_index);
+			console_trace("Row %d, Column %d, Char %d\n", console_cur_row, console_cur_column, c);
 			console_cur_column++;
 
 			if (console_cur_column > console_screen_columns - 2)
@@ -1640,29 +2117,6 @@ console_put_char(char c)
 			}
 			break;
 	}
-
-	if (console_cur_row == CONSOLE_TOTAL_ROWS)
-	{
-		int shift = console_cur_row - (CONSOLE_TOTAL_ROWS - CONSOLE_BUFFER_ROWS);
-		fprintf(stderr, "Shifting the rows by %d.\n", shift);
-		int j;
-
-		for (j = 0; j < CONSOLE_TOTAL_ROWS - CONSOLE_BUFFER_ROWS; j++)
-		{
-			memcpy(console_text[j], console_text[j + shift], console_screen_columns);
-			memcpy(console_text_color[j], console_text_color[j + shift], console_screen_columns * sizeof(color24));
-		}
-
-		for (j = CONSOLE_TOTAL_ROWS - CONSOLE_BUFFER_ROWS; j < CONSOLE_TOTAL_ROWS; j++)
-		{
-			memset(console_text[j], ' ', console_screen_columns);
-			console_text[j][console_screen_columns - 1] = '\0';		
-			memset(console_text_color[j], 0, console_screen_columns * sizeof(color24)); 
-		}
-
-		console_cur_row -= shift;
-		console_force_top_row_on_text -= shift;
-	}			
 }
 
 static void
@@ -1707,15 +2161,15 @@ console_unescape()
 	//was used for indexing, so increment it
 	noParameters++;
 	
-	fprintf(stderr, "ESCAPE: no. Brackets S%d RL%d RR%d, no Question Marks %d, no. params %d, argument %c,\n", 
+	console_trace("ESCAPE: no. Brackets S%d RL%d RR%d, no Question Marks %d, no. params %d, argument %c,\n", 
 		noSqrBrackets, noRoundBracketsLeft, noRoundBracketsRight, noQuestionMarks, noParameters, argument);
-	fprintf(stderr, "PARAMS:");
+	console_trace("PARAMS:");
 	
 	int i, j;
 	for (i = 0; i < noParameters; i++)
-		fprintf(stderr, " %d", parameters[i]);
+		console_trace(" %d", parameters[i]);
 		
-	fprintf(stderr, "\n");
+	console_trace("\n");
 	
 	if (noSqrBrackets == 1 && noRoundBracketsLeft == 0 && noRoundBracketsRight == 0 && noQuestionMarks == 0)
 	{
@@ -1787,55 +2241,23 @@ console_unescape()
 			
 			//clear below cursor	
 			case 'J':			
-				for (j = console_cur_column; j < (console_screen_columns - 1); j++)
-				{
-					console_text[console_cur_row][j] = ' ';
-					console_text_color[console_cur_row][j].r = 0;
-					console_text_color[console_cur_row][j].g = 0;
-					console_text_color[console_cur_row][j].b = 0;
-				}
+				console_clear_cells(console_cur_row, console_cur_column, console_screen_columns - 1);
 		
-				for (j = console_cur_row + 1; j < CONSOLE_TOTAL_ROWS; j++)
-				{
-					memset(console_text[j], ' ', console_screen_columns);
-					console_text[j][console_screen_columns - 1] = '\0';		
-					memset(console_text_color[j], 0, console_screen_columns * sizeof(color24));
-				}
+				for (j = 0; j < CONSOLE_SCROLLBACK_ROWS; j++)
+					if (console_lines[j].row > console_cur_row)
+						console_lines[j].row = -1;
+				
 				was_unescaped = 1;		
 				break;
 				
 			//clear from cursor cursor	
 			case 'K':	
 				if (parameters[0] == 0)
-				{
-					for (j = console_cur_column; j < (console_screen_columns - 1); j++)
-					{
-						console_text[console_cur_row][j] = ' ';
-						console_text_color[console_cur_row][j].r = 0;
-						console_text_color[console_cur_row][j].g = 0;
-						console_text_color[console_cur_row][j].b = 0;
-					}
-				}
+					console_clear_cells(console_cur_row, console_cur_column, console_screen_columns - 1);
 				else if (parameters[0] == 1)
-				{
-					for (j = 0; j <= console_cur_column; j++)
-					{
-						console_text[console_cur_row][j] = ' ';
-						console_text_color[console_cur_row][j].r = 0;
-						console_text_color[console_cur_row][j].g = 0;
-						console_text_color[console_cur_row][j].b = 0;
-					}
-				}
+					console_clear_cells(console_cur_row, 0, console_cur_column + 1);
 				else if (parameters[0] == 2)
-				{
-					for (j = 0; j < (console_screen_columns - 1); j++)
-					{
-						console_text[console_cur_row][j] = ' ';
-						console_text_color[console_cur_row][j].r = 0;
-						console_text_color[console_cur_row][j].g = 0;
-						console_text_color[console_cur_row][j].b = 0;
-					}
-				}
+					console_clear_cells(console_cur_row, 0, console_screen_columns - 1);
 			
 				was_unescaped = 1;	
 				break;
@@ -1900,7 +2322,7 @@ console_put_escape_sequence(char c)
 	if (c != '[' && c != '(' && c != '?' && c != ')' && c != ';' && !(c >= '0' && c <= '9'))
 	{
 		*console_escaped_sequence = '\0';
-		fprintf(stderr, "Escape character: %s\n", console_escaped_buffer);
+		console_trace("Escape character: %s\n", console_escaped_buffer);
 		console_unescape();
 		console_escaped_state = 0;	
 	}
@@ -1937,7 +2359,7 @@ void ui_console_print(const char *text)
 		console_top_row = 0;	
 	
 	console_cursor_sts = 1;
-	console_cursor_last_update_time = clock();	
+	console_cursor_last_update_time = console_time();	
 	update_screen_locked();
 	pthread_mutex_unlock(&gUpdateMutex);	
 }
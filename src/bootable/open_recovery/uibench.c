@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2026 The Open Recovery Project
+ * Open Recovery UI Benchmark
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the recovery's ui (ui.c and minui) on a Linux host, on the
+// headless minui backend, so that drawing can be timed and replayed
+// without a phone:
+//
+//   MINUI_HEADLESS=480x854 MINUI_KEYS=menu.keys [MINUI_DUMP=dir] uibench_orcvr
+//
+// It goes through the things the recovery spends its drawing on: a menu
+// driven by the key script until an item is selected (the script has to
+// select one, or end with "quit"), a screenful of log lines, a progress
+// bar and, where the recovery has one, the console.  The time each part
+// took is printed; minui adds the time of every frame and a summary at
+// exit (see minui.h).  The images come from /res/images if it's there.
+
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "minui/minui.h"
+
+#define TEXT_LINES      200
+#define PROGRESS_STEPS  100
+#define CONSOLE_LINES   500
+
+// ui.c calls these back into the recovery.
+int device_reboot_now(volatile char* key_pressed, int key_code)
+{
+	return 0;
+}
+
+int ensure_common_roots_unmounted()
+{
+	return 0;
+}
+
+static struct timeval phase_start;
+
+static void
+begin_phase()
+{
+	gettimeofday(&phase_start, NULL);
+}
+
+static void
+end_phase(const char* name)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long long ms = (now.tv_sec - phase_start.tv_sec) * 1000LL +
+		(now.tv_usec - phase_start.tv_usec) / 1000;
+	fprintf(stderr, "uibench: %s: %lld ms\n", name, ms);
+
+	//let the last frame out before the next part starts
+	usleep(100000);
+}
+
+//the key handling of get_menu_selection() in recovery.c, with the keys
+//of default_recovery_ui.c that a pc keyboard has
+static int
+run_menu()
+{
+	static char* headers[] = { "uibench", "", NULL };
+	static char* items[] = { "reboot system now", "apply sdcard:update.zip",
+		"wipe data/factory reset", "wipe cache partition", "nandroid",
+		"console", "settings", NULL };
+	int count = sizeof(items) / sizeof(items[0]) - 1;
+	int selected = 0;
+
+	ui_clear_key_queue();
+	ui_start_menu(headers, items, 2, 0);
+	for (;;)
+	{
+		int key = ui_wait_key();
+		if (key == KEY_DOWN || key == KEY_VOLUMEDOWN)
+			selected = ui_menu_select(selected + 1 < count ? selected + 1 : 0);
+		else if (key == KEY_UP || key == KEY_VOLUMEUP)
+			selected = ui_menu_select(selected > 0 ? selected - 1 : count - 1);
+		else if (key == KEY_ENTER || key == KEY_CAMERA)
+			break;
+	}
+	ui_end_menu();
+	return selected;
+}
+
+int main(int argc, char** argv)
+{
+	int i;
+
+	if (getenv(MINUI_HEADLESS_ENV) == NULL)
+	{
+		fprintf(stderr, "uibench: set %s=<width>x<height> (and %s=<script>), "
+			"see minui.h\n", MINUI_HEADLESS_ENV, MINUI_KEYS_ENV);
+		return 2;
+	}
+
+	ui_init();
+	ui_set_background(BACKGROUND_ICON_ERROR);
+
+	if (getenv(MINUI_KEYS_ENV) != NULL)
+	{
+		begin_phase();
+		int selected = run_menu();
+		end_phase("menu");
+		ui_print("Selected item %d.\n", selected);
+	}
+
+	begin_phase();
+	for (i = 0; i < TEXT_LINES; i++)
+		ui_print("Line %d of the log, as long as a typical one gets.\n", i);
+	end_phase("text");
+
+	begin_phase();
+	ui_show_progress(1.0, 0);
+	for (i = 0; i <= PROGRESS_STEPS; i++)
+	{
+		ui_set_progress((float) i / PROGRESS_STEPS);
+		usleep(1000);
+	}
+	ui_reset_progress();
+	end_phase("progress");
+
+#if OPEN_RECOVERY_HAVE_CONSOLE
+	begin_phase();
+	ui_console_begin();
+	for (i = 0; i < CONSOLE_LINES; i++)
+	{
+		char line[80];
+		snprintf(line, sizeof(line), "\033[3%dmconsole line %d\033[0m\r\n", i % 8, i);
+		ui_console_print(line);
+	}
+	ui_console_end();
+	end_phase("console");
+#endif //OPEN_RECOVERY_HAVE_CONSOLE
+
+	return 0;
+}
@@ -825,6 +825,63 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
+// apply_patch_check_batch(file_1, sha1s_1, file_2, sha1s_2, ...)
+//    checks many files at once, as if apply_patch_check() had been
+//    called on each.  Each sha1s_n is a colon-separated list of
+//    acceptable sha1s (or "" to only require that the file exists).
+//    Files are hashed in parallel; returns "t" if every file passed,
+//    or "" (after logging which ones did not).
+Value* ApplyPatchCheckBatchFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    if (argc < 2 || argc % 2 != 0) {
+        return ErrorAbort(state, "%s(): expected file/sha1s pairs, got %d args",
+                          name, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    int count = argc / 2;
+    CheckEntry* entries = malloc(count * sizeof(CheckEntry));
+    int i;
+    for (i = 0; i < count; ++i) {
+        char* list = args[i*2+1];
+        int n = (list[0] == '\0') ? 0 : 1;
+        char* p;
+        for (p = list; *p; ++p) {
+            if (*p == ':') ++n;
+        }
+        entries[i].filename = args[i*2];
+        entries[i].num_sha1s = n;
+        entries[i].sha1s = malloc((n > 0 ? n : 1) * sizeof(char*));
+        int j = 0;
+        char* sha1 = strtok(list, ":");
+        while (sha1 != NULL && j < n) {
+            entries[i].sha1s[j++] = sha1;
+            sha1 = strtok(NULL, ":");
+        }
+        entries[i].num_sha1s = j;
+    }
+
+    int failed = applypatch_check_batch(entries, count, 4);
+    for (i = 0; i < count; ++i) {
+        if (entries[i].result != 0) {
+            fprintf(stderr, "%s(): \"%s\" failed\n", name, entries[i].filename);
+        }
+        free(entries[i].sha1s);
+    }
+    free(entries);
+
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+
+    return StringValue(strdup(failed == 0 ? "t" : ""));
+}
+
 Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) {
@@ -1025,6 +1082,7 @@ void RegisterInstallFunctions() {
 
     RegisterFunction("apply_patch", ApplyPatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
+    RegisterFunction("apply_patch_check_batch", ApplyPatchCheckBatchFn);
     RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
 
     RegisterFunction("read_file", ReadFileFn);
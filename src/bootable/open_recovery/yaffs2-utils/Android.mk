@@ -12,7 +12,7 @@ LOCAL_MODULE_TAGS := eng
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_PATH := $(TARGET_RECOVERY_OUT)
 LOCAL_UNSTRIPPED_PATH := $(TARGET_OUT_UNSTRIPPED)/recovery/
-LOCAL_STATIC_LIBRARIES := libc
+LOCAL_STATIC_LIBRARIES := libz libc
 include $(BUILD_EXECUTABLE)
 
 #open recovery yaffs2image
@@ -25,7 +25,7 @@ LOCAL_MODULE_TAGS := eng
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_PATH := $(TARGET_RECOVERY_OUT)
 LOCAL_UNSTRIPPED_PATH := $(TARGET_OUT_UNSTRIPPED)/recovery/
-LOCAL_STATIC_LIBRARIES := libc
+LOCAL_STATIC_LIBRARIES := libz libc
 include $(BUILD_EXECUTABLE)
 
 endif	# TARGET_ARCH == arm
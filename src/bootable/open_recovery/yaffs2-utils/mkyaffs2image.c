@@ -56,6 +56,9 @@ between directories /data/lost+found and /data/kernelpanics is that unlike
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <zlib.h>
 
 #include "yaffs_def.h"
 
@@ -74,15 +77,20 @@ typedef struct
 {
 	dev_t dev;
 	ino_t ino;
-	int   obj;
+	int   obj;	/* 0 marks an empty slot */
 } objItem;
 
 
 //#define printf (fmt,args...)	do { printf (fmt,## args); } while(0)
 //#define fprintf (stderr,fmt,args...)	do { fprintf (stderr,fmt,## args); } while(0)
 
-static objItem obj_list[MAX_OBJECTS];
-static int n_obj = 0;
+/* Objects seen so far, by (dev, ino), so that hard links can be found.
+ * This is an open-addressed hash table that doubles whenever it gets
+ * half full, so lookups and inserts stay O(1) and there is no fixed
+ * limit on the number of objects. */
+static objItem *obj_table = NULL;
+static unsigned obj_table_size = 0;
+static unsigned n_obj = 0;
 static int obj_id = YAFFS_NOBJECT_BUCKETS + 1;
 static int nObjects, nDirectories, nPages;
 static int outFile;
@@ -132,55 +140,81 @@ static int convert_endian = 1;
 static int convert_endian = 0;
 #endif
 
-static int obj_compare(const void *a, const void * b)
-{
-  objItem *oa, *ob;
-  
-  oa = (objItem *)a;
-  ob = (objItem *)b;
-  
-  if(oa->dev < ob->dev) return -1;
-  if(oa->dev > ob->dev) return 1;
-  if(oa->ino < ob->ino) return -1;
-  if(oa->ino > ob->ino) return 1;
-  
-  return 0;
+static unsigned obj_hash(dev_t dev, ino_t ino)
+{
+	unsigned long long k = ((unsigned long long)dev << 32) ^ (unsigned long long)ino;
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	return (unsigned)k;
+}
+
+static objItem *obj_slot(objItem *table, unsigned size, dev_t dev, ino_t ino)
+{
+	unsigned mask = size - 1;
+	unsigned i = obj_hash(dev, ino) & mask;
+
+	while(table[i].obj != 0 &&
+	      (table[i].dev != dev || table[i].ino != ino))
+	{
+		i = (i + 1) & mask;
+	}
+	return &table[i];
 }
 
+static void grow_obj_table(void)
+{
+	unsigned new_size = obj_table_size ? obj_table_size * 2 : 1024;
+	objItem *new_table = calloc(new_size, sizeof(objItem));
+	unsigned i;
+
+	if(new_table == NULL)
+	{
+		fprintf (stderr,"Not enough memory for object table\n");
+		exit(2);
+	}
+	for(i = 0; i < obj_table_size; i++)
+	{
+		if(obj_table[i].obj != 0)
+		{
+			*obj_slot(new_table, new_size, obj_table[i].dev, obj_table[i].ino) = obj_table[i];
+		}
+	}
+	free(obj_table);
+	obj_table = new_table;
+	obj_table_size = new_size;
+}
 
 static void add_obj_to_list(dev_t dev, ino_t ino, int obj)
 {
-	if(n_obj < MAX_OBJECTS)
+	objItem *slot;
+
+	if((n_obj + 1) * 2 > obj_table_size)
 	{
-		obj_list[n_obj].dev = dev;
-		obj_list[n_obj].ino = ino;
-		obj_list[n_obj].obj = obj;
-		n_obj++;
-		qsort(obj_list,n_obj,sizeof(objItem),obj_compare);		
+		grow_obj_table();
 	}
-	else
+	slot = obj_slot(obj_table, obj_table_size, dev, ino);
+	if(slot->obj == 0)
 	{
-		// oops! not enough space in the object array
-		fprintf (stderr,"Not enough space in object array\n");
-		exit(2);
+		n_obj++;
 	}
+	slot->dev = dev;
+	slot->ino = ino;
+	slot->obj = obj;
 }
 
 
 static int find_obj_in_list(dev_t dev, ino_t ino)
 {
-	objItem *i = NULL;
-	objItem test;
+	objItem *i;
 
-	test.dev = dev;
-	test.ino = ino;
-	
-	if(n_obj > 0)
+	if(n_obj == 0)
 	{
-		i = bsearch(&test,obj_list,n_obj,sizeof(objItem),obj_compare);
+		return -1;
 	}
 
-	if(i)
+	i = obj_slot(obj_table, obj_table_size, dev, ino);
+	if(i->obj != 0)
 	{
 		return i->obj;
 	}
@@ -281,13 +315,96 @@ void packTags2(yaffs_PackedTags2 * pt, const yaffs_ExtendedTags * t)
 	}
 }	
 
-static int write_chunk(__u8 *data, __u32 objId, __u32 chunkId, __u32 nBytes)
+/* Image pipeline.
+ *
+ * The directory scan (readdir, lstat, readlink and object ID
+ * assignment) runs on the main thread, exactly as it always has, and
+ * turns every object into a sequence of jobs: one for its header page
+ * and, for regular files, one per SEGMENT_CHUNKS chunks of data.  Header
+ * pages are built right away; data jobs are read and tagged by a pool of
+ * worker threads.  A single writer thread emits finished jobs strictly
+ * in the order they were queued, so the image is the same byte for byte
+ * whatever the number of workers.  At most MAX_JOBS jobs are in flight,
+ * which bounds memory use to a few megabytes.
+ *
+ * Each NAND page is CHUNK_SIZE bytes of data followed by SPARE_SIZE
+ * bytes of packed tags; the writer gathers pages into a large buffer and
+ * writes it out OUT_PAGES at a time.
+ *
+ * With -z the image is written gzip-compressed instead, as one gzip
+ * member per output buffer; gunzip and unyaffs read the members back as
+ * a single stream.  Full buffers are handed in rotation to a set of
+ * compressor threads and their output is written in the same rotation,
+ * so compression runs in parallel but the stream stays in order. */
+#define PAGE_SIZE_WITH_SPARE	(CHUNK_SIZE + SPARE_SIZE)
+#define OUT_PAGES		128
+#define SEGMENT_CHUNKS		64
+#define MAX_JOBS		64
+#define MAX_WORKERS		4
+#define OUT_BYTES		(OUT_PAGES * PAGE_SIZE_WITH_SPARE)
+
+typedef struct job
+{
+	__u8 *pages;
+	int npages;
+	int done;
+	char *log;		/* printed by the writer, in the order of the image */
+
+	/* data jobs only */
+	char *path;
+	int objId;
+	int firstChunk;		/* chunk ID of the first page */
+	int nChunks;		/* chunks to read, or -1 to read to the end */
+	int last;		/* last segment of its file */
+	unsigned nBytes;	/* data bytes read */
+	off_t fileSize;		/* size of the whole file when scanned */
+	int failed;		/* the file couldn't be read */
+
+	struct job *nextWork;
+} job;
+
+static pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
+static job *ring[MAX_JOBS];
+static unsigned next_seq, write_seq;
+static job *work_head, *work_tail;
+static int scan_finished;
+static int write_failed;	/* set by the writer, under q_lock */
+
+static __u8 *out_buf;
+static int out_pages;
+
+typedef struct compressor
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	z_stream strm;
+	__u8 *in;
+	size_t inLen;
+	__u8 *out;
+	size_t outSize, outLen;
+	int busy;		/* holds a buffer that isn't compressed yet */
+	int pending;		/* holds output that isn't written yet */
+	int failed;
+	int quit;
+} compressor;
+
+static int compress_level;	/* 0: write the image uncompressed */
+static compressor comp[MAX_WORKERS];
+static int nCompressors;
+static unsigned next_block;
+
+/* Pad any unused data in a page with 0xff and fill in its tags. */
+static void tag_page(__u8 *page, __u32 objId, __u32 chunkId, __u32 nBytes)
 {
 	yaffs_ExtendedTags t;
 	yaffs_PackedTags2 pt;
 
-	error = write(outFile,data,CHUNK_SIZE);
-	if(error < 0) return error;
+	if(nBytes < CHUNK_SIZE)
+	{
+		memset(page + nBytes, 0xff, CHUNK_SIZE - nBytes);
+	}
 
 	initialiseTags(&t);
 	
@@ -302,8 +419,7 @@ static int write_chunk(__u8 *data, __u32 objId, __u32 chunkId, __u32 nBytes)
 // added NCB **CHECK**
 	t.chunkUsed = 1;
 
-	nPages++;
-
+	memset(&pt, 0xff, sizeof(pt));
 	packTags2(&pt,&t);
 
 	if (convert_endian)
@@ -311,18 +427,427 @@ static int write_chunk(__u8 *data, __u32 objId, __u32 chunkId, __u32 nBytes)
 		little_to_big_endian(&pt);
 	}
 	
-//	return write(outFile,&pt,sizeof(yaffs_PackedTags2));
-	return write(outFile,&pt,SPARE_SIZE);
-	
+	memset(page + CHUNK_SIZE, 0xff, SPARE_SIZE);
+	memcpy(page + CHUNK_SIZE, &pt, sizeof(pt));
+}
+
+static void queue_job(job *j)
+{
+	pthread_mutex_lock(&q_lock);
+	while(next_seq - write_seq >= MAX_JOBS)
+	{
+		pthread_cond_wait(&q_cond, &q_lock);
+	}
+	ring[next_seq % MAX_JOBS] = j;
+	next_seq++;
+	if(!j->done)
+	{
+		j->nextWork = NULL;
+		if(work_tail) work_tail->nextWork = j; else work_head = j;
+		work_tail = j;
+	}
+	pthread_cond_broadcast(&q_cond);
+	pthread_mutex_unlock(&q_lock);
+}
+
+/* Read a segment of a file into pages.  Runs on a worker thread. */
+static void read_data_job(job *j)
+{
+	int room = j->nChunks >= 0 ? j->nChunks : SEGMENT_CHUNKS;
+	off_t offset = (off_t)(j->firstChunk - 1) * CHUNK_SIZE;
+	int h = open(j->path, O_RDONLY);
+
+	if(h < 0)
+	{
+		fprintf (stderr,"Error opening file %s: %s\n", j->path, strerror(errno));
+		j->failed = 1;
+		return;
+	}
+
+	j->pages = malloc(room * PAGE_SIZE_WITH_SPARE);
+	if(j->pages == NULL) j->failed = 1;
+	while(j->pages != NULL && (j->nChunks < 0 || j->npages < j->nChunks))
+	{
+		__u8 *page;
+		ssize_t n;
+
+		if(j->npages == room)
+		{
+			/* reading to the end of a file that has grown */
+			__u8 *bigger = realloc(j->pages, room * 2 * PAGE_SIZE_WITH_SPARE);
+			if(bigger == NULL)
+			{
+				j->failed = 1;
+				break;
+			}
+			j->pages = bigger;
+			room *= 2;
+		}
+		page = j->pages + j->npages * PAGE_SIZE_WITH_SPARE;
+		n = pread(h, page, CHUNK_SIZE, offset);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0)
+		{
+			fprintf (stderr,"Error reading %s: %s\n", j->path, strerror(errno));
+			j->failed = 1;
+			break;
+		}
+		if(n == 0) break;
+		tag_page(page, j->objId, j->firstChunk + j->npages, n);
+		j->npages++;
+		j->nBytes += n;
+		offset += n;
+	}
+	close(h);
+}
+
+static void *worker_thread(void *cookie)
+{
+	for(;;)
+	{
+		job *j;
+
+		pthread_mutex_lock(&q_lock);
+		while(work_head == NULL && !scan_finished)
+		{
+			pthread_cond_wait(&q_cond, &q_lock);
+		}
+		j = work_head;
+		if(j == NULL)
+		{
+			pthread_mutex_unlock(&q_lock);
+			break;
+		}
+		work_head = j->nextWork;
+		if(work_head == NULL) work_tail = NULL;
+		pthread_mutex_unlock(&q_lock);
+
+		read_data_job(j);
+
+		pthread_mutex_lock(&q_lock);
+		j->done = 1;
+		pthread_cond_broadcast(&q_cond);
+		pthread_mutex_unlock(&q_lock);
+	}
+	return NULL;
+}
+
+static int write_all(const __u8 *buf, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len)
+	{
+		ssize_t n = write(outFile, buf + done, len - done);
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static void *compressor_thread(void *cookie)
+{
+	compressor *c = cookie;
+
+	pthread_mutex_lock(&c->lock);
+	for(;;)
+	{
+		int ret;
+
+		while(!c->busy && !c->quit)
+		{
+			pthread_cond_wait(&c->cond, &c->lock);
+		}
+		if(!c->busy)
+		{
+			break;
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		deflateReset(&c->strm);
+		c->strm.next_in = c->in;
+		c->strm.avail_in = c->inLen;
+		c->strm.next_out = c->out;
+		c->strm.avail_out = c->outSize;
+		ret = deflate(&c->strm, Z_FINISH);
+
+		pthread_mutex_lock(&c->lock);
+		c->outLen = c->outSize - c->strm.avail_out;
+		c->failed = ret != Z_STREAM_END;
+		c->busy = 0;
+		c->pending = 1;
+		pthread_cond_signal(&c->cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+static int start_compressors(int n)
+{
+	for(nCompressors = 0; nCompressors < n; nCompressors++)
+	{
+		compressor *c = &comp[nCompressors];
+
+		memset(c, 0, sizeof(*c));
+		/* windowBits 15 + 16 asks zlib for a gzip wrapper */
+		if(deflateInit2(&c->strm, compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			break;
+		}
+		c->outSize = deflateBound(&c->strm, OUT_BYTES) + 32;
+		c->in = malloc(OUT_BYTES);
+		c->out = malloc(c->outSize);
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		if(c->in == NULL || c->out == NULL ||
+		   pthread_create(&c->thread, NULL, compressor_thread, c) != 0)
+		{
+			free(c->in);
+			free(c->out);
+			deflateEnd(&c->strm);
+			break;
+		}
+	}
+	return nCompressors > 0 ? 0 : -1;
+}
+
+static void stop_compressors(void)
+{
+	int i;
+
+	for(i = 0; i < nCompressors; i++)
+	{
+		compressor *c = &comp[i];
+
+		pthread_mutex_lock(&c->lock);
+		c->quit = 1;
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		pthread_join(c->thread, NULL);
+		free(c->in);
+		free(c->out);
+		deflateEnd(&c->strm);
+	}
+}
+
+/* Wait for a compressor to finish its buffer and write out the result. */
+static int drain_compressor(compressor *c)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	while(c->busy)
+	{
+		pthread_cond_wait(&c->cond, &c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if(c->pending)
+	{
+		if(c->failed)
+		{
+			fprintf (stderr,"Compression failed\n");
+			ret = -1;
+		}
+		else
+		{
+			ret = write_all(c->out, c->outLen);
+		}
+		c->pending = 0;
+	}
+	return ret;
+}
+
+static int flush_output(void)
+{
+	size_t len = (size_t)out_pages * PAGE_SIZE_WITH_SPARE;
+	compressor *c;
+	__u8 *in;
+	int ret;
+
+	out_pages = 0;
+	if(nCompressors == 0)
+	{
+		return write_all(out_buf, len);
+	}
+	if(len == 0)
+	{
+		return 0;
+	}
+
+	/* Blocks go round the compressors in order, so the block this
+	 * compressor last had is the oldest one not yet written. */
+	c = &comp[next_block++ % nCompressors];
+	ret = drain_compressor(c);
+
+	pthread_mutex_lock(&c->lock);
+	in = c->in;
+	c->in = out_buf;
+	c->inLen = len;
+	c->busy = 1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	out_buf = in;
+
+	return ret;
+}
+
+/* Write out everything still held by the compressors, oldest first. */
+static int drain_output(void)
+{
+	int ret = 0;
+	int i;
+
+	for(i = 0; i < nCompressors; i++)
+	{
+		if(drain_compressor(&comp[(next_block + i) % nCompressors]) < 0)
+		{
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int emit_pages(const __u8 *pages, int npages)
+{
+	if(out_pages + npages > OUT_PAGES && flush_output() < 0)
+	{
+		return -1;
+	}
+	if(npages >= OUT_PAGES && nCompressors == 0)
+	{
+		return write_all(pages, (size_t)npages * PAGE_SIZE_WITH_SPARE);
+	}
+	while(npages > 0)
+	{
+		int n = OUT_PAGES - out_pages;
+
+		if(n > npages) n = npages;
+		memcpy(out_buf + out_pages * PAGE_SIZE_WITH_SPARE, pages,
+		       (size_t)n * PAGE_SIZE_WITH_SPARE);
+		out_pages += n;
+		pages += n * PAGE_SIZE_WITH_SPARE;
+		npages -= n;
+		if(out_pages == OUT_PAGES && flush_output() < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void set_write_failed(void)
+{
+	pthread_mutex_lock(&q_lock);
+	write_failed = 1;
+	pthread_mutex_unlock(&q_lock);
+}
+
+static int has_write_failed(void)
+{
+	int failed;
+
+	pthread_mutex_lock(&q_lock);
+	failed = write_failed;
+	pthread_mutex_unlock(&q_lock);
+	return failed;
+}
+
+static void *writer_thread(void *cookie)
+{
+	off_t fileBytes = 0;
+	int fileChunks = 0;
+	int fileFailed = 0;
+
+	for(;;)
+	{
+		job *j;
+
+		pthread_mutex_lock(&q_lock);
+		while((write_seq == next_seq && !scan_finished) ||
+		      (write_seq != next_seq && !ring[write_seq % MAX_JOBS]->done))
+		{
+			pthread_cond_wait(&q_cond, &q_lock);
+		}
+		if(write_seq == next_seq)
+		{
+			pthread_mutex_unlock(&q_lock);
+			break;
+		}
+		j = ring[write_seq % MAX_JOBS];
+		pthread_mutex_unlock(&q_lock);
+
+		if(j->log)
+		{
+			fputs (j->log, stdout);
+		}
+		/* a file that couldn't be read would leave a hole in the image */
+		if(j->failed || (!write_failed && emit_pages(j->pages, j->npages) < 0))
+		{
+			set_write_failed();
+		}
+		nPages += j->npages;
+		if(j->path)
+		{
+			fileBytes += j->nBytes;
+			fileChunks += j->npages;
+			fileFailed |= j->failed;
+			if(j->last)
+			{
+				/* what was actually read, not what stat() said */
+				printf ("    > %d data chunks written, %u bytes\n",fileChunks,(unsigned)fileBytes);
+				if(!fileFailed && fileBytes != j->fileSize)
+				{
+					fprintf (stderr,"%s changed size while being read: %u bytes written\n",j->path,(unsigned)fileBytes);
+				}
+				fileBytes = 0;
+				fileChunks = 0;
+				fileFailed = 0;
+			}
+		}
+
+		pthread_mutex_lock(&q_lock);
+		ring[write_seq % MAX_JOBS] = NULL;
+		write_seq++;
+		pthread_cond_broadcast(&q_cond);
+		pthread_mutex_unlock(&q_lock);
+
+		free(j->pages);
+		free(j->path);
+		free(j->log);
+		free(j);
+	}
+
+	if(!write_failed && flush_output() < 0)
+	{
+		set_write_failed();
+	}
+	if(drain_output() < 0)
+	{
+		set_write_failed();
+	}
+	return NULL;
 }
 
 static int write_object_header(int objId, yaffs_ObjectType t, struct stat *s, int parent, const char *name, int equivalentObj, const char * alias, char *perm)
 {
-	__u8 bytes[CHUNK_SIZE];
+	job *j = calloc(1, sizeof(job));
+	__u8 *bytes = malloc(PAGE_SIZE_WITH_SPARE);
+
+	if(j == NULL || bytes == NULL)
+	{
+		free(j);
+		free(bytes);
+		return -1;
+	}
 	
 	yaffs_ObjectHeader *oh = (yaffs_ObjectHeader *)bytes;
 	
-	memset(bytes,0xff,sizeof(bytes));
+	memset(bytes,0xff,CHUNK_SIZE);
 	oh->type = t;
 	oh->parentObjectId = parent;
 	strncpy(oh->name,name,YAFFS_MAX_NAME_LENGTH);
@@ -360,10 +885,65 @@ static int write_object_header(int objId, yaffs_ObjectType t, struct stat *s, in
   	object_header_little_to_big_endian(oh);
 	}
 	
-	return write_chunk(bytes,objId,0,0xffff);
+	tag_page(bytes,objId,0,0xffff);
+	j->pages = bytes;
+	j->npages = 1;
+	j->done = 1;
+	queue_job(j);
+	return has_write_failed() ? -1 : 1;
 	
 }
 
+/* Queue a line for the log.  The writer prints it when it gets there,
+ * so the log follows the image even though the data is read ahead. */
+static void queue_log(const char *fmt, ...)
+{
+	char line[1200];
+	va_list ap;
+	job *j = calloc(1, sizeof(job));
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if(j == NULL || (j->log = strdup(line)) == NULL)
+	{
+		free(j);
+		fputs(line, stdout);
+		return;
+	}
+	j->done = 1;
+	queue_job(j);
+}
+
+/* Queue the data of a regular file, in segments of SEGMENT_CHUNKS
+ * chunks.  The last segment reads on to the end of the file, in case
+ * it has grown since it was stat()ed. */
+static int write_file_data(int objId, const char *full_name, off_t size)
+{
+	int total = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	int first = 1;
+	int last;
+
+	do
+	{
+		job *j = calloc(1, sizeof(job));
+		if(j == NULL) return -1;
+		last = total - (first - 1) <= SEGMENT_CHUNKS;
+		j->path = strdup(full_name);
+		j->objId = objId;
+		j->firstChunk = first;
+		j->nChunks = last ? -1 : SEGMENT_CHUNKS;
+		j->last = last;
+		j->fileSize = size;
+		/* the writer owns the job once it is queued */
+		queue_job(j);
+		first += SEGMENT_CHUNKS;
+	} while(!last);
+
+	/* the writer logs the chunks once the last segment is written */
+	return has_write_failed() ? -1 : 0;
+}
+
 
 static int process_directory(int parent, const char *path)
 {
@@ -385,6 +965,7 @@ static int process_directory(int parent, const char *path)
 			   strcmp(entry->d_name,".."))
  			{
  				char full_name[500];
+				char object[600];
 				struct stat stats;
 				int equivalentObj;
 				int newObj;
@@ -402,7 +983,7 @@ static int process_directory(int parent, const char *path)
 				    S_ISSOCK(stats.st_mode))
 				{
 					if (is_entry_exception (full_name)) {
-						printf ("<---- Path \"%s\" is in exceptions list. Skipping...\n", full_name);
+						queue_log ("<---- Path \"%s\" is in exceptions list. Skipping...\n", full_name);
 						continue;
 					}
 
@@ -410,13 +991,13 @@ static int process_directory(int parent, const char *path)
 					nObjects++;
 
 
-					printf ("+++> Object %d, %s is a ",newObj,full_name);
+					snprintf (object,sizeof(object),"+++> Object %d, %s is a ",newObj,full_name);
 					/* We're going to create an object for it */
 					if((equivalentObj = find_obj_in_list(stats.st_dev, stats.st_ino)) > 0)
 					{
 					 	/* we need to make a hard link */
 						error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_HARDLINK, &stats, parent, entry->d_name, equivalentObj, NULL, perm);
-					 	printf ("hard link to object %d\n",equivalentObj);
+					 	queue_log ("%shard link to object %d\n",object,equivalentObj);
 					}
 					else 
 					{	
@@ -429,69 +1010,43 @@ static int process_directory(int parent, const char *path)
 							memset(symname,0, sizeof(symname));
 							readlink(full_name,symname,sizeof(symname) -1);
 							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SYMLINK, &stats, parent, entry->d_name, -1, symname, perm);
-							printf ("symlink to \"%s\" %s\n", symname, perm);
+							queue_log ("%ssymlink to \"%s\" %s\n", object, symname, perm);
 						}
 						else if(S_ISREG(stats.st_mode))
 						{
 							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_FILE, &stats, parent, entry->d_name, -1, NULL, perm);
-							printf("file %s\n", perm);
+							queue_log ("%sfile %s\n", object, perm);
 							if(error >= 0)
 							{
-								int h;
-								__u8 bytes[CHUNK_SIZE];
-								int nBytes;
-								int chunk = 0;
-								unsigned int nTotal=0;
-								
-								h = open(full_name,O_RDONLY);
-								if(h >= 0)
-								{
-									memset(bytes,0xff,sizeof(bytes));
-									while((nBytes = read(h,bytes,sizeof(bytes))) > 0)
-									{
-										chunk++;
-										write_chunk(bytes,newObj,chunk,nBytes);
-										memset(bytes,0xff,sizeof(bytes));
-										nTotal += nBytes;
-									}
-									if(nBytes < 0) 
-									   error = nBytes;
-									   
-									printf ("    > %d data chunks written, %u bytes\n",chunk,nTotal);
-								}
-								else
-								{
-									fprintf (stderr,"Error opening file: %s", strerror(errno));
-								}
-								close(h);
-								
+								/* read and written by the worker and writer threads */
+								error = write_file_data(newObj, full_name, stats.st_size);
 							}							
 														
 						}
 						else if(S_ISSOCK(stats.st_mode))
 						{
 							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, perm);
-							printf ("socket %s\n", perm);
+							queue_log ("%ssocket %s\n", object, perm);
 						}
 						else if(S_ISFIFO(stats.st_mode))
 						{
 							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, perm);
-							printf ("fifo %s\n", perm);
+							queue_log ("%sfifo %s\n", object, perm);
 						}
 						else if(S_ISCHR(stats.st_mode))
 						{
 							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, perm);
-							printf ("character device %s\n", perm);
+							queue_log ("%scharacter device %s\n", object, perm);
 						}
 						else if(S_ISBLK(stats.st_mode))
 						{
 							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL, perm);
-							printf ("block device %s\n", perm);
+							queue_log ("%sblock device %s\n", object, perm);
 						}
 						else if(S_ISDIR(stats.st_mode))
 						{
 							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, parent, entry->d_name, -1, NULL, perm);
-							printf ("directory %s\n", perm);
+							queue_log ("%sdirectory %s\n", object, perm);
 // NCB modified 10/9/2001				process_directory(1,full_name);
 							process_directory(newObj,full_name);
 						}
@@ -499,7 +1054,7 @@ static int process_directory(int parent, const char *path)
 				}
 				else
 				{
-					printf (" we don't handle this type\n");
+					queue_log (" we don't handle this type\n");
 				}
 			}
 		}
@@ -515,13 +1070,25 @@ int main(int argc, char *argv[])
 {
   FILE *exclfp;
   struct stat stats;
+  pthread_t writer, workers[MAX_WORKERS];
+  int nWorkers, i;
+
+  while (argc > 1 && !strncmp (argv[1], "-z", 2))
+  {
+		compress_level = argv[1][2] ? atoi (argv[1] + 2) : 1;
+		if (compress_level < 1 || compress_level > 9)
+			compress_level = 1;
+		argv++;
+		argc--;
+	}
 
   if(argc < 3)
   {
 		fprintf(stderr,"mkyaffs2image: image building tool for YAFFS2 built "__DATE__"\n");
-		fprintf(stderr,"usage: mkyaffs2image [-f] dir image_file [convert] [exclude_file]\n");
+		fprintf(stderr,"usage: mkyaffs2image [-f] [-z[level]] dir image_file [convert] [exclude_file]\n");
+		fprintf(stderr,"         -z           write the image gzip-compressed (level 1-9, default 1)\n");
 		fprintf(stderr,"         dir          the directory tree to be converted\n");
-		fprintf(stderr,"         image_file   the output file to hold the image\n");
+		fprintf(stderr,"         image_file   the output file to hold the image, or - for stdout\n");
 		fprintf(stderr,"         'convert'    produce a big-endian image from a little-endian machine\n");
 		fprintf(stderr,"         exclude_file file with directories to exclude from image\n");
 		exit(1);
@@ -553,7 +1120,14 @@ int main(int argc, char *argv[])
 		exit (1);
 	}
 	
-  outFile = open (argv[2], O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);	
+  if (!strcmp (argv[2], "-"))
+  {
+		/* the image goes to stdout, so the log goes to stderr */
+		outFile = dup (1);
+		dup2 (2, 1);
+	}
+	else
+		outFile = open (argv[2], O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);	
   if(outFile < 0)
   {
 		fprintf (stderr,"Could not open output file %s\n",argv[2]);
@@ -563,10 +1137,53 @@ int main(int argc, char *argv[])
   printf ("Processing directory %s\n", argv[1]);
   if (nExcls ) printf ("Exceptions from %s\n", argv[3]);
   printf ("Result image file %s\n", argv[2]);
+  if (compress_level) printf ("Compressing with gzip level %d\n", compress_level);
+
+  nWorkers = sysconf (_SC_NPROCESSORS_ONLN);
+	if (nWorkers < 1) nWorkers = 1;
+	if (nWorkers > MAX_WORKERS) nWorkers = MAX_WORKERS;
+	out_buf = malloc (OUT_BYTES);
+	if (out_buf == NULL)
+	{
+		fprintf (stderr,"Could not allocate output buffer\n");
+		exit (1);
+	}
+	if (compress_level && start_compressors (nWorkers) < 0)
+	{
+		fprintf (stderr,"Could not start compressor threads\n");
+		exit (1);
+	}
+	if (pthread_create (&writer, NULL, writer_thread, NULL) != 0)
+	{
+		fprintf (stderr,"Could not start writer thread\n");
+		exit (1);
+	}
+	for (i = 0; i < nWorkers; i++)
+	{
+		if (pthread_create (&workers[i], NULL, worker_thread, NULL) != 0)
+			break;
+	}
+	nWorkers = i;
+	if (nWorkers == 0)
+	{
+		fprintf (stderr,"Could not start worker threads\n");
+		exit (1);
+	}
 
   error =  write_object_header (1, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, 1,"", -1, NULL, NULL);
   if(error)
 		error = process_directory (YAFFS_OBJECTID_ROOT,argv[1]);
+
+	pthread_mutex_lock (&q_lock);
+	scan_finished = 1;
+	pthread_cond_broadcast (&q_cond);
+	pthread_mutex_unlock (&q_lock);
+	for (i = 0; i < nWorkers; i++)
+		pthread_join (workers[i], NULL);
+	pthread_join (writer, NULL);
+	stop_compressors ();
+	if (write_failed)
+		error = -1;
 	
 	close(outFile);	
   if (error < 0)
@@ -9,151 +9,545 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "yaffs_def.h"
 
-char *obj_list[MAX_OBJECTS];
-unsigned char data[CHUNK_SIZE + SPARE_SIZE];
-unsigned char *chunk_data = data;
-unsigned char *spare_data = data + CHUNK_SIZE;
-int img_file;
+#define RECORD_SIZE	(CHUNK_SIZE + SPARE_SIZE)
+#define READ_RECORDS	128	/* records read from the image at a time */
+#define MAX_DEPTH	256	/* deepest directory nesting we follow */
 
-int read_chunk()
+#define MAX_WORKERS	16
+#define DEFAULT_WORKERS	4
+#define SMALL_FILE	(1024 * 1024)	/* larger files are written inline */
+#define MAX_QUEUED	(8 * 1024 * 1024)	/* file data waiting for workers */
+
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+/* The image is read READ_RECORDS records at a time. */
+gzFile img_file;	/* reads plain and gzip-compressed images alike */
+unsigned char *in_buf;
+int in_records, in_next;
+int read_failed;	/* the image could not be read to its end */
+
+/* Every object is kept as its parent's ID and its own name, rather than
+ * as a full path; paths are put together only when they are needed. */
+typedef struct {
+	int parent;
+	char *name;
+	int pending;	/* file not written yet; protected by q_lock */
+} obj_entry;
+
+obj_entry *obj_table;
+int obj_table_size;
+
+/* Restore pipeline.  The image is parsed on the main thread, which also
+ * creates directories, symlinks and hard links itself, so a parent
+ * always exists before anything is put in it.  Regular files up to
+ * SMALL_FILE bytes have their data copied out of the read buffer and
+ * are created, written and given their owner and mode by a pool of
+ * worker threads; larger files are written inline.  A hard link waits
+ * until the file it points to has been written. */
+typedef struct file_task {
+	int id;
+	char *path;
+	unsigned char *data;
+	unsigned int size;
+	unsigned uid, gid, mode;
+	struct file_task *next;
+} file_task;
+
+pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
+file_task *q_head, *q_tail;
+size_t q_bytes;
+int q_finished;
+int n_workers;
+int write_failed;	/* a worker failed to write a file */
+
+/* Return the next record of the image, or NULL at the end or if the
+ * image can't be read, in which case read_failed is set. */
+unsigned char *read_chunk()
+{
+	if (in_next == in_records) {
+		int s = gzread(img_file, in_buf, READ_RECORDS * RECORD_SIZE);
+		int err;
+		const char *msg = gzerror(img_file, &err);
+		if (s == -1 || (err != Z_OK && err != Z_STREAM_END)) {
+			fprintf(stderr, "read image file: %s\n",
+				err == Z_ERRNO ? strerror(errno) : msg);
+			read_failed = 1;
+			return NULL;
+		}
+		if (s % RECORD_SIZE) {
+			fprintf(stderr, "broken image file\n");
+			read_failed = 1;
+		}
+		in_records = s / RECORD_SIZE;
+		in_next = 0;
+		if (in_records == 0) {
+			printf("end of image\n");
+			return NULL;
+		}
+	}
+	return in_buf + RECORD_SIZE * in_next++;
+}
+
+int set_obj(int id, int parent, const char *name)
+{
+	if (id < 0)
+		return -1;
+	if (id >= obj_table_size) {
+		int size = obj_table_size ? obj_table_size : 1024;
+		obj_entry *table;
+
+		while (size <= id)
+			size *= 2;
+		/* workers update the pending flags under q_lock */
+		pthread_mutex_lock(&q_lock);
+		table = realloc(obj_table, size * sizeof(obj_entry));
+		if (table == NULL) {
+			pthread_mutex_unlock(&q_lock);
+			perror("grow object table\n");
+			return -1;
+		}
+		memset(table + obj_table_size, 0, (size - obj_table_size) * sizeof(obj_entry));
+		obj_table = table;
+		obj_table_size = size;
+		pthread_mutex_unlock(&q_lock);
+	}
+	free(obj_table[id].name);
+	obj_table[id].parent = parent;
+	obj_table[id].name = strdup(name);
+	return obj_table[id].name ? 0 : -1;
+}
+
+/* Build the full path of an object into buf.  Return 0 on success. */
+int obj_path(int id, char *buf, size_t size)
 {
-	ssize_t s;
-	int ret = -1;
-	memset(chunk_data, 0xff, sizeof(chunk_data));
-	s = read(img_file, data, CHUNK_SIZE + SPARE_SIZE);
-	if (s == -1) {
-		perror("read image file\n");
-	} else if (s == 0) {
-		printf("end of image\n");
-	} else if ((s == (CHUNK_SIZE + SPARE_SIZE))) {
-		ret = 0;
-	} else {
-		fprintf(stderr, "broken image file\n");
+	int chain[MAX_DEPTH];
+	int depth = 0;
+	size_t len = 0;
+
+	for (;;) {
+		if (id < 0 || id >= obj_table_size || obj_table[id].name == NULL ||
+		    depth == MAX_DEPTH)
+			return -1;
+		chain[depth++] = id;
+		if (id == YAFFS_OBJECTID_ROOT)
+			break;
+		id = obj_table[id].parent;
 	}
+
+	while (depth-- > 0) {
+		const char *name = obj_table[chain[depth]].name;
+		size_t n = strlen(name);
+
+		if (len + n + 2 > size)
+			return -1;
+		if (len)
+			buf[len++] = '/';
+		memcpy(buf + len, name, n);
+		len += n;
+	}
+	buf[len] = '\0';
+	return 0;
+}
+
+/* Write out iov[0..count), coping with short writes. */
+int writev_all(int fd, struct iovec *iov, int count)
+{
+	while (count > 0) {
+		ssize_t n = writev(fd, iov, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Copy a file's data chunks to out_file.  The data is written straight
+ * from the read buffer, with one writev() per buffer instead of one
+ * write() per chunk. */
+int write_file_data(int out_file, unsigned int remain)
+{
+	struct iovec iov[IOV_MAX];
+	int count = 0;
+	int ret = 0;
+
+	while (remain > 0) {
+		unsigned char *chunk;
+		yaffs_PackedTags2 *pt;
+		unsigned int s;
+
+		/* the next read reuses the buffer the pending data is in */
+		if (in_next == in_records || count == IOV_MAX) {
+			if (writev_all(out_file, iov, count))
+				ret = -1;
+			count = 0;
+		}
+		if ((chunk = read_chunk()) == NULL)
+			return -1;
+		pt = (yaffs_PackedTags2 *)(chunk + CHUNK_SIZE);
+		if (pt->t.byteCount > CHUNK_SIZE) {
+			fprintf(stderr, "broken data chunk\n");
+			return -1;
+		}
+		s = (remain < pt->t.byteCount) ? remain : pt->t.byteCount;
+		iov[count].iov_base = chunk;
+		iov[count].iov_len = s;
+		count++;
+		remain -= s;
+	}
+	if (writev_all(out_file, iov, count))
+		ret = -1;
 	return ret;
 }
 
-int process_chunk()
+/* Copy up to size bytes of a file's data chunks into buf.  Return the
+ * number of bytes copied, or -1 if the image ends early or is broken. */
+int read_file_data(unsigned char *buf, unsigned int size)
 {
-	int out_file, s;
-	unsigned int remain;
-	char *full_path_name;
+	unsigned int done = 0;
+
+	while (done < size) {
+		unsigned char *chunk;
+		yaffs_PackedTags2 *pt;
+		unsigned int s;
+
+		if ((chunk = read_chunk()) == NULL)
+			return -1;
+		pt = (yaffs_PackedTags2 *)(chunk + CHUNK_SIZE);
+		if (pt->t.byteCount > CHUNK_SIZE) {
+			fprintf(stderr, "broken data chunk\n");
+			return -1;
+		}
+		s = (size - done < pt->t.byteCount) ? size - done : pt->t.byteCount;
+		memcpy(buf + done, chunk, s);
+		done += s;
+	}
+	return done;
+}
+
+int write_all(int fd, const unsigned char *buf, unsigned int len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Write out a queued file.  Return 0 on success. */
+int finish_file(file_task *t)
+{
+	int ret = 0;
+	int out_file = creat(t->path, 0777); //set the owner & permissions later
+	if (out_file == -1 || write_all(out_file, t->data, t->size)) {
+		fprintf(stderr, "Failure writing %s: %s\n", t->path, strerror(errno));
+		ret = -1;
+	}
+	if (out_file != -1 && close(out_file)) {
+		fprintf(stderr, "Failure writing %s: %s\n", t->path, strerror(errno));
+		ret = -1;
+	}
+
+	if (chown(t->path, t->uid, t->gid))
+		printf("Failure setting the owner.\n");
+
+	if (chmod(t->path, t->mode))
+		printf("Failure setting the permissions.\n");
+	return ret;
+}
+
+void *worker_thread(void *cookie)
+{
+	pthread_mutex_lock(&q_lock);
+	for (;;) {
+		file_task *t;
+
+		while (q_head == NULL && !q_finished)
+			pthread_cond_wait(&q_cond, &q_lock);
+		if ((t = q_head) == NULL)
+			break;
+		q_head = t->next;
+		if (q_head == NULL)
+			q_tail = NULL;
+		pthread_mutex_unlock(&q_lock);
+
+		int failed = finish_file(t);
+
+		pthread_mutex_lock(&q_lock);
+		if (failed)
+			write_failed = 1;
+		q_bytes -= t->size;
+		if (t->id < obj_table_size)
+			obj_table[t->id].pending = 0;
+		pthread_cond_broadcast(&q_cond);
+		free(t->path);
+		free(t->data);
+		free(t);
+	}
+	pthread_mutex_unlock(&q_lock);
+	return NULL;
+}
+
+/* Hand a file to the workers, waiting while too much data is queued. */
+void queue_file(file_task *t)
+{
+	pthread_mutex_lock(&q_lock);
+	while (q_bytes > 0 && q_bytes + t->size > MAX_QUEUED)
+		pthread_cond_wait(&q_cond, &q_lock);
+	q_bytes += t->size;
+	obj_table[t->id].pending = 1;
+	t->next = NULL;
+	if (q_tail)
+		q_tail->next = t;
+	else
+		q_head = t;
+	q_tail = t;
+	pthread_cond_broadcast(&q_cond);
+	pthread_mutex_unlock(&q_lock);
+}
+
+/* Wait until the workers have written an object, if it is queued. */
+void wait_for_obj(int id)
+{
+	pthread_mutex_lock(&q_lock);
+	while (id >= 0 && id < obj_table_size && obj_table[id].pending)
+		pthread_cond_wait(&q_cond, &q_lock);
+	pthread_mutex_unlock(&q_lock);
+}
+
+/* Extract a regular file whose header has just been read. */
+int process_file(int id, const char *path, yaffs_ObjectHeader *oh)
+{
+	file_task *t;
+	int out_file, ret;
+
+	if (n_workers > 0 && oh->fileSize <= SMALL_FILE &&
+	    (t = calloc(1, sizeof(file_task))) != NULL) {
+		t->id = id;
+		t->path = strdup(path);
+		t->data = malloc(oh->fileSize ? oh->fileSize : 1);
+		t->uid = oh->yst_uid;
+		t->gid = oh->yst_gid;
+		t->mode = oh->yst_mode;
+		ret = t->data ? read_file_data(t->data, oh->fileSize) : -1;
+		if (ret < 0 || t->path == NULL) {
+			free(t->path);
+			free(t->data);
+			free(t);
+			return -1;
+		}
+		t->size = ret;
+		queue_file(t);
+		return 0;
+	}
+
+	out_file = creat(path, 0777); //set the owner & permissions later
+	if (out_file == -1)
+		fprintf(stderr, "Failure creating %s: %s\n", path, strerror(errno));
+	ret = write_file_data(out_file, oh->fileSize);
+	if (out_file != -1 && close(out_file))
+		ret = -1;
+	if (ret) {
+		fprintf(stderr, "Failure writing %s\n", path);
+		return -1;
+	}
+
+	if (chown(path, oh->yst_uid, oh->yst_gid))
+		printf("Failure setting the owner.\n");
+
+	if (chmod(path, oh->yst_mode))
+		printf("Failure setting the permissions.\n");
+	return 0;
+}
+
+int process_chunk(unsigned char *chunk)
+{
+	char full_path_name[PATH_MAX];
+	char equiv_path_name[PATH_MAX];
 	int do_chmod;
-	
-	yaffs_PackedTags2 *pt = (yaffs_PackedTags2 *)spare_data;
-	if (pt->t.byteCount == 0xffff)  {	//a new object 
+	int ret = 0;
+
+	yaffs_PackedTags2 *pt = (yaffs_PackedTags2 *)(chunk + CHUNK_SIZE);
+	if (pt->t.byteCount == 0xffff)  {	//a new object
 
-		yaffs_ObjectHeader *oh = (yaffs_ObjectHeader *)malloc(sizeof(yaffs_ObjectHeader));
-		memcpy(oh, chunk_data, sizeof(yaffs_ObjectHeader));
+		yaffs_ObjectHeader oh;
+		memcpy(&oh, chunk, sizeof(yaffs_ObjectHeader));
+		oh.name[YAFFS_MAX_NAME_LENGTH] = '\0';
+		oh.alias[YAFFS_MAX_ALIAS_LENGTH] = '\0';
 
-		full_path_name = (char *)malloc(strlen(oh->name) + strlen(obj_list[oh->parentObjectId]) + 2);
-		if (full_path_name == NULL) {
-			perror("malloc full path name\n");
+		/* the root keeps the extraction directory as its name */
+		if ((pt->t.objectId != YAFFS_OBJECTID_ROOT &&
+		     set_obj(pt->t.objectId, oh.parentObjectId, oh.name)) ||
+		    obj_path(pt->t.objectId, full_path_name, sizeof(full_path_name))) {
+			fprintf(stderr, "bad path for object %u\n", pt->t.objectId);
+			return -1;
 		}
-		strcpy(full_path_name, obj_list[oh->parentObjectId]);
-		strcat(full_path_name, "/");
-		strcat(full_path_name, oh->name);
-		obj_list[pt->t.objectId] = full_path_name;
 		do_chmod = 1;
 
-		switch(oh->type) {
+		switch(oh.type) {
 			case YAFFS_OBJECT_TYPE_FILE:
-				remain = oh->fileSize;
-				out_file = creat(full_path_name, 0777); //set the owner & permissions later
-				printf("File: %s %u %u %o\n", oh->name, oh->yst_uid, oh->yst_gid, oh->yst_mode);
-				while(remain > 0) {
-					if (read_chunk())
-						return -1;
-					s = (remain < pt->t.byteCount) ? remain : pt->t.byteCount;	
-					if (write(out_file, chunk_data, s) == -1)
-						return -1;
-					remain -= s;
-				}
-				close(out_file);						
-				break;
+				printf("File: %s %u %u %o\n", oh.name, oh.yst_uid, oh.yst_gid, oh.yst_mode);
+				/* sets the owner & permissions itself */
+				return process_file(pt->t.objectId, full_path_name, &oh);
 			case YAFFS_OBJECT_TYPE_SYMLINK:
-				symlink(oh->alias, full_path_name);
-				printf("Symlink: %s %u %u %o\n", oh->name, oh->yst_uid, oh->yst_gid, oh->yst_mode);
+				if (symlink(oh.alias, full_path_name)) {
+					fprintf(stderr, "Failure creating %s: %s\n", full_path_name, strerror(errno));
+					ret = -1;
+				}
+				printf("Symlink: %s %u %u %o\n", oh.name, oh.yst_uid, oh.yst_gid, oh.yst_mode);
 				do_chmod = 0;
 				break;
 			case YAFFS_OBJECT_TYPE_DIRECTORY:
-				mkdir(full_path_name, 0777); //set the owner & permissions later
-				printf("Directory: %s %u %u %o\n", oh->name, oh->yst_uid, oh->yst_gid, oh->yst_mode);
+				//set the owner & permissions later
+				if (mkdir(full_path_name, 0777) && errno != EEXIST) {
+					fprintf(stderr, "Failure creating %s: %s\n", full_path_name, strerror(errno));
+					ret = -1;
+				}
+				printf("Directory: %s %u %u %o\n", oh.name, oh.yst_uid, oh.yst_gid, oh.yst_mode);
 				break;
 			case YAFFS_OBJECT_TYPE_HARDLINK:
-				link(obj_list[oh->equivalentObjectId], full_path_name);
-				printf("Hardlink: %s %u %u %o\n", oh->name, oh->yst_uid, oh->yst_gid, oh->yst_mode);
+				if (obj_path(oh.equivalentObjectId, equiv_path_name, sizeof(equiv_path_name))) {
+					fprintf(stderr, "bad hard link target for %s\n", full_path_name);
+					ret = -1;
+				} else {
+					wait_for_obj(oh.equivalentObjectId);
+					if (link(equiv_path_name, full_path_name)) {
+						fprintf(stderr, "Failure creating %s: %s\n", full_path_name, strerror(errno));
+						ret = -1;
+					}
+				}
+				printf("Hardlink: %s %u %u %o\n", oh.name, oh.yst_uid, oh.yst_gid, oh.yst_mode);
 				break;
 			case YAFFS_OBJECT_TYPE_SPECIAL:
 				printf("Special object skipped.\n");
 				return 1;
 			case YAFFS_OBJECT_TYPE_UNKNOWN:
 				printf("Unknown object skipped.\n");
-				return 1;			
+				return 1;
 		}
-		
-		if (chown(full_path_name, oh->yst_uid, oh->yst_gid))
+
+		if (chown(full_path_name, oh.yst_uid, oh.yst_gid))
 			printf("Failure setting the owner.\n");
-		
+
 		if (do_chmod)
-			if (chmod(full_path_name, oh->yst_mode))
+			if (chmod(full_path_name, oh.yst_mode))
 				printf("Failure setting the permissions.\n");
 	}
-	
-	return 0;
+
+	return ret;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 3) 
+	unsigned char *chunk;
+	pthread_t workers[MAX_WORKERS];
+	int i;
+	int failed = 0;
+
+	n_workers = DEFAULT_WORKERS;
+	if (argc == 5 && !strcmp(argv[1], "-j"))
 	{
-		printf("Usage: unyaffs image_file_name dir_to_extract\n");
+		n_workers = atoi(argv[2]);
+		if (n_workers < 0)
+			n_workers = 0;
+		if (n_workers > MAX_WORKERS)
+			n_workers = MAX_WORKERS;
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc != 3)
+	{
+		printf("Usage: unyaffs [-j threads] image_file_name dir_to_extract\n");
+		printf("       -j 0 extracts everything on one thread\n");
+		printf("       image_file_name - reads the image from stdin\n");
 		exit(1);
 	}
-	
-	img_file = open(argv[1], O_RDONLY);
-	if (img_file == -1) 
+
+	if (!strcmp(argv[1], "-"))
+		img_file = gzdopen(0, "rb");
+	else
+		img_file = gzopen(argv[1], "rb");
+	in_buf = malloc(READ_RECORDS * RECORD_SIZE);
+	if (img_file == NULL || in_buf == NULL)
 	{
 		printf("open image file failed\n");
 		exit(1);
 	}
 
 	char* dirName = argv[2];
-	char rootPath[100];
-	
+	char rootPath[PATH_MAX];
+
 	if (dirName[0] == '.' && dirName[1] == '/' )
 		dirName+=2;
-	
+
 	int dirCreat = mkdir(dirName, 0777);
 	if (dirCreat == -1 && errno != EEXIST)
 	{
 		printf("create dir to extract failed\n");
 		exit(1);
 	}
-	
+
 	if (dirName[0] != '/')
-		sprintf(rootPath, "./%s", argv[2]);
+		snprintf(rootPath, sizeof(rootPath), "./%s", argv[2]);
 	else
-		strcpy(rootPath, dirName);
-		
-	obj_list[YAFFS_OBJECTID_ROOT] = rootPath;
-	
-	while(1) 
-	{
-		if (read_chunk() == -1)
+		snprintf(rootPath, sizeof(rootPath), "%s", dirName);
+
+	set_obj(YAFFS_OBJECTID_ROOT, YAFFS_OBJECTID_ROOT, rootPath);
+
+	for (i = 0; i < n_workers; i++)
+		if (pthread_create(&workers[i], NULL, worker_thread, NULL) != 0)
 			break;
-		process_chunk();
+	n_workers = i;
+
+	while((chunk = read_chunk()) != NULL)
+		if (process_chunk(chunk) < 0)
+			failed = 1;
+
+	pthread_mutex_lock(&q_lock);
+	q_finished = 1;
+	pthread_cond_broadcast(&q_cond);
+	pthread_mutex_unlock(&q_lock);
+	for (i = 0; i < n_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	gzclose(img_file);
+	if (failed || read_failed || write_failed)
+	{
+		fprintf(stderr, "unyaffs: the image was not fully extracted\n");
+		return 1;
 	}
-	
-	close(img_file);
 	return 0;
 }